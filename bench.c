@@ -0,0 +1,183 @@
+/* bench - time the scan over all services nitro does on every wakeup
+
+   Usage: bench [SERVICES...]  (default: 500 5000)
+
+   Builds a service table of UP services without timers and runs
+   poll_services() on it, once with the table in cache, and once
+   after evicting it, which is the usual case for a supervisor that
+   sleeps most of the time.  For comparison, the same is done with
+   the table and scan of the baseline nitro (struct service and main
+   loop of commit 4ccb7bb). */
+
+#define main nitro_main
+#include "nitro.c"
+#undef main
+
+#include <stdio.h>
+
+#define EVICT_SIZE (64 << 20)
+
+static char evict[EVICT_SIZE];
+
+/* struct service of the baseline */
+struct old_service {
+	char name[64];
+	deadline startstop;
+	deadline deadline;
+	int timeout;
+	pid_t pid;
+	pid_t setuppid;
+	pid_t finishpid;
+	int wstatus;
+	int log_out[2];
+	int log_in[2];
+	int readypipe;
+	char state;
+	char seen;
+};
+
+static struct old_service *old_services;
+static int expired;
+
+/* the per-service part of the baseline main loop; its timeouts
+   would call process_step, which is only counted here */
+static int
+old_poll_services(deadline now, int *timeout)
+{
+	int max_fd = FIXFD;
+
+	for (int i = 0; i < max_service; i++) {
+		if (old_services[i].readypipe != -1) {
+			fds[max_fd].fd = old_services[i].readypipe;
+			fds[max_fd].events = POLLIN;
+			max_fd++;
+		}
+
+		if (old_services[i].timeout <= 0)
+			continue;
+
+		if (old_services[i].deadline == 0)
+			old_services[i].deadline = now + old_services[i].timeout;
+
+		if (old_services[i].deadline <= now) {
+			expired++;
+			continue;
+		}
+
+		int64_t wait_for = old_services[i].deadline - now;
+		if (wait_for > 0) {
+			if (*timeout == -1 || (wait_for < *timeout))
+				*timeout = wait_for;
+		}
+	}
+
+	return max_fd;
+}
+
+static double
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+setup(int n)
+{
+	char name[64];
+
+	max_service = 0;
+	for (int k = 0; k < n; k++) {
+		snprintf(name, sizeof name, "service%d", k);
+		int i = new_service(name);
+		if (i < 0) {
+			fprintf(stderr, "bench: can't add service %d\n", k);
+			exit(1);
+		}
+		services[i].state = PROC_UP;
+		services[i].timeout = 0;
+		services[i].pid = 100000 + k;
+		services[i].log_out[0] = services[i].log_out[1] = -1;
+
+		memset(&old_services[i], 0, sizeof old_services[i]);
+		snprintf(old_services[i].name, sizeof old_services[i].name,
+		    "%s", name);
+		old_services[i].state = PROC_UP;
+		old_services[i].pid = 100000 + k;
+		old_services[i].log_out[0] = old_services[i].log_out[1] = -1;
+		old_services[i].log_in[0] = old_services[i].log_in[1] = -1;
+		old_services[i].readypipe = -1;
+	}
+}
+
+static void
+measure(const char *layout, int (*scan)(deadline, int *), int n,
+    size_t size)
+{
+	deadline now = time_now();
+	int timeout = -1;
+	int rounds = 20000000 / n;
+	double best = 0;
+
+	/* warm: the table stays in cache between scans */
+	for (int t = 0; t < 5; t++) {
+		double start = now_ns();
+		for (int r = 0; r < rounds; r++)
+			scan(now, &timeout);
+		double ns = (now_ns() - start) / rounds / n;
+		if (!best || ns < best)
+			best = ns;
+	}
+	printf("%5d services, %-4s layout: warm %6.2f ns/service",
+	    n, layout, best);
+
+	/* cold: evict the table before each scan */
+	double total = 0;
+	int cold_rounds = 50;
+	for (int r = 0; r < cold_rounds; r++) {
+		memset(evict, r, sizeof evict);
+		double start = now_ns();
+		scan(now, &timeout);
+		total += now_ns() - start;
+	}
+	printf("  cold %6.2f ns/service  (%zu bytes/service)\n",
+	    total / cold_rounds / n, size);
+}
+
+static void
+run(int n)
+{
+	setup(n);
+	measure("old", old_poll_services, n, sizeof old_services[0]);
+	measure("new", poll_services, n, sizeof services[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char maxsv_env[32];
+	int most = 5000;
+	for (int a = 1; a < argc; a++)
+		if (atoi(argv[a]) > most)
+			most = atoi(argv[a]);
+	snprintf(maxsv_env, sizeof maxsv_env, "%d", most + 1);
+	setenv("NITRO_MAXSV", maxsv_env, 1);
+
+	arena_setup();
+	global_state = GLBL_UP;
+	old_services = calloc(most + 1, sizeof *old_services);
+	if (!old_services) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+
+	if (argc < 2) {
+		run(500);
+		run(5000);
+	}
+	for (int a = 1; a < argc; a++)
+		run(atoi(argv[a]));
+
+	return 0;
+}
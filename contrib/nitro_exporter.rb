@@ -18,9 +18,15 @@ class NitroExporter
       r.write %Q|nitro_up{hostname=#{HOSTNAME_DUMP}} 1\n|
       state.each_line { |line|
         case line
-        when /^([A-Z]+) (.*?) (\(pid \d+\) )?\(wstatus (\d+)\) (\d+)s$/
-          r.write %Q|nitro_state{hostname=#{HOSTNAME_DUMP},service=#{$2.dump},state=#{$1.dump}} #{$5}\n|
-          r.write %Q|nitro_wstatus{hostname=#{HOSTNAME_DUMP},service=#{$2.dump}} #{$4}\n|  if $4
+        when /^([A-Z]+) (.*?) (\(pid \d+\) )?\(wstatus (\d+)\) (\d+)s( .*)?$/
+          name, extra = $2, $6
+          r.write %Q|nitro_state{hostname=#{HOSTNAME_DUMP},service=#{name.dump},state=#{$1.dump}} #{$5}\n|
+          r.write %Q|nitro_wstatus{hostname=#{HOSTNAME_DUMP},service=#{name.dump}} #{$4}\n|  if $4
+          if extra =~ /\(pipe (\d+)(?:\/(\d+))? max (\d+)\)/
+            r.write %Q|nitro_log_pipe_pending_bytes{hostname=#{HOSTNAME_DUMP},service=#{name.dump}} #{$1}\n|
+            r.write %Q|nitro_log_pipe_size_bytes{hostname=#{HOSTNAME_DUMP},service=#{name.dump}} #{$2}\n|  if $2
+            r.write %Q|nitro_log_pipe_max_bytes{hostname=#{HOSTNAME_DUMP},service=#{name.dump}} #{$3}\n|
+          end
         end
       }
 
@@ -5,14 +5,19 @@
 #define _GNU_SOURCE
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #ifdef __linux__
+#include <sys/inotify.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
 #include <sys/reboot.h>
 #endif
 #ifdef __NetBSD__
@@ -25,6 +30,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
 #include <paths.h>
 #include <poll.h>
@@ -50,6 +56,50 @@
 #define TIMEOUT_SIGKILL 7000     /* max wait after SIGKILL */
 #define TIMEOUT_SYS_FINISH 30000 /* ms before killing SYS/finish */
 #define TIMEOUT_SYS_FINAL 30000  /* ms before killing SYS/final */
+#define LOG_SAMPLE_INTERVAL 0  /* ms between log pipe fill level samples */
+#define CHECK_INTERVAL 10        /* s between runs of ./check */
+#define CHECK_TIMEOUT 5          /* s before killing ./check */
+#define CHECK_FAILURES 3         /* failed checks in a row until restart */
+#define PROBE_RETRY 100          /* ms between probes of a STARTING service */
+#define PROBE_TIMEOUT 1000       /* ms until a probe of a STARTING service fails */
+#define SCHED_LATE 60            /* s after which a calendar run was missed */
+#define SCHED_RECHECK 60000      /* ms between looks at the wall clock */
+#define ROLLOUT_TIMEOUT 300      /* s an instance may take to restart in a rollout */
+
+#ifndef LOGBUF_SLOTS
+#define LOGBUF_SLOTS 16          /* services that can use ./log-buffer */
+#endif
+#ifndef LOGBUF_SIZE
+#define LOGBUF_SIZE 16384        /* bytes of output kept per service */
+#endif
+#if LOGBUF_SIZE > 65534
+#error LOGBUF_SIZE must fit into a single SPAT packet
+#endif
+
+#ifndef MAXLISTEN
+#define MAXLISTEN 4              /* sockets per service in ./listen */
+#endif
+#ifndef MAXFDSTORE
+#define MAXFDSTORE 8             /* fds a service can store in nitro */
+#endif
+#ifndef MAXTRIGGER
+#define MAXTRIGGER 4             /* paths per service in ./trigger */
+#endif
+
+#ifndef MAXTRANSIENT
+#define MAXTRANSIENT 16          /* services created by nitroctl run */
+#endif
+#ifndef TRANSIENT_SIZE
+#define TRANSIENT_SIZE 4096      /* bytes of arguments and environment each */
+#endif
+#define TRANSIENT_ARGS 64        /* arguments, and variables, of each */
+#define CTLMSG_SIZE (TRANSIENT_SIZE + 4*TRANSIENT_ARGS + 256)
+#define REPLY_PAGE 16384         /* bytes of a list reply, nitroctl asks for more */
+
+#ifndef MAXSCALE
+#define MAXSCALE 16              /* templates scaled with nitroctl scale */
+#endif
+#define MAXWAITERS 32            /* clients waiting for services or groups */
 
 /* no stdio */
 #ifdef DEBUG
@@ -65,24 +115,17 @@ char **child_environ;
 #define ENVSIZE 64
 char *envbuf[ENVSIZE+1];
 
-typedef int64_t deadline;               /* milliseconds since boot */
-
-deadline
-time_now()
+/* lower the poll timeout to wait at most until d */
+static void
+wait_until(int *timeout, deadline d, deadline now)
 {
-	struct timespec now;
-
-	/* prefer a clock that does *not* count time during suspend, as we
-	   are measuring delays */
-#if defined(CLOCK_UPTIME)
-	clock_gettime(CLOCK_UPTIME, &now);
-#elif defined(CLOCK_UPTIME_RAW)
-	clock_gettime(CLOCK_UPTIME_RAW, &now);
-#else
-	clock_gettime(CLOCK_MONOTONIC, &now);
-#endif
-
-	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	int64_t wait_for = d - now;
+	if (wait_for < 0)
+		wait_for = 0;
+	if (wait_for > INT_MAX)
+		wait_for = INT_MAX;
+	if (*timeout == -1 || wait_for < *timeout)
+		*timeout = wait_for;
 }
 
 enum global_state {
@@ -102,30 +145,162 @@ enum process_events {
 	EVNT_SETUP,             /* setup script exited */
 	EVNT_EXITED,
 	EVNT_FINISHED,          /* finish script exited */
+	EVNT_ACTIVATE,          /* connection on a socket of ./listen */
+};
+
+union sockaddr_any {
+	struct sockaddr sa;
+	struct sockaddr_un un;
+	struct sockaddr_in in;
 };
 
+#define SV_LOG 1                /* the LOG service */
+#define SV_SYS 2                /* the SYS service */
+#define SV_INSTANCE 4           /* an instance of a template */
+#define SV_LOG_INSTANCE 8       /* an instance of LOG@ */
+
+/* The fields poll_services looks at for every service on every wakeup
+   fill the first 64 bytes, so a scan of a service not using any timers
+   touches a single cache line of it. */
 struct service {
-	char name[64];
-	deadline startstop;
-	deadline deadline;
+	/* hot: checked on every scan */
+	deadline idle_deadline; /* when to stop the idle service */
+	deadline oldkill;       /* when to kill oldpid */
 	int timeout;
 	pid_t pid;
-	pid_t setuppid;
-	pid_t finishpid;
-	int wstatus;
-	int log_out[2];         /* process writes to log_out[1] */
-	int log_in[2];          /* process reads from log_in[0] */
 	int readypipe;          /* process writes to readypipe when ready */
+	short ring;             /* index into rings + 1, or 0 */
+	short transient;        /* index into transients + 1, or 0 */
+	int watchdog;           /* ms the process may go without a ping */
+	pid_t checkpid;         /* running ./check */
+	int check_interval;     /* ms between checks, 0 without ./check */
+	int probefd;            /* connect to probe_addr in progress, or -1 */
+	socklen_t probe_addrlen;       /* 0 without ./probe */
+	pid_t status_pid;       /* pid and state last published to status */
 #ifdef DEBUG
 	enum process_state state;
 #else
 	char /* enum process_state */ state;
 #endif
 	char seen;
-} services[MAXSV];
+	char ondemand;          /* start on first connection when DOWN */
+	char scheduled;         /* has ./schedule, run by the clock */
+	uint8_t status_state;
+
+	/* warm: timers of services that use them, and reaping */
+	deadline deadline;
+	deadline watchdog_ping; /* when the process last pinged the watchdog */
+	deadline check_start;
+	deadline check_next;    /* when to run ./check again */
+	deadline probe_start;
+	deadline probe_next;    /* when to connect to probe_addr again */
+	deadline sched_next;    /* when to run next */
+	time_t sched_wall;      /* wall clock time of sched_next, or 0 */
+	pid_t setuppid;
+	pid_t finishpid;
+	pid_t oldpid;           /* previous instance during an overlapping restart */
+	int check_timeout;      /* ms until a check is killed */
+	int probe_interval;     /* ms between probes while UP, or 0 */
+	int capture[2];         /* output pipe read by nitro for log-buffer */
+	int log_in[2];          /* process reads from log_in[0] */
+	int log_out[2];         /* process writes to log_out[1] */
+	int nlisten;
+	char sched_pending;     /* run again once the current run exited */
+
+	/* cold: only used on state changes and requests */
+	char name[64];
+	char flags;             /* SV_*, derived from the name */
+	deadline startstop;
+	int wstatus;
+	char notify;            /* process talks to notifysock when ready */
+	char stopping;          /* process sent STOPPING=1 */
+	char check;             /* 1: last check passed, 2: failed */
+	char check_fails;       /* failed checks in a row */
+	char check_failmax;     /* failed checks in a row until restart */
+	char trigger;           /* 1: waiting for a ./trigger path, 2: seen */
+	int trigger_wd[MAXTRIGGER]; /* inotify watches for ./trigger, or 0 */
+	char rolling;           /* 1: to be restarted by rollout, 2: restarting */
+	deadline rolling_deadline; /* when the rollout gives up on restarting */
+	int check_latency;      /* ms the last check took */
+	deadline last_run;      /* when the last scheduled run started */
+	int last_duration;      /* ms the last scheduled run took */
+	int idle_timeout;       /* ms after IDLE=1 until stopped */
+	int pipesize;           /* capacity of the log pipe, if known */
+	int log_hwm;            /* max. unread bytes seen in the log pipe */
+	uint32_t waiters;       /* bit w: waiters[w] waits for this service */
+	int listenfd[MAXLISTEN]; /* sockets bound by nitro for ./listen */
+	int fdstore[MAXFDSTORE]; /* fds handed to nitro by the service */
+	int nfdstore;
+	char status_text[64];   /* last STATUS= sent by the process */
+	union sockaddr_any probe_addr; /* address of ./probe */
+} __attribute__((aligned(64))) *services;
+
+_Static_assert(offsetof(struct service, deadline) <= 64,
+    "hot fields of struct service exceed a cache line");
+
+/* services, fds and fdowner live in an arena reserved for maxsv services
+   at startup; its pages are only committed when first used. */
+int maxsv = MAXSV;
+int service_hwm;                /* max. max_service seen */
+#define MAXSV_LIMIT 100000
+
+#define FIXFD 5
+#define MAXFDS (FIXFD + (3+MAXLISTEN)*maxsv)
+struct pollfd *fds;
+
+enum fd_kind {
+	FD_READY = 1,           /* services[i].readypipe */
+	FD_CAPTURE,             /* services[i].capture[0] */
+	FD_FORWARD,             /* output target of services[i].capture */
+	FD_LISTEN,              /* services[i].listenfd[k] */
+	FD_PROBE,               /* services[i].probefd */
+};
 
-#define FIXFD 2
-struct pollfd fds[FIXFD + MAXSV];
+struct fdowner {
+	int service;
+	enum fd_kind kind;
+} *fdowner;
+
+/* the last LOGBUF_SIZE bytes written by a service with ./log-buffer */
+struct ring {
+	char used;
+	size_t pos;             /* next write position in buf */
+	size_t len;             /* valid bytes in buf */
+	size_t pending;         /* bytes of out not yet forwarded */
+	char out[PIPE_BUF];
+	char buf[LOGBUF_SIZE];
+} rings[LOGBUF_SLOTS];
+
+/* command line and environment of a service created by nitroctl run */
+struct transient {
+	char used;
+	int argc;
+	int envc;
+	char *argv[TRANSIENT_ARGS + 1];
+	char *env[TRANSIENT_ARGS + 1];
+	size_t len;             /* bytes used in buf */
+	char buf[TRANSIENT_SIZE];
+} transients[MAXTRANSIENT];
+
+/* instance counts set by nitroctl scale, override ./instances */
+struct {
+	char name[64];          /* template, ending in @ */
+	int count;
+} scales[MAXSCALE];
+
+/* a client waiting for a set of services to reach a state */
+struct {
+	char used;
+	uint16_t want;          /* bit s: state s ends the wait for a service */
+	uint16_t fail;          /* bit s: state s fails the whole wait */
+	deadline deadline;      /* when to give up, or 0 */
+	deadline since;
+	struct sockaddr_un src;
+	socklen_t srclen;
+} waiters[MAXWAITERS];
+int nwaiters;
+
+#define STATEBIT(s) (1u << (s))
 
 #define IS_LOG(i) (services[i].log_in[0] != -1)
 #define PENDING_FD (-666)
@@ -138,18 +313,49 @@ int globallog[2];
 DIR *cwd;
 DIR *notifydir;
 char notifypath[256];
+int notifysock = -1;            /* NOTIFY_SOCKET for ./notify-socket */
+char notifysockpath[PATH_MAX];
+int inotifyfd = -1;             /* watches the paths of ./trigger */
+int mountsfd = -1;              /* polls for mount changes */
+int subreaper;                  /* we adopt orphans, for MAINPID= */
 const char *control_socket_path;
 const char *servicedir = "/etc/nitro";
 
 long total_reaps;
 long total_sv_reaps;
 
+deadline log_sample_deadline;
+int log_sample_interval = LOG_SAMPLE_INTERVAL; /* ms, or 0 for no sampling */
+
+struct status_page *status;     /* mapped status file, or 0 */
+char statuspath[PATH_MAX];
+
 int pid1;
 int real_pid1;
 
 volatile sig_atomic_t want_rescan;
 volatile sig_atomic_t want_shutdown;
 volatile sig_atomic_t want_reboot;
+volatile sig_atomic_t want_softreboot;  /* with want_reboot: don't reboot(2) */
+volatile sig_atomic_t want_kexec;       /* with want_reboot: try RB_KEXEC */
+int want_reexec;
+int state_changed;      /* process_step ran since the last rollout_step */
+
+char **nitro_argv;
+char nitro_exe[PATH_MAX];       /* absolute path of our binary */
+
+/* the argument for SYS/finish and SYS/final */
+static const char *
+shutdown_mode()
+{
+	if (want_softreboot)
+		return "soft-reboot";
+	if (want_kexec)
+		return "kexec";
+	if (want_reboot)
+		return "reboot";
+	return "shutdown";
+}
 
 static ssize_t
 safe_write(int fd, const char *buf, size_t len)
@@ -338,7 +544,7 @@ valid_service_name(const char *name)
 {
 	if (!name[0])
 		return 0;
-	if (name[0] == '.')
+	if (name[0] == '.' || name[0] == '@')
 		return 0;
 	if (strcmp(name, "SYS") == 0)
 		return 0;
@@ -357,1497 +563,4755 @@ valid_service_name(const char *name)
 void process_step(int i, enum process_events ev);
 void notify(int);
 void slayall();
-
+void status_update(int);
+void status_open(const char *);
+void waiter_reply(int, enum tags, int);
+void trigger_unwatch(int);
+void trigger_rearm(int);
+void log_sample_writer(int);
+void handle_notify_sock();
+
+/* open a file of the service directory (of the template for instances) */
 int
-notification_fd(int i)
+open_svfile(int i, const char *file)
 {
 	char buf[PATH_MAX];
 	char *instance = strchr(services[i].name, '@');
 	if (instance)
 		*instance = 0;
-	sprn(buf, buf + sizeof buf, "%s%s/notification-fd",
-	    services[i].name, ("@" + !instance));
+	sprn(buf, buf + sizeof buf, "%s%s/%s",
+	    services[i].name, ("@" + !instance), file);
 	if (instance)
 		*instance = '@';
 
-	int fd = open(buf, O_RDONLY | O_CLOEXEC);
+	return open(buf, O_RDONLY | O_CLOEXEC);
+}
+
+/* read a decimal number from fd and close it, dflt if empty */
+long
+read_num(int fd, long dflt)
+{
 	if (fd < 0)
-		return -1;
+		return dflt;
 
 	char num[64];
 	int r = read(fd, num, sizeof num);
 	close(fd);
 
 	if (r <= 0)
-		return -1;
+		return dflt;
 
-	int n = 0;
+	long n = 0;
 	for (int j = 0; j < r && num[j]; j++)
 		if (((unsigned int)num[j] - '0') < 10)
 			n = n*10 + (num[j] - '0');
 	return n;
 }
 
+/* read a decimal number from a service file, dflt if missing or empty */
+long
+svfile_num(int i, const char *file, long dflt)
+{
+	return read_num(open_svfile(i, file), dflt);
+}
+
+/* does the service directory contain file? */
+int
+svfile_exists(int i, const char *file)
+{
+	int fd = open_svfile(i, file);
+	if (fd < 0)
+		return 0;
+	close(fd);
+	return 1;
+}
+
+int
+notification_fd(int i)
+{
+	return svfile_num(i, "notification-fd", -1);
+}
+
+/* the fd the output of service i should go to, or -1 for our stdout */
+int
+output_fd(int i)
+{
+	if (services[i].ring)
+		return services[i].capture[1];
+	if (services[i].log_out[1] != -1)
+		return services[i].log_out[1];
+	if (globallog[1] > 0)
+		return globallog[1];
+	return -1;
+}
+
+/* where nitro forwards captured output of service i to */
+int
+forward_fd(int i)
+{
+	if (services[i].log_out[1] != -1)
+		return services[i].log_out[1];
+	if (globallog[1] > 0)
+		return globallog[1];
+	return 1;
+}
+
 void
-proc_launch(int i)
+ring_setup(int i)
 {
-	services[i].setuppid = 0;
+	if (services[i].ring)
+		return;
 
 	struct stat st;
-	if (stat_slash_to_at(services[i].name, "run", &st) < 0 && errno == ENOENT) {
-		services[i].pid = 0;
-		services[i].startstop = time_now();
-		services[i].state = PROC_ONESHOT;
-		services[i].timeout = 0;
-		services[i].deadline = 0;
-		if (stat_slash_to_at(services[i].name, ".", &st) < 0 && errno == ENOENT)
-			goto fatal;
-		notify(i);
+	if (stat_slash_to_at(services[i].name, "log-buffer", &st) < 0)
+		return;
 
+	int r;
+	for (r = 0; r < LOGBUF_SLOTS; r++)
+		if (!rings[r].used)
+			break;
+	if (r == LOGBUF_SLOTS) {
+		prn(2, "- nitro: too many log buffers, limit=%d\n", LOGBUF_SLOTS);
 		return;
 	}
 
-	unsigned char status;
-	int alivepipefd[2];
-	if (pipe2(alivepipefd, O_CLOEXEC) < 0) {
-		/* pipe failed, delay */
-		prn(2, "- nitro: can't create status pipe: errno=%d\n", errno);
-		services[i].state = PROC_DELAY;
-		services[i].timeout = DELAY_SPAWN_ERROR;
-		services[i].deadline = 0;
+	if (pipe2(services[i].capture, O_CLOEXEC) < 0) {
+		prn(2, "- nitro: can't create capture pipe: errno=%d\n", errno);
 		return;
 	}
+	/* only our end is non-blocking */
+	fcntl(services[i].capture[0], F_SETFL, O_NONBLOCK);
 
-	int readypipe[2];
-	int notificationfd = notification_fd(i);
-	if (notificationfd <= 0) {
-		services[i].readypipe = -1;
-	} else {
-		if (pipe2(readypipe, O_NONBLOCK | O_CLOEXEC) < 0) {
-			/* pipe failed, delay */
-			prn(2, "- nitro: can't create readiness pipe: errno=%d\n", errno);
-			services[i].state = PROC_DELAY;
-			services[i].timeout = DELAY_SPAWN_ERROR;
-			services[i].deadline = 0;
-			return;
-		}
-		services[i].readypipe = readypipe[0];
-	}
+	rings[r] = (struct ring){ .used = 1 };
+	services[i].ring = r + 1;
+}
 
-	pid_t child = fork();
-	if (child == 0) {
-		char *instance;
-		if (chdir_at(services[i].name, &instance) < 0)
-			_exit(127);
+void
+ring_free(int i)
+{
+	if (!services[i].ring)
+		return;
 
-		setsid();
+	rings[services[i].ring - 1].used = 0;
+	services[i].ring = 0;
+	close(services[i].capture[0]);
+	close(services[i].capture[1]);
+}
 
-		if (strcmp(services[i].name, "LOG") == 0) {
-			dup2(globallog[0], 0);
-			dup2(1, 2);
-		} else {
-			if (IS_LOG(i))
-				dup2(services[i].log_in[0], 0);
-			else
-				dup2(nullfd, 0);
+/* copy the buffered output of i to dst, oldest first */
+size_t
+ring_copy(int i, char *dst)
+{
+	if (!services[i].ring)
+		return 0;
 
-			if (services[i].log_out[1] != -1)
-				dup2(services[i].log_out[1], 1);
-			else if (globallog[1] > 0)
-				dup2(globallog[1], 1);
-			// else keep fd 1 to /dev/console
-		}
+	struct ring *rg = &rings[services[i].ring - 1];
+	size_t start = (rg->pos + sizeof rg->buf - rg->len) % sizeof rg->buf;
+	for (size_t n = 0; n < rg->len; n++)
+		dst[n] = rg->buf[(start + n) % sizeof rg->buf];
 
-		if (notificationfd != -1)
-			dup2(readypipe[1], notificationfd);
+	return rg->len;
+}
 
-		exec1("run", instance);
+/* forward pending captured output, without ever blocking */
+void
+ring_forward(int i)
+{
+	struct ring *rg = &rings[services[i].ring - 1];
+	if (!rg->pending)
+		return;
 
-		status = errno;
-		(void)! write(alivepipefd[1], &status, 1);
-		_exit(status == ENOENT ? 127 : 126);
-	} else if (child < 0) {
-		/* fork failed, delay */
-		prn(2, "- nitro: can't fork %s/%s: errno=%d\n", services[i].name, "run", errno);
-		close(alivepipefd[0]);
-		close(alivepipefd[1]);
-		services[i].state = PROC_DELAY;
-		services[i].pid = 0;
-		services[i].wstatus = -1;
-		services[i].timeout = DELAY_SPAWN_ERROR;
-		services[i].deadline = 0;
+	/* POLLOUT guarantees we can write PIPE_BUF bytes to a pipe */
+	struct pollfd pfd = { .fd = forward_fd(i), .events = POLLOUT };
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT)) {
+		log_sample_writer(i);   /* the logger is falling behind */
 		return;
 	}
 
-	close(alivepipefd[1]);
-	if (read(alivepipefd[0], &status, 1) == 1) {
-		prn(2, "- nitro: can't exec %s/%s: errno=%d\n", services[i].name, "run", status);
-		close(alivepipefd[0]);
+	ssize_t w = write(pfd.fd, rg->out, rg->pending);
+	if (w < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		w = rg->pending;        /* drop output that can't be written */
+	}
+	memmove(rg->out, rg->out + w, rg->pending - w);
+	rg->pending -= w;
+}
 
-		switch (status) {
-		case EAGAIN:
-		case EIO:
-		case EMFILE:
-		case ENOMEM:
-		case ETXTBSY:
-			// probably temporary problem, retry after delay
-			services[i].state = PROC_DELAY;
-			services[i].wstatus = -1;
-			services[i].pid = 0;
-			services[i].timeout = DELAY_SPAWN_ERROR;
-			services[i].deadline = 0;
-			break;
-		default:
-fatal:			// unlikely to go away problem, go fatal
-			services[i].state = PROC_FATAL;
-			services[i].wstatus = -1;
-			services[i].pid = 0;
-			services[i].startstop = time_now();
-			services[i].timeout = 0;
-			services[i].deadline = 0;
+void
+ring_read(int i)
+{
+	struct ring *rg = &rings[services[i].ring - 1];
+	if (rg->pending)
+		return;
 
-			process_step(i, EVNT_EXITED);
-		}
+	ssize_t r = read(services[i].capture[0], rg->out, sizeof rg->out);
+	if (r <= 0)
 		return;
+
+	for (ssize_t j = 0; j < r; j++) {
+		rg->buf[rg->pos] = rg->out[j];
+		rg->pos = (rg->pos + 1) % sizeof rg->buf;
 	}
-	close(alivepipefd[0]);
+	rg->len += r;
+	if (rg->len > sizeof rg->buf)
+		rg->len = sizeof rg->buf;
 
-	if (strcmp(services[i].name, "LOG") == 0)
-		globallog[1] = -globallog[1];
+	rg->pending = r;
+	ring_forward(i);
+}
 
-	if (notificationfd > 0)
-		close(readypipe[1]);
+/* parse a socket address: unix:PATH, tcp:[ADDR:]PORT, 0 on error */
+static socklen_t
+socket_addr(const char *spec, union sockaddr_any *addr)
+{
+	*addr = (union sockaddr_any){ 0 };
 
-	services[i].pid = child;
-	services[i].startstop = time_now();
-	services[i].state = PROC_STARTING;
-	services[i].timeout = (notificationfd == -1) ? DELAY_STARTING : 0;
-	services[i].deadline = 0;
+	if (strncmp(spec, "unix:", 5) == 0) {
+		const char *path = spec + 5;
+		if (strlen(path) >= sizeof addr->un.sun_path) {
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+		addr->un.sun_family = AF_UNIX;
+		stecpy(addr->un.sun_path, addr->un.sun_path + sizeof addr->un.sun_path, path);
+		return sizeof addr->un;
+	} else if (strncmp(spec, "tcp:", 4) == 0) {
+		char host[64] = "127.0.0.1";
+		const char *port = strrchr(spec, ':') + 1;
+		if (port - 1 > spec + 3) {
+			size_t n = port - 1 - (spec + 4);
+			if (n >= sizeof host) {
+				errno = EINVAL;
+				return 0;
+			}
+			memcpy(host, spec + 4, n);
+			host[n] = 0;
+		}
 
-	notify(i);
+		unsigned long p = 0;
+		for (; ((unsigned int)*port - '0') < 10; port++)
+			p = p*10 + (*port - '0');
+		if (*port || p == 0 || p > 65535) {
+			errno = EINVAL;
+			return 0;
+		}
+
+		addr->in.sin_family = AF_INET;
+		addr->in.sin_port = htons(p);
+		if (inet_pton(AF_INET, host, &addr->in.sin_addr) != 1) {
+			errno = EINVAL;
+			return 0;
+		}
+		return sizeof addr->in;
+	}
+
+	errno = EINVAL;
+	return 0;
 }
 
-void
-proc_setup(int i)
+/* bind a socket for one line of ./listen, a Unix socket gets mode */
+static int
+listen_socket(const char *spec, mode_t mode)
 {
-	if (services[i].log_out[1] != -1)
-		for (int j = 0; j < max_service; j++)
-			if (j != i && services[j].log_in[1] == services[i].log_out[1]) {
-				process_step(j, EVNT_WANT_UP);  // start logger
-				break;
-			}
+	union sockaddr_any addr;
+	socklen_t addrlen = socket_addr(spec, &addr);
+	if (!addrlen)
+		return -1;
 
 	struct stat st;
-	if (stat_slash_to_at(services[i].name, "setup", &st) < 0 && errno == ENOENT) {
-		services[i].state = PROC_SETUP;
-		process_step(i, EVNT_SETUP);
-		return;
-	}
+	if (addr.sa.sa_family == AF_UNIX &&
+	    lstat(addr.un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(addr.un.sun_path);       /* stale socket */
 
-	pid_t child = fork();
-	if (child == 0) {
-		char *instance;
-		if (chdir_at(services[i].name, &instance) < 0)
-			_exit(111);
+	int fd = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
 
-		setsid();
+	int one = 1;
+	if (addr.sa.sa_family == AF_INET)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
 
-		if (strcmp(services[i].name, "SYS") == 0) {
-			// keep fd connected to console, acquire controlling tty
-			// only works after setsid!
-			ioctl(0, TIOCSCTTY, 1);
-		} else {
-			dup2(nullfd, 0);
-		}
+	if (bind(fd, &addr.sa, addrlen) < 0 ||
+	    (addr.sa.sa_family == AF_UNIX && chmod(addr.un.sun_path, mode) < 0) ||
+	    listen(fd, SOMAXCONN) < 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
 
-		if (services[i].log_out[1] != -1)
-			dup2(services[i].log_out[1], 1);
-		else if (globallog[1] > 0)
-			dup2(globallog[1], 1);
-		// else keep fd 1 to /dev/console
+	return fd;
+}
 
-		exec1("setup", instance);
-		_exit(111);
-	} else if (child < 0) {
-		/* fork failed, delay */
-		prn(2, "- nitro: can't fork %s/%s: errno=%d\n",
-		    services[i].name, "setup", errno);
-		services[i].state = PROC_DELAY;
-		services[i].timeout = DELAY_SPAWN_ERROR;
-		services[i].deadline = 0;
-		return;
-	}
-
-	// XXX use alivepipe?
-
-	services[i].setuppid = child;
-	services[i].startstop = time_now();
-	services[i].state = PROC_SETUP;
-	services[i].timeout = 0;
-	services[i].deadline = 0;
-
-	notify(i);
+void
+listen_close(int i)
+{
+	for (int k = 0; k < services[i].nlisten; k++)
+		close(services[i].listenfd[k]);
+	services[i].nlisten = 0;
 }
 
+/* bind all sockets in ./listen, they are kept until the service is removed */
 void
-proc_finish(int i)
+listen_setup(int i)
 {
-	if (services[i].finishpid)
+	if (services[i].nlisten > 0)
 		return;
 
-	struct stat st;
-	if (stat_slash_to_at(services[i].name, "finish", &st) < 0 && errno == ENOENT) {
-		process_step(i, EVNT_FINISHED);
+	int fd = open_svfile(i, "listen");
+	if (fd < 0)
 		return;
-	}
-
-	int wstatus = services[i].wstatus;
-	int status;
-	int signal;
-	char run_status[16];
-	char run_signal[16];
-	if (wstatus == -1) {
-		// exec failed;
-		status = 111;
-		signal = 0;
-	} else if (WIFSIGNALED(wstatus)) {
-		status = -1;
-		signal = WTERMSIG(wstatus);
-	} else {
-		status = WEXITSTATUS(wstatus);
-		signal = 0;
-	}
-	steprl(run_status, run_status + sizeof run_status, status);
-	steprl(run_signal, run_signal + sizeof run_signal, signal);
 
-	pid_t child = fork();
-	if (child == 0) {
-		char *instance;
-		if (chdir_at(services[i].name, &instance) < 0)
-			_exit(127);
+	char buf[1024];
+	ssize_t r = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (r <= 0)
+		return;
+	buf[r] = 0;
 
-		dup2(nullfd, 0);
-		if (services[i].log_out[1] != -1)
-			dup2(services[i].log_out[1], 1);
-		else if (globallog[1] > 0)
-			dup2(globallog[1], 1);
-		// else keep fd 1 to /dev/console
+	char *line, *next;
+	for (line = buf; *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+		else
+			next = line + strlen(line);
 
-		setsid();
+		if (!*line || *line == '#')
+			continue;
 
-		if (strcmp(services[i].name, "SYS") == 0) {
-			if (want_reboot)
-				instance = (char *)"reboot";
-			else
-				instance = (char *)"shutdown";
+		/* clients may have dropped privileges, as for notify.sock,
+		   unless an octal mode follows the address */
+		long mode = 0666;
+		int bad = 0;
+		char *arg = strpbrk(line, " \t");
+		if (arg) {
+			*arg++ = 0;
+			arg += strspn(arg, " \t");
+			if (*arg) {
+				char *end;
+				mode = strtol(arg, &end, 8);
+				end += strspn(end, " \t");
+				bad = *end || mode < 0 || mode > 07777;
+			}
 		}
 
-		exec3("finish", run_status, run_signal, instance);
-		_exit(127);
-	} else if (child < 0) {
-		/* fork failed, skip over the finish script */
-		prn(2, "- nitro: can't fork %s/%s: errno=%d\n", services[i].name, "finish", errno);
-		process_step(i, EVNT_FINISHED);
-		return;
+		int s = -1;
+		if (bad)
+			errno = EINVAL;
+		else if (services[i].nlisten < MAXLISTEN)
+			s = listen_socket(line, mode);
+		else
+			errno = EMFILE;
+		if (s < 0) {
+			prn(2, "- nitro: can't listen on %s for %s: errno=%d\n",
+			    line, services[i].name, errno);
+			/* all or nothing, retry on next start */
+			listen_close(i);
+			return;
+		}
+		services[i].listenfd[services[i].nlisten++] = s;
 	}
-
-	services[i].finishpid = child;
-	services[i].timeout = TIMEOUT_FINISH;
-	services[i].deadline = 0;
-
-	notify(i);
 }
 
-int
-downsig(int i)
+/* read the address to connect to from ./probe */
+void
+probe_setup(int i)
 {
-	char buf[PATH_MAX];
-	char *instance = strchr(services[i].name, '@');
-	if (instance)
-		*instance = 0;
-	sprn(buf, buf + sizeof buf, "%s%s/down-signal",
-	    services[i].name, ("@" + !instance));
-	if (instance)
-		*instance = '@';
+	services[i].probe_addrlen = 0;
 
-	int fd = open(buf, O_RDONLY | O_CLOEXEC);
+	int fd = open_svfile(i, "probe");
 	if (fd < 0)
-		return SIGTERM;
+		return;
 
-	char c = 't';
-	(void)! read(fd, &c, 1);
+	char buf[256];
+	ssize_t r = read(fd, buf, sizeof buf - 1);
 	close(fd);
+	if (r <= 0)
+		return;
+	buf[r] = 0;
+	buf[strcspn(buf, "\n")] = 0;
 
-	return charsig(c) ? charsig(c) : SIGTERM;
+	services[i].probe_addrlen = socket_addr(buf, &services[i].probe_addr);
+	if (!services[i].probe_addrlen)
+		prn(2, "- nitro: can't probe %s for %s: errno=%d\n",
+		    buf, services[i].name, errno);
 }
 
+/* an on-demand service needs something to listen on */
 void
-proc_shutdown(int i)
+ondemand_setup(int i)
 {
-	if (services[i].setuppid) {
-		kill(services[i].setuppid, SIGTERM);
-		kill(services[i].setuppid, SIGCONT);
-	}
-
-	if (services[i].pid) {
-		kill(services[i].pid, downsig(i));
-		kill(services[i].pid, SIGCONT);
-	}
-
-	if (strcmp(services[i].name, "LOG") == 0)
-		globallog[1] = -globallog[1];
+	struct stat st;
+	services[i].ondemand = services[i].nlisten > 0 &&
+	    stat_slash_to_at(services[i].name, "on-demand", &st) == 0;
+	services[i].idle_timeout = services[i].ondemand ?
+	    svfile_num(i, "idle-timeout", 0) * 1000 : 0;
+}
 
-	if (services[i].state != PROC_SHUTDOWN &&
-	    services[i].state != PROC_RESTART) {
-		services[i].state = PROC_SHUTDOWN;
-		services[i].timeout = TIMEOUT_SHUTDOWN;
-		services[i].deadline = 0;
-	}
+/* service i started or got a connection: it is busy until it sends
+   IDLE=1 again */
+void
+idle_activity(int i)
+{
+	services[i].idle_deadline = 0;
 }
 
+/* service i sent IDLE=1: stop it after idle_timeout unless a
+   connection arrives meanwhile */
 void
-proc_kill(int i)
+idle_report(int i)
 {
-	assert(services[i].state == PROC_SHUTDOWN ||
-	    services[i].state == PROC_RESTART ||
-	    services[i].state == PROC_ONESHOT);
+	if (services[i].idle_timeout <= 0 || services[i].idle_deadline ||
+	    (services[i].state != PROC_STARTING &&
+	    services[i].state != PROC_UP))
+		return;
+	services[i].idle_deadline = time_now() + services[i].idle_timeout;
+}
 
-	if (services[i].setuppid)
-		kill(services[i].setuppid, SIGKILL);
+/* right before stopping service i for being idle, look at the
+   messages it sent and its sockets once more, and keep it up if it
+   got busy */
+int
+idle_confirm(int i)
+{
+	struct pollfd pfd = { .fd = notifysock, .events = POLLIN };
+	for (int n = 0; n < 64 && notifysock >= 0 &&
+	    poll(&pfd, 1, 0) > 0; n++)
+		handle_notify_sock();
+	if (!services[i].idle_deadline)
+		return 0;
 
-	if (services[i].pid)
-		kill(services[i].pid, SIGKILL);
+	for (int k = 0; k < services[i].nlisten; k++) {
+		pfd.fd = services[i].listenfd[k];
+		if (poll(&pfd, 1, 0) > 0) {
+			idle_activity(i);
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	if (services[i].finishpid)
-		kill(services[i].finishpid, SIGKILL);
+/* build an environment of child_environ overridden by extra into env */
+static char **
+child_env(char **env, char **extra, int n)
+{
+	int k = 0;
+	for (char **e = child_environ; *e; e++) {
+		int j;
+		for (j = 0; j < n; j++) {
+			size_t l = strchr(extra[j], '=') - extra[j] + 1;
+			if (strncmp(*e, extra[j], l) == 0)
+				break;
+		}
+		if (j == n)
+			env[k++] = *e;
+	}
+	for (int j = 0; j < n; j++)
+		env[k++] = extra[j];
+	env[k] = 0;
+
+	return env;
 }
 
 void
-proc_cleanup(int i)
+fdstore_close(int i)
 {
-	services[i].pid = 0;
-	services[i].setuppid = 0;
-	services[i].finishpid = 0;
-	services[i].timeout = 0;
-	services[i].deadline = 0;
-	services[i].state = PROC_DOWN;
-	services[i].startstop = time_now();
+	for (int k = 0; k < services[i].nfdstore; k++)
+		close(services[i].fdstore[k]);
+	services[i].nfdstore = 0;
+}
 
-	if (services[i].readypipe != -1) {
-		close(services[i].readypipe);
-		services[i].readypipe = -1;
-	}
+/* add fd to the store of service i, unless it's already in there */
+int
+fdstore_add(int i, int fd)
+{
+	struct stat st, st2;
+	if (fstat(fd, &st) < 0)
+		return -1;
 
-	if (global_state != GLBL_UP) {
-		if (services[i].log_in[0] > 0) {
-			close(services[i].log_in[0]);
-			close(services[i].log_in[1]);
-		}
-		if (services[i].log_out[1] > 0) {
-			close(services[i].log_out[0]);
-			close(services[i].log_out[1]);
+	for (int k = 0; k < services[i].nfdstore; k++)
+		if (fstat(services[i].fdstore[k], &st2) == 0 &&
+		    st.st_dev == st2.st_dev && st.st_ino == st2.st_ino) {
+			close(fd);
+			return 0;
 		}
-		services[i].log_in[0] = -1;
-		services[i].log_in[1] = -1;
-		services[i].log_out[0] = -1;
-		services[i].log_out[1] = -1;
-	}
 
-	notify(i);
+	if (services[i].nfdstore >= MAXFDSTORE)
+		return -1;
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	services[i].fdstore[services[i].nfdstore++] = fd;
+	return 0;
 }
 
-static void
-close_fd(int fd)
+/* find a free transient slot, -1 if there is none */
+int
+transient_alloc()
 {
-	if (fd < 0)
-		return;
+	for (int t = 0; t < MAXTRANSIENT; t++)
+		if (!transients[t].used) {
+			transients[t] = (struct transient){ .used = 1 };
+			return t;
+		}
+	return -1;
+}
 
-	for (int i = 0; i < max_service; i++) {
-		if (services[i].log_in[0] == fd)
-			services[i].log_in[0] = -1;
-		if (services[i].log_in[1] == fd)
-			services[i].log_in[1] = -1;
-		if (services[i].log_out[0] == fd)
-			services[i].log_out[0] = -1;
-		if (services[i].log_out[1] == fd)
-			services[i].log_out[1] = -1;
-	}
-	close(fd);
+/* append s of length len to the arguments (or the environment) of t */
+int
+transient_add(int t, int env, const char *s, size_t len)
+{
+	struct transient *tr = &transients[t];
+	int *n = env ? &tr->envc : &tr->argc;
+	char **v = env ? tr->env : tr->argv;
+
+	if (*n >= TRANSIENT_ARGS || len + 1 > sizeof tr->buf - tr->len ||
+	    memchr(s, 0, len) || (env && !memchr(s, '=', len)))
+		return -1;
+
+	v[*n] = tr->buf + tr->len;
+	memcpy(v[*n], s, len);
+	v[*n][len] = 0;
+	v[++*n] = 0;
+	tr->len += len + 1;
+	return 0;
 }
 
 void
-proc_zap(int i) {
-	if (!services[i].seen) {
-		/* close the log pipes and remove all references to it */
-		close_fd(services[i].log_in[0]);
-		close_fd(services[i].log_in[1]);
+transient_free(int i)
+{
+	if (!services[i].transient)
+		return;
 
-		dprn("can garbage-collect %s\n", services[i].name);
+	transients[services[i].transient - 1].used = 0;
+	services[i].transient = 0;
+}
 
-		if (max_service > 0) {
-			services[i] = services[--max_service];
-		} else {
-			assert(i == 0);
-			services[i] = (struct service) { 0 };
-		}
+/* in the child: move the sockets and stored fds of service i to
+   fd 3, 4, ... */
+static int
+pass_fds(int i)
+{
+	int n = services[i].nlisten + services[i].nfdstore;
+	int tmp[MAXLISTEN + MAXFDSTORE];
+
+	/* first get them out of the way of their targets */
+	for (int k = 0; k < services[i].nlisten; k++)
+		tmp[k] = fcntl(services[i].listenfd[k], F_DUPFD, 3 + n);
+	for (int k = 0; k < services[i].nfdstore; k++)
+		tmp[services[i].nlisten + k] =
+		    fcntl(services[i].fdstore[k], F_DUPFD, 3 + n);
+	for (int k = 0; k < n; k++) {
+		dup2(tmp[k], 3 + k);
+		close(tmp[k]);
 	}
+
+	return n;
 }
 
 void
-process_step(int i, enum process_events ev)
+proc_launch(int i)
 {
-	dprn("process %s[%d] state %d step %d\n",
-	    services[i].name, services[i].pid,
-	    services[i].state, ev);
-
-	switch (ev) {
-	case EVNT_WANT_UP:
-		if (global_state != GLBL_UP)
-			break;
-		switch (services[i].state) {
-		case PROC_ONESHOT:
-		case PROC_SETUP:
-		case PROC_STARTING:
-		case PROC_UP:
-		case PROC_RESTART:
-			/* ignore, is up */
-			break;
+	services[i].setuppid = 0;
 
-		case PROC_SHUTDOWN:
-			services[i].state = PROC_RESTART;
-			break;
+	struct stat st;
+	if (!services[i].transient &&
+	    stat_slash_to_at(services[i].name, "run", &st) < 0 && errno == ENOENT) {
+		services[i].pid = 0;
+		services[i].startstop = time_now();
+		services[i].state = PROC_ONESHOT;
+		services[i].timeout = 0;
+		services[i].deadline = 0;
+		if (stat_slash_to_at(services[i].name, ".", &st) < 0 && errno == ENOENT)
+			goto fatal;
+		notify(i);
 
-		case PROC_DOWN:
-		case PROC_FATAL:
-		case PROC_DELAY:
-			proc_setup(i);
-			break;
-		}
-		break;
+		return;
+	}
 
-	case EVNT_WANT_DOWN:
-		switch (services[i].state) {
-		case PROC_RESTART:
-			services[i].state = PROC_SHUTDOWN;
-			/* fallthrough */
-		case PROC_SETUP:
-		case PROC_STARTING:
-		case PROC_UP:
-		case PROC_SHUTDOWN:
-			proc_shutdown(i);
-			break;
-
-		case PROC_ONESHOT:
-			proc_finish(i);
-			break;
+	unsigned char status;
+	int alivepipefd[2];
+	if (pipe2(alivepipefd, O_CLOEXEC) < 0) {
+		/* pipe failed, delay */
+		prn(2, "- nitro: can't create status pipe: errno=%d\n", errno);
+		services[i].state = PROC_DELAY;
+		services[i].timeout = DELAY_SPAWN_ERROR;
+		services[i].deadline = 0;
+		return;
+	}
 
-		case PROC_FATAL:
-		case PROC_DELAY:
-		case PROC_DOWN:
-			services[i].state = PROC_DOWN;
-			services[i].timeout = 0;
+	int readypipe[2];
+	int notificationfd = notification_fd(i);
+	int npass = services[i].nlisten + services[i].nfdstore;
+	if (notificationfd >= 3 && notificationfd < 3 + npass) {
+		prn(2, "- nitro: notification-fd %d of %s clashes with its passed fds\n",
+		    notificationfd, services[i].name);
+		close(alivepipefd[0]);
+		close(alivepipefd[1]);
+		goto fatal;
+	}
+	services[i].notify = notifysock >= 0 && svfile_exists(i, "notify-socket");
+#ifdef __linux__
+	/* reap the MAINPID of services, like pid 1 would */
+	if (services[i].notify && !pid1 && !subreaper)
+		subreaper = prctl(PR_SET_CHILD_SUBREAPER, 1) == 0;
+#endif
+	services[i].watchdog = svfile_num(i, "watchdog", 0);
+	if (services[i].watchdog > 0 && notificationfd < 0 &&
+	    !services[i].notify) {
+		/* it could never ping, so it would be restarted forever */
+		prn(2, "- nitro: %s has a watchdog but no way to ping it, ignored\n",
+		    services[i].name);
+		services[i].watchdog = 0;
+	}
+	if (services[i].idle_timeout > 0 && !services[i].notify)
+		prn(2, "- nitro: %s has an idle-timeout but can't report idleness, ignored\n",
+		    services[i].name);
+	int check = svfile_exists(i, "check");
+	probe_setup(i);
+	services[i].check_interval = 0;
+	services[i].probe_interval = 0;
+	if (services[i].probe_addrlen)
+		services[i].probe_interval = svfile_num(i, "probe-interval", 0) * 1000;
+	if (check || services[i].probe_interval) {
+		services[i].check_timeout =
+		    svfile_num(i, "check-timeout", CHECK_TIMEOUT) * 1000;
+		services[i].check_failmax =
+		    svfile_num(i, "check-failures", CHECK_FAILURES);
+	}
+	if (check)
+		services[i].check_interval =
+		    svfile_num(i, "check-interval", CHECK_INTERVAL) * 1000;
+	services[i].check_fails = 0;
+	services[i].check_next = 0;
+	services[i].probe_next = 0;
+	services[i].stopping = 0;
+	services[i].status_text[0] = 0;
+	if (notificationfd <= 0) {
+		services[i].readypipe = -1;
+	} else {
+		if (pipe2(readypipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			/* pipe failed, delay */
+			prn(2, "- nitro: can't create readiness pipe: errno=%d\n", errno);
+			services[i].state = PROC_DELAY;
+			services[i].timeout = DELAY_SPAWN_ERROR;
 			services[i].deadline = 0;
-			break;
+			return;
 		}
-		break;
+		services[i].readypipe = readypipe[0];
+	}
 
-	case EVNT_WANT_RESTART:
-		if (global_state != GLBL_UP)
-			break;
-		switch (services[i].state) {
-		case PROC_SETUP:
-		case PROC_STARTING:
-		case PROC_UP:
-		case PROC_RESTART:
-		case PROC_SHUTDOWN:
-			proc_shutdown(i);
-			services[i].state = PROC_RESTART;
-			break;
+	pid_t child = fork();
+	if (child == 0) {
+		char *instance = 0;
+		struct transient *tr = 0;
+		if (services[i].transient) {
+			tr = &transients[services[i].transient - 1];
+			if (chdir("/") < 0)
+				_exit(127);
+		} else if (chdir_at(services[i].name, &instance) < 0) {
+			_exit(127);
+		}
 
-		case PROC_ONESHOT:
-			services[i].state = PROC_RESTART;
-			proc_finish(i);
-			break;
+		setsid();
 
-		case PROC_DOWN:
-		case PROC_FATAL:
-		case PROC_DELAY:
-			proc_setup(i);
-			break;
+		if (services[i].flags & SV_LOG) {
+			dup2(globallog[0], 0);
+			dup2(1, 2);
+		} else {
+			if (IS_LOG(i))
+				dup2(services[i].log_in[0], 0);
+			else
+				dup2(nullfd, 0);
+
+			if (output_fd(i) != -1)
+				dup2(output_fd(i), 1);
+			// else keep fd 1 to /dev/console
 		}
-		break;
 
-	case EVNT_SETUP:
-		switch (services[i].state) {
-		case PROC_ONESHOT:
-		case PROC_STARTING:
-		case PROC_UP:
-		case PROC_RESTART:
-		case PROC_SHUTDOWN:
-		case PROC_FATAL:
-		case PROC_DELAY:
-		case PROC_DOWN:
-			assert(!"invalid state transition");
+		if (npass > 0) {
+			/* keep our pipes clear of the passed fds */
+			int alivefd = fcntl(alivepipefd[1], F_DUPFD_CLOEXEC,
+			    3 + MAXLISTEN + MAXFDSTORE);
+			if (alivefd >= 0)
+				alivepipefd[1] = alivefd;
+			if (notificationfd > 0) {
+				int readyfd = fcntl(readypipe[1], F_DUPFD_CLOEXEC,
+				    3 + MAXLISTEN + MAXFDSTORE);
+				if (readyfd >= 0)
+					readypipe[1] = readyfd;
+			}
+		}
 
-		case PROC_SETUP:
-			if (global_state == GLBL_UP)
-				proc_launch(i);
-			else
-				proc_cleanup(i);
-			break;
+		char *extra[5 + TRANSIENT_ARGS];
+		int nextra = 0;
+		char listen_fds[32], listen_pid[32];
+		char listen_fdnames[sizeof "LISTEN_FDNAMES=" +
+		    sizeof "stored:" * (MAXLISTEN + MAXFDSTORE)];
+		char notify_socket[sizeof "NOTIFY_SOCKET=" + PATH_MAX];
+		char watchdog_usec[32];
+
+		if (services[i].notify) {
+			stecpy(stecpy(notify_socket,
+			    notify_socket + sizeof notify_socket, "NOTIFY_SOCKET="),
+			    notify_socket + sizeof notify_socket, notifysockpath);
+			extra[nextra++] = notify_socket;
+		}
+		if (services[i].notify && services[i].watchdog > 0) {
+			steprl(stecpy(watchdog_usec, watchdog_usec + sizeof watchdog_usec,
+			    "WATCHDOG_USEC="), watchdog_usec + sizeof watchdog_usec,
+			    services[i].watchdog * 1000L);
+			extra[nextra++] = watchdog_usec;
 		}
-		break;
 
-	case EVNT_EXITED:
-		services[i].timeout = 0;
-		services[i].deadline = 0;
-		switch (services[i].state) {
-		case PROC_UP:
-			services[i].state = PROC_RESTART;
-			proc_finish(i);
-			break;
+		int nfds = pass_fds(i);
+		if (nfds > 0) {
+			steprl(stecpy(listen_fds, listen_fds + sizeof listen_fds,
+			    "LISTEN_FDS="), listen_fds + sizeof listen_fds, nfds);
+			steprl(stecpy(listen_pid, listen_pid + sizeof listen_pid,
+			    "LISTEN_PID="), listen_pid + sizeof listen_pid, getpid());
+			extra[nextra++] = listen_fds;
+			extra[nextra++] = listen_pid;
+
+			/* tell sockets from ./listen and stored fds apart */
+			char *e = listen_fdnames + sizeof listen_fdnames;
+			char *p = stecpy(listen_fdnames, e, "LISTEN_FDNAMES=");
+			for (int k = 0; k < nfds; k++) {
+				if (k > 0)
+					p = stecpy(p, e, ":");
+				p = stecpy(p, e,
+				    k < services[i].nlisten ? "listen" : "stored");
+			}
+			extra[nextra++] = listen_fdnames;
+		}
+		for (int k = 0; tr && k < tr->envc; k++)
+			extra[nextra++] = tr->env[k];
 
-		case PROC_STARTING:
-		case PROC_RESTART:
-		case PROC_SHUTDOWN:
-		case PROC_FATAL:
-			proc_finish(i);
-			break;
+		size_t envc = 0;
+		while (child_environ[envc])
+			envc++;
+		char *env[envc + nextra + 1];
+		if (nextra)
+			child_environ = child_env(env, extra, nextra);
 
-		case PROC_SETUP:               /* can't happen */
-		case PROC_DOWN:                /* can't happen */
-		case PROC_DELAY:               /* can't happen */
-		case PROC_ONESHOT:             /* can't happen */
-			assert(!"invalid state transition");
-			break;
+		if (notificationfd != -1)
+			dup2(readypipe[1], notificationfd);
+
+		if (tr) {
+			environ = child_environ;
+			execvp(tr->argv[0], tr->argv);
+		} else {
+			exec1("run", instance);
 		}
-		break;
 
-	case EVNT_FINISHED:
-		services[i].timeout = 0;
+		status = errno;
+		(void)! write(alivepipefd[1], &status, 1);
+		_exit(status == ENOENT ? 127 : 126);
+	} else if (child < 0) {
+		/* fork failed, delay */
+		prn(2, "- nitro: can't fork %s/%s: errno=%d\n", services[i].name, "run", errno);
+		close(alivepipefd[0]);
+		close(alivepipefd[1]);
+		services[i].state = PROC_DELAY;
+		services[i].pid = 0;
+		services[i].wstatus = -1;
+		services[i].timeout = DELAY_SPAWN_ERROR;
 		services[i].deadline = 0;
-		switch (services[i].state) {
-		case PROC_UP:
-		case PROC_STARTING:
-		case PROC_RESTART: ;
-			deadline uptime = time_now() - services[i].startstop;
-			proc_cleanup(i);
-			if (global_state != GLBL_UP)
-				break;
-			if (uptime < DELAY_RESPAWN) {
-				/* delay too quick restarts */
-				services[i].state = PROC_DELAY;
-				services[i].timeout = DELAY_RESPAWN;
-				services[i].deadline = 0;
-			} else {
-				proc_setup(i);
-			}
-			break;
+		return;
+	}
 
-		case PROC_ONESHOT:
-		case PROC_SHUTDOWN:
-			proc_cleanup(i);
-			proc_zap(i);
-			break;
+	close(alivepipefd[1]);
+	if (read(alivepipefd[0], &status, 1) == 1) {
+		if (services[i].transient)
+			prn(2, "- nitro: can't exec %s for %s: errno=%d\n",
+			    transients[services[i].transient - 1].argv[0],
+			    services[i].name, status);
+		else
+			prn(2, "- nitro: can't exec %s/%s: errno=%d\n", services[i].name, "run", status);
+		close(alivepipefd[0]);
 
-		case PROC_FATAL:
-			proc_cleanup(i);
-			services[i].state = PROC_FATAL;
-			notify(i);
+		switch (status) {
+		case EAGAIN:
+		case EIO:
+		case EMFILE:
+		case ENOMEM:
+		case ETXTBSY:
+			// probably temporary problem, retry after delay
+			services[i].state = PROC_DELAY;
+			services[i].wstatus = -1;
+			services[i].pid = 0;
+			services[i].timeout = DELAY_SPAWN_ERROR;
+			services[i].deadline = 0;
 			break;
+		default:
+fatal:			// unlikely to go away problem, go fatal
+			services[i].state = PROC_FATAL;
+			services[i].wstatus = -1;
+			services[i].pid = 0;
+			services[i].startstop = time_now();
+			services[i].timeout = 0;
+			services[i].deadline = 0;
 
-		case PROC_SETUP:               /* can't happen */
-		case PROC_DOWN:                /* can't happen */
-		case PROC_DELAY:               /* can't happen */
-			assert(!"invalid state transition");
-			break;
+			process_step(i, EVNT_EXITED);
 		}
-		break;
+		return;
+	}
+	close(alivepipefd[0]);
 
-	case EVNT_TIMEOUT:
-		services[i].timeout = 0;
-		services[i].deadline = 0;
-		switch (services[i].state) {
-		case PROC_DELAY:
-			if (global_state == GLBL_WAIT_TERM)
-				slayall();
-			else if (global_state == GLBL_WAIT_KILL)
-				global_state = GLBL_FINAL;
-			else
-				proc_setup(i);
-			break;
+	if (services[i].flags & SV_LOG)
+		globallog[1] = -globallog[1];
 
-		case PROC_STARTING:
-			services[i].state = PROC_UP;
-			notify(i);
-			break;
+	if (notificationfd > 0)
+		close(readypipe[1]);
 
-		case PROC_RESTART:
-		case PROC_SHUTDOWN:
-		case PROC_ONESHOT:
-			proc_kill(i);
-			break;
+	services[i].pid = child;
+	services[i].startstop = time_now();
+	services[i].state = PROC_STARTING;
+	services[i].timeout = (notificationfd == -1 && !services[i].notify &&
+	    !services[i].probe_addrlen) ? DELAY_STARTING : 0;
+	services[i].deadline = 0;
 
-		case PROC_UP:
-		case PROC_DOWN:
-		case PROC_FATAL:
-		case PROC_SETUP:
-			assert(!"invalid timeout handler");
-			break;
+	notify(i);
+}
+
+void
+proc_setup(int i)
+{
+	if (services[i].log_out[1] != -1)
+		for (int j = 0; j < max_service; j++)
+			if (j != i && services[j].log_in[1] == services[i].log_out[1]) {
+				process_step(j, EVNT_WANT_UP);  // start logger
+				break;
+			}
+
+	ring_setup(i);
+	listen_setup(i);
+	if (services[i].idle_timeout > 0)
+		idle_activity(i);
+
+	struct stat st;
+	if (stat_slash_to_at(services[i].name, "setup", &st) < 0 && errno == ENOENT) {
+		services[i].state = PROC_SETUP;
+		process_step(i, EVNT_SETUP);
+		return;
+	}
+
+	pid_t child = fork();
+	if (child == 0) {
+		char *instance;
+		if (chdir_at(services[i].name, &instance) < 0)
+			_exit(111);
+
+		setsid();
+
+		if (services[i].flags & SV_SYS) {
+			// keep fd connected to console, acquire controlling tty
+			// only works after setsid!
+			ioctl(0, TIOCSCTTY, 1);
+		} else {
+			dup2(nullfd, 0);
+		}
+
+		if (output_fd(i) != -1)
+			dup2(output_fd(i), 1);
+		// else keep fd 1 to /dev/console
+
+		exec1("setup", instance);
+		_exit(111);
+	} else if (child < 0) {
+		/* fork failed, delay */
+		prn(2, "- nitro: can't fork %s/%s: errno=%d\n",
+		    services[i].name, "setup", errno);
+		services[i].state = PROC_DELAY;
+		services[i].timeout = DELAY_SPAWN_ERROR;
+		services[i].deadline = 0;
+		return;
+	}
+
+	// XXX use alivepipe?
+
+	services[i].setuppid = child;
+	services[i].startstop = time_now();
+	services[i].state = PROC_SETUP;
+	services[i].timeout = 0;
+	services[i].deadline = 0;
+
+	notify(i);
+}
+
+void
+proc_finish(int i)
+{
+	if (services[i].finishpid)
+		return;
+
+	struct stat st;
+	if (stat_slash_to_at(services[i].name, "finish", &st) < 0 && errno == ENOENT) {
+		process_step(i, EVNT_FINISHED);
+		return;
+	}
+
+	int wstatus = services[i].wstatus;
+	int status;
+	int signal;
+	char run_status[16];
+	char run_signal[16];
+	if (wstatus == -1) {
+		// exec failed;
+		status = 111;
+		signal = 0;
+	} else if (WIFSIGNALED(wstatus)) {
+		status = -1;
+		signal = WTERMSIG(wstatus);
+	} else {
+		status = WEXITSTATUS(wstatus);
+		signal = 0;
+	}
+	steprl(run_status, run_status + sizeof run_status, status);
+	steprl(run_signal, run_signal + sizeof run_signal, signal);
+
+	pid_t child = fork();
+	if (child == 0) {
+		char *instance;
+		if (chdir_at(services[i].name, &instance) < 0)
+			_exit(127);
+
+		dup2(nullfd, 0);
+		if (output_fd(i) != -1)
+			dup2(output_fd(i), 1);
+		// else keep fd 1 to /dev/console
+
+		setsid();
+
+		if (services[i].flags & SV_SYS)
+			instance = (char *)shutdown_mode();
+
+		exec3("finish", run_status, run_signal, instance);
+		_exit(127);
+	} else if (child < 0) {
+		/* fork failed, skip over the finish script */
+		prn(2, "- nitro: can't fork %s/%s: errno=%d\n", services[i].name, "finish", errno);
+		process_step(i, EVNT_FINISHED);
+		return;
+	}
+
+	services[i].finishpid = child;
+	services[i].timeout = TIMEOUT_FINISH;
+	services[i].deadline = 0;
+
+	notify(i);
+}
+
+/* a pseudo-random delay of up to a tenth of ms, to spread out checks */
+static int
+jitter(int ms)
+{
+	static uint32_t x;
+	if (!x)
+		x = (uint32_t)time_now() ^ ((uint32_t)getpid() << 16) ^ 0x9e3779b9;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return ms >= 10 ? (int)(x % (ms / 10)) : 0;
+}
+
+/* run the health check of an UP service */
+void
+proc_check(int i)
+{
+	pid_t child = fork();
+	if (child == 0) {
+		char *instance;
+		if (chdir_at(services[i].name, &instance) < 0)
+			_exit(127);
+
+		dup2(nullfd, 0);
+		if (output_fd(i) != -1)
+			dup2(output_fd(i), 1);
+		// else keep fd 1 to /dev/console
+
+		setsid();
+
+		exec1("check", instance);
+		_exit(127);
+	} else if (child < 0) {
+		prn(2, "- nitro: can't fork %s/%s: errno=%d\n", services[i].name, "check", errno);
+		return;
+	}
+
+	services[i].checkpid = child;
+	services[i].check_start = time_now();
+}
+
+/* account for a finished health check, restart after too many failures */
+void
+check_done(int i, int ok, deadline start)
+{
+	services[i].check_latency = time_now() - start;
+	services[i].check = ok ? 1 : 2;
+	if (ok)
+		services[i].check_fails = 0;
+	else if (services[i].check_fails < 127)
+		services[i].check_fails++;
+	status_update(i);
+
+	if (!ok && services[i].check_fails >= services[i].check_failmax &&
+	    services[i].state == PROC_UP && global_state == GLBL_UP) {
+		prn(2, "- nitro: %s failed its check %d times, restarting\n",
+		    services[i].name, services[i].check_fails);
+		process_step(i, EVNT_WANT_RESTART);
+	}
+}
+
+int
+downsig(int i)
+{
+	int fd = open_svfile(i, "down-signal");
+	if (fd < 0)
+		return SIGTERM;
+
+	char c = 't';
+	(void)! read(fd, &c, 1);
+	close(fd);
+
+	return charsig(c) ? charsig(c) : SIGTERM;
+}
+
+/* apply ./pipe-size of the logger i to its input pipe fd */
+void
+log_pipe_size(int i, int fd)
+{
+#ifdef F_SETPIPE_SZ
+	long size = svfile_num(i, "pipe-size", 0);
+	if (size > 0 && fcntl(fd, F_SETPIPE_SZ, (int)size) < 0)
+		prn(2, "- nitro: can't set pipe size of %s: errno=%d\n",
+		    services[i].name, errno);
+
+	int r = fcntl(fd, F_GETPIPE_SZ);
+	services[i].pipesize = r > 0 ? r : 0;
+#endif
+
+	if (log_sample_interval)
+		log_sample_deadline = 0;        /* start sampling */
+}
+
+/* number of unread bytes in the input pipe of logger i */
+int
+log_pending(int i)
+{
+	int fd = services[i].log_in[0];
+	if (services[i].flags & SV_LOG)
+		fd = globallog[0];
+
+	int n = 0;
+	if (fd < 0 || ioctl(fd, FIONREAD, &n) < 0)
+		return 0;
+
+	if (n > services[i].log_hwm)
+		services[i].log_hwm = n;
+
+	return n;
+}
+
+/* sample the pipe of the logger that service i writes to */
+void
+log_sample_writer(int i)
+{
+	int fd = forward_fd(i);
+
+	for (int j = 0; j < max_service; j++)
+		if ((services[j].flags & SV_LOG) ? fd == globallog[1] :
+		    IS_LOG(j) && services[j].log_in[1] == fd) {
+			log_pending(j);
+			return;
+		}
+}
+
+/* returns 0 if there are no log pipes to watch */
+int
+sample_log_pipes()
+{
+	int loggers = 0;
+
+	for (int i = 0; i < max_service; i++)
+		if (IS_LOG(i)) {
+			status_update(i);       /* samples log_pending */
+			loggers++;
+		}
+
+	return loggers;
+}
+
+/* stop the instance left running by an overlapping restart */
+void
+proc_stop_old(int i)
+{
+	if (!services[i].oldpid || services[i].oldkill)
+		return;         /* already stopping */
+
+	kill(services[i].oldpid, downsig(i));
+	kill(services[i].oldpid, SIGCONT);
+	services[i].oldkill = time_now() + TIMEOUT_SHUTDOWN;
+}
+
+/* the new instance did not come up, keep using the old one */
+void
+proc_rollback(int i)
+{
+	dprn("overlapping restart of %s failed, keeping %d\n",
+	    services[i].name, services[i].oldpid);
+
+	if (services[i].readypipe != -1) {
+		close(services[i].readypipe);
+		services[i].readypipe = -1;
+	}
+
+	services[i].pid = services[i].oldpid;
+	services[i].oldpid = 0;
+	services[i].oldkill = 0;
+	services[i].state = PROC_UP;
+	services[i].timeout = 0;
+	services[i].deadline = 0;
+
+	notify(i);
+}
+
+/* start a second instance, and only stop the old one once it is up */
+int
+proc_overlap(int i)
+{
+	struct stat st;
+
+	if (services[i].state != PROC_UP || !services[i].pid ||
+	    services[i].oldpid ||
+	    (services[i].flags & (SV_LOG | SV_SYS)) ||
+	    stat_slash_to_at(services[i].name, "restart-overlap", &st) < 0 ||
+	    stat_slash_to_at(services[i].name, "run", &st) < 0)
+		return 0;
+
+	dprn("overlapping restart of %s\n", services[i].name);
+
+	if (services[i].readypipe != -1) {
+		close(services[i].readypipe);
+		services[i].readypipe = -1;
+	}
+
+	services[i].oldpid = services[i].pid;
+	services[i].oldkill = 0;
+	services[i].pid = 0;
+
+	proc_launch(i);
+
+	/* proc_launch goes FATAL through EVNT_EXITED, which rolls back */
+	if (services[i].oldpid && services[i].state == PROC_DELAY)
+		proc_rollback(i);
+
+	return 1;
+}
+
+/* the service is ready, retire the old instance */
+void
+proc_ready(int i)
+{
+	services[i].deadline = 0;
+	services[i].timeout = 0;
+	services[i].state = PROC_UP;
+	services[i].watchdog_ping = time_now();
+	proc_stop_old(i);
+	notify(i);
+}
+
+/* the result of connecting to ./probe: ready when STARTING, else a check */
+void
+probe_done(int i, int ok)
+{
+	services[i].probe_next = 0;
+
+	if (services[i].state == PROC_STARTING) {
+		if (ok) {
+			dprn("service %s is ready\n", services[i].name);
+			proc_ready(i);
+		}
+	} else if (services[i].state == PROC_UP) {
+		check_done(i, ok, services[i].probe_start);
+	}
+}
+
+/* start a non-blocking connect to ./probe, finished in probe_finish */
+void
+probe_connect(int i)
+{
+	services[i].probe_start = time_now();
+
+	int fd = socket(services[i].probe_addr.sa.sa_family,
+	    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		probe_done(i, 0);
+		return;
+	}
+
+	if (connect(fd, &services[i].probe_addr.sa,
+	    services[i].probe_addrlen) == 0) {
+		close(fd);
+		probe_done(i, 1);
+	} else if (errno == EINPROGRESS) {
+		services[i].probefd = fd;
+	} else {
+		close(fd);
+		probe_done(i, 0);
+	}
+}
+
+void
+probe_finish(int i, int timed_out)
+{
+	int err = 0;
+	socklen_t len = sizeof err;
+	if (!timed_out &&
+	    getsockopt(services[i].probefd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	close(services[i].probefd);
+	services[i].probefd = -1;
+	probe_done(i, !timed_out && err == 0);
+}
+
+/* find the next run in ./schedule: N (seconds since the last run) or
+   HH:MM (local time), one per line */
+void
+sched_plan(int i, deadline now)
+{
+	char buf[512];
+	int fd = open_svfile(i, "schedule");
+	ssize_t r = fd < 0 ? -1 : read(fd, buf, sizeof buf - 1);
+	if (fd >= 0)
+		close(fd);
+	if (r < 0)
+		r = 0;
+	buf[r] = 0;
+
+	time_t wall = time(0);
+	struct tm tm;
+	localtime_r(&wall, &tm);
+
+	int catchup = svfile_exists(i, "catch-up");
+	deadline next = 0;
+	time_t next_wall = 0;
+
+	char *line, *end;
+	for (line = buf; *line; line = end) {
+		end = line + strcspn(line, "\n");
+		if (*end)
+			*end++ = 0;
+
+		long n = 0, m = -1;
+		char *p = line;
+		for (; ((unsigned int)*p - '0') < 10; p++)
+			n = n*10 + (*p - '0');
+		if (*p == ':' && p > line) {
+			m = 0;
+			for (p++; ((unsigned int)*p - '0') < 10; p++)
+				m = m*10 + (*p - '0');
+		}
+
+		if (!*line || *line == '#') {
+			continue;
+		} else if (*p || p == line || (n == 0 && m < 0) ||
+		    (m >= 0 && (n > 23 || m > 59))) {
+			prn(2, "- nitro: invalid schedule %s for %s\n",
+			    line, services[i].name);
+		} else if (m < 0) {             /* every n seconds */
+			deadline base = services[i].last_run ?
+			    services[i].last_run : now;
+			deadline d = base + n * 1000;
+			if (d <= now)           /* missed while running */
+				d = catchup ? now : now + n * 1000 -
+				    (now - base) % (n * 1000);
+			if (!next || d < next) {
+				next = d;
+				next_wall = 0;
+			}
+		} else {                        /* daily at n:m */
+			struct tm at = tm;
+			at.tm_hour = n;
+			at.tm_min = m;
+			at.tm_sec = 0;
+			time_t w = mktime(&at);
+			if (w <= wall) {
+				at.tm_mday++;
+				at.tm_isdst = -1;
+				w = mktime(&at);
+			}
+			deadline d = now + (w - wall) * 1000;
+			if (!next || d < next) {
+				next = d;
+				next_wall = w;
+			}
+		}
+	}
+
+	services[i].sched_next = next;
+	services[i].sched_wall = next_wall;
+	if (!next)
+		services[i].scheduled = 0;      /* until the next rescan */
+	status_update(i);
+}
+
+/* the time for a scheduled run has come */
+void
+sched_run(int i)
+{
+	int catchup = svfile_exists(i, "catch-up");
+	int late = services[i].sched_wall &&
+	    time(0) > services[i].sched_wall + SCHED_LATE;
+
+	if (services[i].state != PROC_DOWN &&
+	    services[i].state != PROC_FATAL &&
+	    services[i].state != PROC_DELAY) {
+		if (catchup)
+			services[i].sched_pending = 1;
+		else
+			prn(2, "- nitro: %s still running, skipping a run\n",
+			    services[i].name);
+	} else if (svfile_exists(i, "down")) {
+		;                               /* paused */
+	} else if (late && !catchup) {
+		prn(2, "- nitro: %s missed its time, skipping a run\n",
+		    services[i].name);
+	} else {
+		services[i].last_run = time_now();
+		process_step(i, EVNT_WANT_UP);
+	}
+}
+
+void
+proc_shutdown(int i)
+{
+	if (services[i].setuppid) {
+		kill(services[i].setuppid, SIGTERM);
+		kill(services[i].setuppid, SIGCONT);
+	}
+
+	if (services[i].pid) {
+		kill(services[i].pid, downsig(i));
+		kill(services[i].pid, SIGCONT);
+	}
+
+	proc_stop_old(i);
+
+	if (services[i].flags & SV_LOG)
+		globallog[1] = -globallog[1];
+
+	if (services[i].state != PROC_SHUTDOWN &&
+	    services[i].state != PROC_RESTART) {
+		services[i].state = PROC_SHUTDOWN;
+		services[i].timeout = TIMEOUT_SHUTDOWN;
+		services[i].deadline = 0;
+	}
+}
+
+void
+proc_kill(int i)
+{
+	assert(services[i].state == PROC_SHUTDOWN ||
+	    services[i].state == PROC_RESTART ||
+	    services[i].state == PROC_ONESHOT);
+
+	if (services[i].setuppid)
+		kill(services[i].setuppid, SIGKILL);
+
+	if (services[i].pid)
+		kill(services[i].pid, SIGKILL);
+
+	if (services[i].oldpid)
+		kill(services[i].oldpid, SIGKILL);
+
+	if (services[i].finishpid)
+		kill(services[i].finishpid, SIGKILL);
+}
+
+void
+proc_cleanup(int i)
+{
+	/* the old instance finishes on its own, or is killed at oldkill */
+	proc_stop_old(i);
+
+	services[i].pid = 0;
+	services[i].setuppid = 0;
+	services[i].finishpid = 0;
+	services[i].timeout = 0;
+	services[i].deadline = 0;
+	services[i].state = PROC_DOWN;
+	services[i].startstop = time_now();
+	trigger_rearm(i);
+
+	if (services[i].readypipe != -1) {
+		close(services[i].readypipe);
+		services[i].readypipe = -1;
+	}
+
+	if (global_state != GLBL_UP) {
+		if (services[i].log_in[0] > 0) {
+			close(services[i].log_in[0]);
+			close(services[i].log_in[1]);
+		}
+		if (services[i].log_out[1] > 0) {
+			close(services[i].log_out[0]);
+			close(services[i].log_out[1]);
+		}
+		services[i].log_in[0] = -1;
+		services[i].log_in[1] = -1;
+		services[i].log_out[0] = -1;
+		services[i].log_out[1] = -1;
+		listen_close(i);
+		fdstore_close(i);
+	}
+
+	notify(i);
+}
+
+static void
+close_fd(int fd)
+{
+	if (fd < 0)
+		return;
+
+	for (int i = 0; i < max_service; i++) {
+		if (services[i].log_in[0] == fd)
+			services[i].log_in[0] = -1;
+		if (services[i].log_in[1] == fd)
+			services[i].log_in[1] = -1;
+		if (services[i].log_out[0] == fd)
+			services[i].log_out[0] = -1;
+		if (services[i].log_out[1] == fd)
+			services[i].log_out[1] = -1;
+	}
+	close(fd);
+}
+
+void
+proc_zap(int i) {
+	if (services[i].oldpid)
+		return;         /* zapped once the old instance is reaped */
+
+	if (!services[i].seen) {
+		/* close the log pipes and remove all references to it */
+		close_fd(services[i].log_in[0]);
+		close_fd(services[i].log_in[1]);
+		ring_free(i);
+		listen_close(i);
+		fdstore_close(i);
+		transient_free(i);
+		trigger_unwatch(i);
+		if (services[i].probefd >= 0)
+			close(services[i].probefd);
+
+		/* a service that is gone won't reach any other state */
+		for (int w = 0; services[i].waiters && w < MAXWAITERS; w++)
+			if ((services[i].waiters & (1u << w)) &&
+			    !(waiters[w].want & STATEBIT(services[i].state)))
+				waiter_reply(w, T_EFAIL, i);
+
+		dprn("can garbage-collect %s\n", services[i].name);
+
+		if (max_service > 0) {
+			services[i] = services[--max_service];
+		} else {
+			assert(i == 0);
+			services[i] = (struct service) { 0 };
+		}
+		status_update(-1);
+	}
+}
+
+void
+process_step(int i, enum process_events ev)
+{
+	dprn("process %s[%d] state %d step %d\n",
+	    services[i].name, services[i].pid,
+	    services[i].state, ev);
+
+	switch (ev) {
+	case EVNT_WANT_UP:
+		if (global_state != GLBL_UP)
+			break;
+		switch (services[i].state) {
+		case PROC_ONESHOT:
+		case PROC_SETUP:
+		case PROC_STARTING:
+		case PROC_UP:
+		case PROC_RESTART:
+			/* ignore, is up */
+			break;
+
+		case PROC_SHUTDOWN:
+			services[i].state = PROC_RESTART;
+			break;
+
+		case PROC_DOWN:
+		case PROC_FATAL:
+		case PROC_DELAY:
+			proc_setup(i);
+			break;
+		}
+		break;
+
+	case EVNT_WANT_DOWN:
+		if (services[i].transient)
+			services[i].seen = 0;   /* remove once down */
+		switch (services[i].state) {
+		case PROC_RESTART:
+			services[i].state = PROC_SHUTDOWN;
+			/* fallthrough */
+		case PROC_SETUP:
+		case PROC_STARTING:
+		case PROC_UP:
+		case PROC_SHUTDOWN:
+			proc_shutdown(i);
+			break;
+
+		case PROC_ONESHOT:
+			proc_finish(i);
+			break;
+
+		case PROC_FATAL:
+		case PROC_DELAY:
+		case PROC_DOWN:
+			services[i].state = PROC_DOWN;
+			services[i].timeout = 0;
+			services[i].deadline = 0;
+			trigger_rearm(i);
+			break;
+		}
+		break;
+
+	case EVNT_WANT_RESTART:
+		if (global_state != GLBL_UP)
+			break;
+		switch (services[i].state) {
+		case PROC_UP:
+			if (proc_overlap(i))
+				break;
+			/* fallthrough */
+		case PROC_SETUP:
+		case PROC_STARTING:
+		case PROC_RESTART:
+		case PROC_SHUTDOWN:
+			proc_shutdown(i);
+			services[i].state = PROC_RESTART;
+			break;
+
+		case PROC_ONESHOT:
+			services[i].state = PROC_RESTART;
+			proc_finish(i);
+			break;
+
+		case PROC_DOWN:
+		case PROC_FATAL:
+		case PROC_DELAY:
+			proc_setup(i);
+			break;
+		}
+		break;
+
+	case EVNT_SETUP:
+		switch (services[i].state) {
+		case PROC_ONESHOT:
+		case PROC_STARTING:
+		case PROC_UP:
+		case PROC_RESTART:
+		case PROC_SHUTDOWN:
+		case PROC_FATAL:
+		case PROC_DELAY:
+		case PROC_DOWN:
+			assert(!"invalid state transition");
+
+		case PROC_SETUP:
+			if (global_state == GLBL_UP)
+				proc_launch(i);
+			else
+				proc_cleanup(i);
+			break;
+		}
+		break;
+
+	case EVNT_EXITED:
+		services[i].timeout = 0;
+		services[i].deadline = 0;
+		if (services[i].oldpid && !services[i].oldkill &&
+		    (services[i].state == PROC_STARTING ||
+		    services[i].state == PROC_FATAL)) {
+			proc_rollback(i);
+			break;
+		}
+		if (services[i].transient &&
+		    (services[i].state == PROC_STARTING ||
+		    services[i].state == PROC_UP)) {
+			/* transient services run once */
+			services[i].state = PROC_SHUTDOWN;
+			services[i].seen = 0;
+		}
+		if (services[i].scheduled &&
+		    (services[i].state == PROC_STARTING ||
+		    services[i].state == PROC_UP)) {
+			/* scheduled services run until the next time */
+			services[i].last_duration =
+			    time_now() - services[i].startstop;
+			services[i].state = PROC_SHUTDOWN;
+		}
+		switch (services[i].state) {
+		case PROC_UP:
+			services[i].state = PROC_RESTART;
+			proc_finish(i);
+			break;
+
+		case PROC_STARTING:
+		case PROC_RESTART:
+		case PROC_SHUTDOWN:
+		case PROC_FATAL:
+			proc_finish(i);
+			break;
+
+		case PROC_SETUP:               /* can't happen */
+		case PROC_DOWN:                /* can't happen */
+		case PROC_DELAY:               /* can't happen */
+		case PROC_ONESHOT:             /* can't happen */
+			assert(!"invalid state transition");
+			break;
+		}
+		break;
+
+	case EVNT_FINISHED:
+		services[i].timeout = 0;
+		services[i].deadline = 0;
+		switch (services[i].state) {
+		case PROC_UP:
+		case PROC_STARTING:
+		case PROC_RESTART: ;
+			deadline uptime = time_now() - services[i].startstop;
+			proc_cleanup(i);
+			if (global_state != GLBL_UP)
+				break;
+			if (uptime < DELAY_RESPAWN) {
+				/* delay too quick restarts */
+				services[i].state = PROC_DELAY;
+				services[i].timeout = DELAY_RESPAWN;
+				services[i].deadline = 0;
+			} else {
+				proc_setup(i);
+			}
+			break;
+
+		case PROC_ONESHOT:
+		case PROC_SHUTDOWN:
+			fdstore_close(i);
+			proc_cleanup(i);
+			proc_zap(i);
+			break;
+
+		case PROC_FATAL:
+			proc_cleanup(i);
+			services[i].state = PROC_FATAL;
+			notify(i);
+			break;
+
+		case PROC_SETUP:               /* can't happen */
+		case PROC_DOWN:                /* can't happen */
+		case PROC_DELAY:               /* can't happen */
+			assert(!"invalid state transition");
+			break;
+		}
+		break;
+
+	case EVNT_ACTIVATE:
+		if (global_state != GLBL_UP)
+			break;
+		if (services[i].state == PROC_DOWN) {
+			dprn("activating %s\n", services[i].name);
+			proc_setup(i);
+		}
+		else if (services[i].idle_timeout > 0 &&
+		    (services[i].state == PROC_STARTING ||
+		    services[i].state == PROC_UP))
+			idle_activity(i);
+		break;
+
+	case EVNT_TIMEOUT:
+		services[i].timeout = 0;
+		services[i].deadline = 0;
+		switch (services[i].state) {
+		case PROC_DELAY:
+			if (global_state == GLBL_WAIT_TERM)
+				slayall();
+			else if (global_state == GLBL_WAIT_KILL)
+				global_state = GLBL_FINAL;
+			else
+				proc_setup(i);
+			break;
+
+		case PROC_STARTING:
+			proc_ready(i);
+			break;
+
+		case PROC_RESTART:
+		case PROC_SHUTDOWN:
+		case PROC_ONESHOT:
+			proc_kill(i);
+			break;
+
+		case PROC_UP:
+		case PROC_DOWN:
+		case PROC_FATAL:
+		case PROC_SETUP:
+			assert(!"invalid timeout handler");
+			break;
+		}
+		break;
+	}
+	status_update(i);
+	state_changed = 1;
+}
+
+void
+on_signal(int sig)
+{
+	int old_errno = errno;
+
+	switch (sig) {
+	case SIGPIPE:           /* ignore, but don't use SIG_IGN */
+		return;
+	case SIGINT:
+		if (real_pid1)
+			want_reboot = 1;    /* Linux Ctrl-Alt-Delete */
+		else
+			want_shutdown = 1;
+		break;
+	case SIGTERM:
+		want_shutdown = 1;
+		break;
+	case SIGHUP:
+		want_rescan = 1;
+		break;
+	case SIGCHLD:           /* just selfpipe */
+		break;
+	default:
+#ifdef SIGRTMIN
+		if (sig == SIGRTMIN + 6)        /* as systemd */
+			want_reboot = want_kexec = 1;
+#endif
+		break;
+	}
+
+	ssize_t r;
+	do {
+		r = write(selfpipe[1], "", 1);
+	} while (r == -1 && errno == EINTR);
+
+	errno = old_errno;
+}
+
+int
+find_service(const char *name)
+{
+	for (int i = 0; i < max_service; i++)
+		if (strcmp(services[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+/* the SV_* flags of a service called name */
+int
+name_flags(const char *name)
+{
+	if (strcmp(name, "LOG") == 0)
+		return SV_LOG;
+	if (strcmp(name, "SYS") == 0)
+		return SV_SYS;
+	if (strncmp(name, "LOG@", 4) == 0)
+		return SV_INSTANCE | SV_LOG_INSTANCE;
+	if (strchr(name, '@'))
+		return SV_INSTANCE;
+	return 0;
+}
+
+/* allocate a slot for service name, which is started soon */
+int
+new_service(const char *name)
+{
+	int i = max_service;
+
+	if (strlen(name) >= sizeof (services[i].name)) {
+		return -1;
+	} else if (max_service >= maxsv - 1) {
+		prn(2, "- nitro: too many services, limit=%d\n", maxsv);
+		return -1;
+	}
+
+	max_service++;
+	if (max_service > service_hwm)
+		service_hwm = max_service;
+
+	services[i] = (struct service){ 0 };
+	stecpy(services[i].name, services[i].name + sizeof services[i].name, name);
+	services[i].flags = name_flags(name);
+	services[i].pid = 0;
+	services[i].state = PROC_DELAY;
+	services[i].startstop = time_now();
+	services[i].timeout = 1;
+	services[i].deadline = 0;
+
+	services[i].log_in[0] = -1;
+	services[i].log_in[1] = -1;
+
+	services[i].readypipe = -1;
+	services[i].probefd = -1;
+
+	if (services[i].flags & SV_LOG)
+		services[i].log_in[0] = PENDING_FD;
+
+	status_update(i);
+
+	return i;
+}
+
+int log_attach(int i, char *target_name);
+
+int
+add_service(const char *name)
+{
+	int i;
+	for (i = 0; i < max_service; i++)
+		if (strcmp(services[i].name, name) == 0)
+			goto refresh_log;
+
+	struct stat st;
+	if (strcmp(name, "SYS") != 0 &&
+	    strcmp(name, ".SHUTDOWN") != 0 &&
+	    stat_slash_to_at(name, "run", &st) != 0 &&
+	    stat_slash_to_at(name, "setup", &st) != 0) {
+		prn(2, "- nitro: no such service: %s\n", name);
+		return -1;
+	}
+
+	/* else set up a new service */
+
+	i = new_service(name);
+	if (i < 0)
+		return -1;
+
+refresh_log:
+ 	if (services[i].log_out[1] == PENDING_FD)
+		return i;
+
+	if (services[i].flags & SV_LOG)
+		log_pipe_size(i, globallog[0]);
+
+	services[i].log_out[0] = -1;
+	services[i].log_out[1] = -1;
+
+	char log_target[PATH_MAX];
+	char log_link[PATH_MAX];
+	char s = 0;
+	char *instance = strchr(name, '@');
+	if (instance) {
+		instance++;
+		s = *instance;
+		*instance = 0;
+	}
+	sprn(log_link, log_link + sizeof log_link, "%s/log", name);
+	if (instance)
+		*instance = s;
+
+	ssize_t r = readlink(log_link, log_target, sizeof log_target - 1);
+	if (r < 0) {
+		if (errno == EINVAL)
+			prn(2, "warning: ignoring log, it is not a symlink: %s\n", name);
+		if (errno == ENOENT &&
+		    !(services[i].flags & (SV_LOG | SV_LOG_INSTANCE)) && // no loops
+		    !(services[i].flags & SV_SYS) &&        // too soon
+		    stat("LOG@", &st) == 0 &&
+		    S_ISDIR(st.st_mode))
+			stecpy(log_target, log_target + sizeof log_target,
+			    "LOG@");
+		else
+			return i;
+	}
+
+	/* just interpret the last path segment as service name */
+	log_target[r] = 0;
+	char *target_name = strrchr(log_target, '/');
+	if (target_name)
+		target_name++;
+	else
+		target_name = log_target;
+
+	size_t n = strlen(target_name);
+	if (target_name[n-1] == '@')
+		stecpy(target_name + n, log_target + sizeof log_target,
+		    instance ? instance : name);
+
+	log_attach(i, target_name);
+	return i;
+}
+
+/* connect the output of service i to the log service target_name */
+int
+log_attach(int i, char *target_name)
+{
+	services[i].log_out[1] = PENDING_FD;
+
+	int created = find_service(target_name) < 0;
+	int j = add_service(target_name);
+	if (j < 0) {
+		services[i].log_out[1] = -1;
+		return -1;
+	}
+
+	services[j].seen = 1; /* mark @ service used */
+	if (services[j].log_in[0] == -1) {
+		if (pipe2(services[j].log_in, O_CLOEXEC) < 0) {
+			prn(2, "- nitro: can't create log pipe: errno=%d\n", errno);
+			services[j].log_in[0] = -1;
+			services[j].log_in[1] = -1;
+		}
+	}
+	if (services[j].log_in[0] >= 0)
+		log_pipe_size(j, services[j].log_in[0]);
+
+	services[i].log_out[0] = services[j].log_in[0];
+	services[i].log_out[1] = services[j].log_in[1];
+
+	if (created) {
+		services[j].state = PROC_DOWN;
+		services[j].timeout = 0;
+	}
+
+	return j;
+}
+
+static void
+reopendir(DIR **d)
+{
+#ifdef REOPEN_USE_CLOSEDIR
+	DIR *newd = opendir(servicedir);
+	if (!newd)
+		return;
+	closedir(*d);
+	*d = newd;
+	(void)!fchdir(dirfd(newd));
+#else
+
+	// avoid OpenBSD bug: ensure we hit end, so rewinddir forces re-read.
+	while (readdir(*d))
+		;
+
+#ifdef REOPEN_USE_DUP_HACK
+	// this fiddles in the internals of DIR, use only if you vetted
+	// your libc to tolerate this!
+	int fd = open(servicedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (dup3(fd, dirfd(*d), O_CLOEXEC) < 0)
+			close(fd);
+		else
+			(void)!fchdir(dirfd(*d));
+	}
+#endif
+
+	rewinddir(*d);
+#endif
+}
+
+/* the number of instances wanted for template tmpl, or -1 if unset */
+int
+scale_count(const char *tmpl)
+{
+	for (int k = 0; k < MAXSCALE; k++)
+		if (strcmp(scales[k].name, tmpl) == 0)
+			return scales[k].count;
+
+	char path[PATH_MAX];
+	sprn(path, path + sizeof path, "%s/instances", tmpl);
+	long n = read_num(open(path, O_RDONLY | O_CLOEXEC), -1);
+	return n > maxsv ? maxsv : n;
+}
+
+int
+scale_set(const char *tmpl, int n)
+{
+	int slot = -1;
+	for (int k = 0; k < MAXSCALE; k++) {
+		if (strcmp(scales[k].name, tmpl) == 0) {
+			scales[k].count = n;
+			return 0;
+		}
+		if (!scales[k].name[0] && slot < 0)
+			slot = k;
+	}
+	if (slot < 0 || strlen(tmpl) >= sizeof scales[slot].name)
+		return -1;
+
+	stecpy(scales[slot].name, scales[slot].name + sizeof scales[slot].name, tmpl);
+	scales[slot].count = n;
+	return 0;
+}
+
+/* is inst a number beyond the instance count n? */
+static int
+scale_excess(const char *inst, int n)
+{
+	if (n < 0 || !*inst)
+		return 0;
+
+	long k = 0;
+	for (; *inst; inst++) {
+		if (*inst < '0' || *inst > '9')
+			return 0;
+		if (k <= maxsv)
+			k = k*10 + (*inst - '0');
+	}
+	return k > n;
+}
+
+/* make sure the instances 1 to n of template tmpl exist */
+static void
+scale_up(const char *tmpl, int n)
+{
+	for (int k = 1; k <= n; k++) {
+		char name[64];
+		steprl(stecpy(name, name + sizeof name, tmpl), name + sizeof name, k);
+		if (!valid_service_name(name))
+			break;
+
+		int i = add_service(name);
+		if (i < 0)
+			break;
+		services[i].seen = 1;
+	}
+}
+
+#ifdef __linux__
+/* watch the nearest existing directory above path, return the watch
+   descriptor or -1, and whether it is the parent of path */
+static int
+trigger_watch(const char *path, int *parent)
+{
+	char dir[PATH_MAX];
+	stecpy(dir, dir + sizeof dir, path);
+
+	char *s;
+	for (*parent = 1; (s = strrchr(dir, '/')); *parent = 0) {
+		s[s == dir] = 0;
+		int wd = inotify_add_watch(inotifyfd, dir, IN_CREATE | IN_MOVED_TO |
+		    IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+		if (wd >= 0)
+			return wd;
+		if (s == dir)
+			break;
+	}
+	return -1;
+}
+
+/* do the inotify events in ev remove path from the directory wd? */
+static int
+trigger_removed(const char *path, int wd, const char *ev, ssize_t len)
+{
+	const char *base = strrchr(path, '/') + 1;
+	const char *p = ev;
+	while (wd >= 0 && p < ev + len) {
+		const struct inotify_event *e = (const struct inotify_event *)p;
+		if (e->wd == wd && (e->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+		    e->len && strcmp(e->name, base) == 0)
+			return 1;
+		p += sizeof *e + e->len;
+	}
+	return 0;
+}
+
+/* is the watch wd in use by any service? */
+static int
+trigger_wd_used(int wd)
+{
+	for (int i = 0; i < max_service; i++)
+		for (int k = 0; k < MAXTRIGGER; k++)
+			if (services[i].trigger_wd[k] == wd)
+				return 1;
+	return 0;
+}
+
+/* replace the watches of service i by the nwd ones just added in wds,
+   or by none unless keep, and remove the watches nobody uses anymore */
+static void
+trigger_keep(int i, const int *wds, int nwd, int keep)
+{
+	int old[MAXTRIGGER];
+	memcpy(old, services[i].trigger_wd, sizeof old);
+	for (int k = 0; k < MAXTRIGGER; k++)
+		services[i].trigger_wd[k] = keep && k < nwd ? wds[k] : 0;
+
+	for (int k = 0; k < MAXTRIGGER + nwd; k++) {
+		int wd = k < MAXTRIGGER ? old[k] : wds[k - MAXTRIGGER];
+		if (wd > 0 && !trigger_wd_used(wd))
+			inotify_rm_watch(inotifyfd, wd);
+	}
+}
+
+/* do the inotify events in ev concern a watch of service i? */
+static int
+trigger_event(int i, const char *ev, ssize_t len)
+{
+	const char *p = ev;
+	while (p < ev + len) {
+		const struct inotify_event *e = (const struct inotify_event *)p;
+		for (int k = 0; k < MAXTRIGGER; k++)
+			if (services[i].trigger_wd[k] == e->wd)
+				return 1;
+		p += sizeof *e + e->len;
+	}
+	return 0;
+}
+
+void
+open_trigger_watch()
+{
+	inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyfd < 0)
+		prn(2, "- nitro: inotify: errno=%d\n", errno);
+	/* poll signals POLLPRI when the mount table changes */
+	mountsfd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+}
+#endif
+
+/* drop the watches of service i, when it has no ./trigger anymore */
+void
+trigger_unwatch(int i)
+{
+#ifdef __linux__
+	if (inotifyfd >= 0)
+		trigger_keep(i, 0, 0, 0);
+#endif
+}
+
+/* bring up service i if one of its ./trigger paths appeared since the
+   last look, ev are the inotify events that caused the look, if any.
+   The paths are only watched while the service could be triggered,
+   that is until it is brought up, and again once it is DOWN. */
+static void
+trigger_look(int i, const char *ev, ssize_t evlen)
+{
+	char buf[1024];
+	int fd = open_svfile(i, "trigger");
+	ssize_t r = fd < 0 ? -1 : read(fd, buf, sizeof buf - 1);
+	if (fd >= 0)
+		close(fd);
+	if (r < 0)
+		r = 0;
+	buf[r] = 0;
+
+	int wds[MAXTRIGGER];
+	int nwd = 0;
+	int exists = 0, removed = 0, kept = 0;
+	char *line, *end;
+	for (line = buf; *line && nwd < MAXTRIGGER; line = end) {
+		end = line + strcspn(line, "\n");
+		if (*end)
+			*end++ = 0;
+		if (*line != '/')
+			continue;
+		int gone = 0;
+		wds[nwd++] = 0;
+#ifdef __linux__
+		if (inotifyfd >= 0) {
+			int parent;
+			int wd = trigger_watch(line, &parent);
+			wds[nwd - 1] = wd > 0 ? wd : 0;
+			gone = parent && trigger_removed(line, wd, ev, evlen);
+		}
+#endif
+		removed |= gone;
+		if (access(line, F_OK) == 0) {
+			exists = 1;
+			kept |= !gone;
+		}
+	}
+
+	/* removed and created again since the last look */
+	if (removed && !kept)
+		services[i].trigger = 1;
+
+	if (!exists) {
+		services[i].trigger = 1;
+	} else if (services[i].trigger == 1) {
+		services[i].trigger = 2;
+		if (services[i].state == PROC_DOWN &&
+		    global_state == GLBL_UP) {
+			dprn("trigger for %s appeared\n", services[i].name);
+			process_step(i, EVNT_WANT_UP);
+		}
+	}
+
+#ifdef __linux__
+	if (inotifyfd >= 0)
+		trigger_keep(i, wds, nwd, services[i].trigger == 1 ||
+		    services[i].state == PROC_DOWN);
+#endif
+}
+
+/* look at the ./trigger paths of all services, or with inotify events
+   in ev, only of those with a watch among them */
+void
+trigger_check(const char *ev, ssize_t evlen)
+{
+	for (int i = 0; i < max_service; i++) {
+		if (!services[i].trigger)
+			continue;
+#ifdef __linux__
+		if (ev && !trigger_event(i, ev, evlen))
+			continue;
+#endif
+		trigger_look(i, ev, evlen);
+	}
+}
+
+/* service i went DOWN, watch its ./trigger paths again */
+void
+trigger_rearm(int i)
+{
+	if (services[i].trigger == 2)
+		trigger_look(i, 0, 0);
+}
+
+#ifdef __linux__
+void
+handle_trigger_watch()
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t r;
+
+	while ((r = read(inotifyfd, buf, sizeof buf)) > 0)
+		trigger_check(buf, r);
+}
+#endif
+
+void
+rescan()
+{
+	int i;
+
+	for (i = 0; i < max_service; i++)
+		if (!services[i].transient)
+			services[i].seen = 0;
+
+	reopendir(&cwd);
+
+	struct dirent *ent;
+	while ((ent = readdir(cwd))) {
+		char *name = ent->d_name;
+		struct stat st;
+
+		if (stat(name, &st) < 0)
+			continue;
+		if (!S_ISDIR(st.st_mode))
+			continue;
+
+		if (name[0] == '@')     // group
+			continue;
+
+		if (name[strlen(name) - 1] == '@') {
+			// mark parametrized services seen, unless scaled away
+			size_t prefixlen = strlen(name);
+			int n = scale_count(name);
+			for (i = 0; i < max_service; i++)
+				if (strncmp(name, services[i].name, prefixlen) == 0 &&
+				    services[i].state != PROC_DOWN &&
+				    !scale_excess(services[i].name + prefixlen, n)) {
+					services[i].seen = 1;
+				}
+
+			scale_up(name, n);
+			continue;
+		}
+
+		if (!valid_service_name(name))
+			continue;
+
+		int created = find_service(name) < 0;
+		int i = add_service(name);
+		if (i < 0)
+			continue;
+
+		listen_setup(i);
+
+		services[i].scheduled = stat_slash(name, "schedule", &st) == 0;
+		if (!services[i].scheduled)
+			services[i].sched_next = 0;
+
+		if (!svfile_exists(i, "trigger")) {
+			services[i].trigger = 0;
+			trigger_unwatch(i);
+		} else if (!services[i].trigger)
+			services[i].trigger = 1;
+
+		if (created) {
+			ondemand_setup(i);
+			if (services[i].ondemand || services[i].scheduled ||
+			    services[i].trigger ||
+			    stat_slash(name, "down", &st) == 0) {
+				services[i].state = PROC_DOWN;
+				services[i].timeout = 0;
+			}
+		}
+
+		services[i].seen = 1;
+	}
+
+	// iterate backwards so we can zap
+	for (i = max_service - 1; i >= 0; i--) {
+		if (IS_LOG(i) && services[i].state == PROC_DOWN &&
+		    (services[i].flags & SV_INSTANCE)) {
+			services[i].seen = 0;
+			for (int j = 0; j < max_service; j++)
+				if (i != j && services[i].log_in[1] == services[j].log_out[1]) {
+					services[i].seen = 1;
+					break;
+				}
+		}
+		if (!services[i].seen) {
+			process_step(i, EVNT_WANT_DOWN);
+			if (services[i].state == PROC_DOWN)
+				proc_zap(i);
+		}
+	}
+
+	trigger_check(0, 0);
+}
+
+void
+own_console()
+{
+	int ttyfd = open("/dev/console", O_RDWR);
+	if (ttyfd < 0)
+		return;
+	dup2(ttyfd, 0);
+	dup2(ttyfd, 1);
+	dup2(ttyfd, 2);
+	if (ttyfd > 2)
+		close(ttyfd);
+	ioctl(0, TIOCSCTTY, 1);
+}
+
+void
+do_stop_services()
+{
+	global_state = GLBL_SHUTDOWN;
+
+	int up = 0;
+	for (int i = 0; i < max_service; i++) {
+		if (IS_LOG(i))
+			continue;
+
+		process_step(i, EVNT_WANT_DOWN);
+
+		if (!(services[i].state == PROC_DOWN ||
+		    services[i].state == PROC_FATAL))
+			up++;
+	}
+
+	if (up)
+		prn(2, "- nitro: waiting for %d services to finish", up);
+}
+
+void
+do_shutdown()
+{
+	if (global_state == GLBL_UP) {
+		global_state = GLBL_WAIT_FINISH;
+
+		if (want_softreboot)
+			prn(2, "- nitro: soft-rebooting\n");
+		else if (want_kexec)
+			prn(2, "- nitro: rebooting with kexec\n");
+		else if (want_reboot)
+			prn(2, "- nitro: rebooting\n");
+		else
+			prn(2, "- nitro: shutting down\n");
+
+		if (pid1)
+			own_console();
+#ifdef __linux__
+		if (real_pid1)
+			reboot(RB_ENABLE_CAD);
+#endif
+
+		struct stat st;
+		if (stat("SYS/finish", &st) == 0) {
+			int b = add_service("SYS");
+			services[b].state = PROC_ONESHOT;
+			process_step(b, EVNT_WANT_DOWN);
+			/* got zapped or is down */
+			if (!(services[b].flags & SV_SYS) ||
+			    services[b].state == PROC_DOWN)
+				do_stop_services();
+			else
+				services[b].timeout = TIMEOUT_SYS_FINISH;
+		} else {
+			do_stop_services();
+		}
+	} else if (global_state == GLBL_WAIT_FINISH) {
+		do_stop_services();
+	}
+}
+
+void
+open_notify_dir()
+{
+	control_socket_path = control_socket();
+	char *last_slash = strrchr(control_socket_path, '/');
+	if (last_slash) {
+		char dir[PATH_MAX];
+		memcpy(dir, control_socket_path, last_slash - control_socket_path);
+		dir[last_slash - control_socket_path] = 0;
+		/* others may traverse it to reach notify.sock, the control
+		   socket and notify dir are private by their own modes */
+		mkdir(dir, 0711);
+		// ignore errors
+
+		sprn(notifypath, notifypath + sizeof notifypath, "%s/notify", dir);
+		mkdir(notifypath, 0700);
+		// ignore errors
+
+		notifydir = opendir(notifypath);
+		if (!notifydir)
+			fatal("could not create notify dir %s: errno=%d\n", notifypath, errno);
+
+		sprn(notifysockpath, notifysockpath + sizeof notifysockpath,
+		    "%s/notify.sock", dir);
+
+		status_open(dir);
+	}
+}
+
+#ifdef __linux__
+/* bind the socket services with ./notify-socket send sd_notify messages to */
+void
+open_notify_socket()
+{
+	struct sockaddr_un addr = { 0 };
+	addr.sun_family = AF_UNIX;
+	stecpy(addr.sun_path, addr.sun_path + sizeof addr.sun_path, notifysockpath);
+
+	if (!*notifysockpath)
+		return;
+
+	notifysock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (notifysock < 0) {
+		prn(2, "- nitro: notify socket: errno=%d\n", errno);
+		return;
+	}
+
+	int one = 1;
+	unlink(notifysockpath);
+	/* services may drop privileges, the sender is checked by its pid */
+	if (bind(notifysock, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    chmod(notifysockpath, 0666) < 0 ||
+	    setsockopt(notifysock, SOL_SOCKET, SO_PASSCRED, &one, sizeof one) < 0) {
+		prn(2, "- nitro: could not bind notify socket: errno=%d\n", errno);
+		close(notifysock);
+		notifysock = -1;
+	}
+}
+#endif
+
+void
+open_control_socket()
+{
+	open_notify_dir();
+
+	struct sockaddr_un addr = { 0 };
+	addr.sun_family = AF_UNIX;
+	stecpy(addr.sun_path, addr.sun_path + sizeof addr.sun_path, control_socket_path);
+
+	int checksock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (checksock < 0)
+		fatal("check socket: errno=%d", errno);
+	if (connect(checksock, (struct sockaddr *)&addr, sizeof addr) == 0)
+		fatal("socket in use outside of nitro\n");
+	else if (errno == EPROTOTYPE)
+		fatal_no_panic("socket already in use\n");
+	else if (errno == ECONNREFUSED) // stale socket, remove
+		unlink(control_socket_path);
+	// else if (errno == ENOENT) // socket doesn't exist, good
+	// ignore other errors, fail below.
+	close(checksock);
+
+	controlsock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (controlsock < 0)
+		fatal("control socket: errno=%d", errno);
+
+	mode_t mask = umask(0077);
+	int r = bind(controlsock, (struct sockaddr *)&addr, sizeof addr);
+	umask(mask);
+	if (r < 0)
+		fatal("could not bind control socket: errno=%d\n", errno);
+
+#ifdef __linux__
+	open_notify_socket();
+#endif
+}
+
+int
+notifyprefix(const char *name, const char *file)
+{
+	if (strncmp("ALL,", file, 4) == 0)
+		return 1;
+
+	// slashes are encoded as comma in the notify file name
+	while (*name && (*name == *file || (*name == '/' && *file == ',')))
+		name++, file++;
+
+	return *name == 0 && *file == ',';
+}
+
+static void
+status_fill(int i)
+{
+	struct status_entry *e = &status->services[i];
+
+	stecpy(e->name, e->name + sizeof e->name, services[i].name);
+	e->startstop = services[i].startstop;
+	e->pid = services[i].pid;
+	e->oldpid = services[i].oldpid;
+	e->wstatus = services[i].wstatus;
+	e->log_pending = IS_LOG(i) ? log_pending(i) : -1;
+	e->log_hwm = services[i].log_hwm;
+	e->pipe_size = services[i].pipesize;
+	e->state = services[i].state;
+	services[i].status_state = services[i].state;
+	services[i].status_pid = services[i].pid;
+	e->fdstore = services[i].nfdstore;
+	e->check = services[i].check;
+	e->check_fails = services[i].check_fails;
+	e->check_latency = services[i].check_latency;
+	e->last_run = services[i].last_run;
+	e->next_run = services[i].scheduled ? services[i].sched_next : 0;
+	e->last_duration = services[i].last_duration;
+}
+
+/* publish service i, or all services if i < 0, to the status file */
+void
+status_update(int i)
+{
+	if (!status)
+		return;
+
+	uint32_t seq = status->seq;
+	__atomic_store_n(&status->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (i < 0) {
+		for (i = 0; i < max_service; i++)
+			status_fill(i);
+	} else if (i < max_service) {
+		status_fill(i);
+	}
+	status->max_service = max_service;
+	status->total_reaps = total_reaps;
+	status->total_sv_reaps = total_sv_reaps;
+
+	__atomic_store_n(&status->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+status_open(const char *dir)
+{
+	sprn(statuspath, statuspath + sizeof statuspath, "%s/status", dir);
+
+	size_t size = sizeof *status + maxsv * sizeof status->services[0];
+	/* like the control socket, the service table is for root only */
+	int fd = open(statuspath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || fchmod(fd, 0600) < 0 || ftruncate(fd, size) < 0) {
+		prn(2, "- nitro: can't create %s: errno=%d\n", statuspath, errno);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	void *p = mmap(0, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		prn(2, "- nitro: can't map %s: errno=%d\n", statuspath, errno);
+		return;
+	}
+
+	status = p;
+	status->magic = STATUS_MAGIC;
+	status->version = STATUS_VERSION;
+	status->nitro_pid = getpid();
+	status_update(-1);
+}
+
+void
+notify(int i)
+{
+	char notifybuf[128];
+	unsigned char len = strlen(services[i].name);
+	notifybuf[0] = len;
+	notifybuf[1] = 0;
+	notifybuf[2] = services[i].state;
+	stecpy(notifybuf + 3, notifybuf + sizeof notifybuf, services[i].name);
+
+	status_update(i);
+
+	struct dirent *ent;
+	rewinddir(notifydir);
+	while ((ent = readdir(notifydir))) {
+		char *name = ent->d_name;
+
+		if (name[0] == '.')
+			continue;
+
+		if (notifyprefix(services[i].name, name)) {
+			struct sockaddr_un addr = { 0 };
+			addr.sun_family = AF_UNIX;
+
+			sprn(addr.sun_path, addr.sun_path + sizeof addr.sun_path,
+			    "%s/%s", notifypath, name);
+
+			if (sendto(controlsock, notifybuf, len + 3,
+			    MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof addr) < 0) {
+				if (errno == ECONNREFUSED) {
+					// remove stale socket
+					unlinkat(dirfd(notifydir), name, 0);
+				}
+			}
+		}
+	}
+}
+
+void
+handle_ready_pipe(int j)
+{
+	char buf[256];
+
+	for (int i = 0; i < max_service; i++) {
+		if (fds[j].fd == services[i].readypipe) {
+			int r = read(fds[j].fd, buf, sizeof buf);
+			if (r == -1) {
+				if (errno != EINTR && errno != EAGAIN) {
+					dprn("read error: %d\n", errno);
+				}
+			} else if (memchr(buf, '\n', r)) {
+				if (services[i].state == PROC_STARTING) {
+					dprn("service %s is ready\n", services[i].name);
+					proc_ready(i);
+				} else {
+					/* further newlines ping the watchdog */
+					services[i].watchdog_ping = time_now();
+				}
+			}
+			if (r == 0 || (fds[j].revents & POLLHUP)) {
+				close(services[i].readypipe);
+				services[i].readypipe = -1;
+			}
+			break;
+		}
+	}
+}
+
+#ifdef __linux__
+/* read the parent and session of pid from /proc, return -1 if it's gone */
+static int
+proc_stat(pid_t pid, pid_t *ppid, pid_t *sid)
+{
+	char path[64], buf[512];
+	char *e = stecpy(path, path + sizeof path, "/proc/");
+	e = steprl(e, path + sizeof path, pid);
+	stecpy(e, path + sizeof path, "/stat");
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ssize_t r = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (r <= 0)
+		return -1;
+	buf[r] = 0;
+
+	/* pid (comm) state ppid pgrp session ..., comm may contain ) */
+	char *p = strrchr(buf, ')');
+	if (!p || p[1] != ' ' || !p[2] || p[3] != ' ')
+		return -1;
+	long v[3] = { 0 };
+	p += 4;
+	for (int k = 0; k < 3; k++) {
+		for (; ((unsigned int)*p - '0') < 10; p++)
+			v[k] = v[k]*10 + (*p - '0');
+		if (*p++ != ' ')
+			return -1;
+	}
+	*ppid = v[0];
+	*sid = v[2];
+	return 0;
+}
+
+/* is pid a descendant of service i, or in the session of its process? */
+static int
+proc_belongs(int i, pid_t pid)
+{
+	pid_t ppid, sid, svsid;
+	if (proc_stat(services[i].pid, &ppid, &svsid) < 0 ||
+	    proc_stat(pid, &ppid, &sid) < 0)
+		return 0;
+	if (sid == svsid && sid > 1)
+		return 1;
+
+	for (int depth = 0; depth < 64 && ppid > 1; depth++) {
+		if (ppid == services[i].pid)
+			return 1;
+		if (proc_stat(ppid, &ppid, &sid) < 0)
+			return 0;
+	}
+	return 0;
+}
+
+/* apply the VAR=VALUE lines of an sd_notify message to service i,
+   which passed the nfds descriptors in fds along */
+static void
+notify_msg(int i, char *buf, char *end, int *fds, int nfds)
+{
+	for (char *line = buf, *nl; line < end; line = nl + 1) {
+		nl = memchr(line, '\n', end - line);
+		if (!nl)
+			nl = end;
+		*nl = 0;
+
+		if (strcmp(line, "READY=1") == 0) {
+			if (services[i].state == PROC_STARTING) {
+				dprn("service %s is ready\n", services[i].name);
+				proc_ready(i);
+			}
+		} else if (strncmp(line, "STATUS=", 7) == 0) {
+			stecpy(services[i].status_text,
+			    services[i].status_text + sizeof services[i].status_text,
+			    line + 7);
+		} else if (strncmp(line, "MAINPID=", 8) == 0) {
+			/* we are a subreaper, so we see it exit */
+			pid_t pid = 0;
+			for (char *p = line + 8; *p >= '0' && *p <= '9'; p++)
+				pid = pid*10 + (*p - '0');
+			if (pid <= 1 || pid == services[i].pid) {
+				;
+			} else if (!proc_belongs(i, pid)) {
+				prn(2, "- nitro: %s sent MAINPID=%d of a foreign process, ignored\n",
+				    services[i].name, pid);
+			} else {
+				dprn("service %s has main pid %s\n",
+				    services[i].name, line + 8);
+				services[i].pid = pid;
+				status_update(i);
+			}
+		} else if (strcmp(line, "IDLE=1") == 0) {
+			idle_report(i);
+		} else if (strcmp(line, "IDLE=0") == 0) {
+			services[i].idle_deadline = 0;
+		} else if (strcmp(line, "STOPPING=1") == 0) {
+			services[i].stopping = 1;
+		} else if (strcmp(line, "WATCHDOG=1") == 0) {
+			services[i].watchdog_ping = time_now();
+		} else if (strcmp(line, "FDSTORE=1") == 0) {
+			for (int k = 0; k < nfds; k++) {
+				if (fds[k] < 0)
+					continue;
+				if (fdstore_add(i, fds[k]) < 0)
+					prn(2, "- nitro: can't store fd of %s, limit=%d\n",
+					    services[i].name, MAXFDSTORE);
+				else
+					fds[k] = -1;
+			}
+		}
+	}
+}
+
+void
+handle_notify_sock()
+{
+	char buf[4096];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof (struct ucred)) +
+		    CMSG_SPACE(sizeof (int) * MAXFDSTORE)];
+	} cmsg;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof cmsg.buf,
+	};
+	ssize_t r = recvmsg(notifysock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (r < 0)
+		return;
+
+	pid_t pid = 0;
+	int fds[MAXFDSTORE];
+	int nfds = 0;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET)
+			continue;
+		if (c->cmsg_type == SCM_CREDENTIALS) {
+			struct ucred cred;
+			memcpy(&cred, CMSG_DATA(c), sizeof cred);
+			pid = cred.pid;
+		} else if (c->cmsg_type == SCM_RIGHTS) {
+			int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+			for (int k = 0; k < n; k++) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(c) + k * sizeof (int), sizeof fd);
+				if (nfds < MAXFDSTORE)
+					fds[nfds++] = fd;
+				else
+					close(fd);
+			}
+		}
+	}
+
+	/* like MAINPID=, FDSTORE=1 is only taken from the service's main
+	   process, as vouched for by the kernel */
+	int i;
+	for (i = 0; pid && i < max_service; i++)
+		if (services[i].pid == pid && services[i].notify)
+			break;
+	if (pid && i < max_service)
+		notify_msg(i, buf, buf + r, fds, nfds);
+	else
+		dprn("notify message from unknown pid %d\n", pid);
+
+	for (int k = 0; k < nfds; k++)
+		if (fds[k] >= 0)
+			close(fds[k]);
+}
+#endif
+
+#define SPAT_U8(tag, value) \
+		*reply++ = 1; \
+		*reply++ = 0; \
+		*reply++ = tag; \
+		*reply++ = ((uint8_t)value);
+
+#define SPAT_U32(tag, value) \
+		*reply++ = 4; \
+		*reply++ = 0; \
+		*reply++ = tag; \
+		*reply++ = ((uint32_t)value); \
+		*reply++ = ((uint32_t)value) >> 8; \
+		*reply++ = ((uint32_t)value) >> 16; \
+		*reply++ = ((uint32_t)value) >> 24;
+
+/* fds passed along with the current control message */
+int ctlfds[MAXFDSTORE];
+int nctlfds;
+
+/* the rolling restart in progress, see rollout_step */
+struct {
+	char tmpl[64];          /* template, or empty if none is running */
+	int batch;              /* max. instances restarting at once */
+	struct sockaddr_un src; /* where to reply when done */
+	socklen_t srclen;
+} rollout;
+
+/* finish the rollout, reporting instance i if it failed */
+static void
+rollout_reply(enum tags status, int i)
+{
+	char reply[3 + 3 + sizeof services[0].name];
+	char *r = reply;
+
+	*r++ = 0;
+	*r++ = 0;
+	*r++ = status;
+	if (i >= 0) {
+		size_t len = strlen(services[i].name);
+		*r++ = len;
+		*r++ = 0;
+		*r++ = T_NAME;
+		memcpy(r, services[i].name, len);
+		r += len;
+	}
+
+	if (rollout.srclen > 0)
+		sendto(controlsock, reply, r - reply, MSG_DONTWAIT,
+		    (struct sockaddr *)&rollout.src, rollout.srclen);
+
+	for (int j = 0; j < max_service; j++)
+		services[j].rolling = 0;
+	rollout.tmpl[0] = 0;
+}
+
+/* restart the next instances once the previous ones are UP again */
+void
+rollout_step()
+{
+	if (global_state != GLBL_UP) {
+		rollout_reply(T_EFAIL, -1);
+		return;
+	}
+
+	deadline now = time_now();
+	int active = 0;
+	int pending = 0;
+	for (int i = 0; i < max_service; i++) {
+		if (services[i].rolling == 1)
+			pending++;
+		if (services[i].rolling != 2)
+			continue;
+
+		switch (services[i].state) {
+		case PROC_UP:
+		case PROC_ONESHOT:
+		case PROC_DOWN:         /* brought down meanwhile */
+			services[i].rolling = 0;
+			break;
+		case PROC_FATAL:
+			rollout_reply(T_EFAIL, i);
+			return;
+		default:
+			if (services[i].rolling_deadline <= now) {
+				prn(2, "- nitro: %s did not come up again, "
+				    "aborting rolling restart\n", services[i].name);
+				rollout_reply(T_ETIMEDOUT, i);
+				return;
+			}
+			active++;
+		}
+	}
+
+	for (int i = 0; i < max_service && active < rollout.batch; i++)
+		if (services[i].rolling == 1) {
+			services[i].rolling = 2;
+			services[i].rolling_deadline = now + 1000L *
+			    svfile_num(i, "rollout-timeout", ROLLOUT_TIMEOUT);
+			active++;
+			pending--;
+			process_step(i, EVNT_WANT_RESTART);
+			notify(i);
+		}
+
+	if (!active && !pending)
+		rollout_reply(T_OK, -1);
+}
+
+static void
+waiter_drop(int w)
+{
+	for (int j = 0; j < max_service; j++)
+		services[j].waiters &= ~(1u << w);
+	waiters[w].used = 0;
+	nwaiters--;
+}
+
+/* answer waiter w, reporting service i if it failed */
+void
+waiter_reply(int w, enum tags status, int i)
+{
+	char reply[3 + 3 + sizeof services[0].name];
+	char *r = reply;
+
+	*r++ = 0;
+	*r++ = 0;
+	*r++ = status;
+	if (i >= 0) {
+		size_t len = strlen(services[i].name);
+		*r++ = len;
+		*r++ = 0;
+		*r++ = T_NAME;
+		memcpy(r, services[i].name, len);
+		r += len;
+	}
+
+	sendto(controlsock, reply, r - reply, MSG_DONTWAIT,
+	    (struct sockaddr *)&waiters[w].src, waiters[w].srclen);
+
+	waiter_drop(w);
+}
+
+/* find a slot for a new waiter, replacing the oldest if needed */
+static int
+waiter_add(int want, int fail, deadline d,
+    struct sockaddr_un src, socklen_t srclen)
+{
+	int w, oldest = 0;
+	for (w = 0; w < MAXWAITERS; w++) {
+		if (!waiters[w].used)
+			break;
+		if (waiters[w].since < waiters[oldest].since)
+			oldest = w;
+	}
+	if (w == MAXWAITERS) {
+		w = oldest;
+		waiter_reply(w, T_EBUSY, -1);
+	}
+
+	waiters[w].used = 1;
+	nwaiters++;
+	waiters[w].want = want;
+	waiters[w].fail = fail;
+	waiters[w].deadline = d;
+	waiters[w].since = time_now();
+	waiters[w].src = src;
+	waiters[w].srclen = srclen;
+	return w;
+}
+
+/* reply to waiter w if all its services reached a wanted state */
+static void
+waiter_check(int w)
+{
+	if (global_state != GLBL_UP &&
+	    !(waiters[w].want & STATEBIT(PROC_DOWN))) {
+		waiter_reply(w, T_EFAIL, -1);
+		return;
+	}
+
+	int pending = 0;
+	for (int i = 0; i < max_service; i++) {
+		if (!(services[i].waiters & (1u << w)))
+			continue;
+
+		if (waiters[w].fail & STATEBIT(services[i].state)) {
+			waiter_reply(w, T_EFAIL, i);
+			return;
+		}
+		if (waiters[w].want & STATEBIT(services[i].state))
+			services[i].waiters &= ~(1u << w);
+		else
+			pending++;
+	}
+
+	if (!pending)
+		waiter_reply(w, T_OK, -1);
+	else if (waiters[w].deadline && waiters[w].deadline <= time_now())
+		waiter_reply(w, T_ETIMEDOUT, -1);
+}
+
+void
+waiters_check()
+{
+	for (int w = 0; w < MAXWAITERS; w++)
+		if (waiters[w].used)
+			waiter_check(w);
+}
+
+/* the service to apply cmd to, created if needed, or -1 */
+static int
+control_lookup(enum tags cmd, const char *sv)
+{
+	struct stat st;
+
+	if ((cmd != T_CMD_DOWN || find_service("SYS") != -1) &&
+	    cmd != T_CMD_READY &&
+	    valid_service_name(sv) &&
+	    stat_slash_to_at(sv, ".", &st) == 0)
+		return add_service(sv);
+	else
+		return find_service(sv);
+}
+
+/* up, down, restart or mark ready service i */
+static void
+control_apply(enum tags cmd, int i)
+{
+	services[i].seen = 1;
+
+	if (cmd == T_CMD_UP) {
+		ondemand_setup(i);
+		process_step(i, EVNT_WANT_UP);
+	} else if (cmd == T_CMD_DOWN) {
+		services[i].ondemand = 0;       /* stay down */
+		process_step(i, EVNT_WANT_DOWN);
+	}
+	else if (cmd == T_CMD_RESTART)
+		process_step(i, EVNT_WANT_RESTART);
+	else if (cmd == T_CMD_READY &&
+	    services[i].state == PROC_STARTING)
+		process_step(i, EVNT_TIMEOUT);
+
+	notify(i);
+}
+
+static int
+is_pattern(const char *s)
+{
+	return strpbrk(s, "*?[") != 0;
+}
+
+/* apply cmd to all services matching pattern, reply with their names */
+static void
+control_pattern(enum tags cmd, int sig, const char *pattern,
+    struct sockaddr_un src, socklen_t srclen)
+{
+	char replybuf[REPLY_PAGE];
+	char *replyend = replybuf + sizeof replybuf - 7;  /* for T_MORE */
+	char *reply = replybuf + 3;
+	int n = 0, more = -1;
+
+	for (int i = 0; i < max_service; i++) {
+		if (fnmatch(pattern, services[i].name, 0) != 0)
+			continue;
+
+		if (cmd == T_CMD_SIGNAL) {
+			if (!services[i].pid)
+				continue;
+			kill(services[i].pid, (unsigned char)sig);
+		} else {
+			control_apply(cmd, i);
+		}
+
+		n++;
+
+		/* names that don't fit are listed with T_CMD_LIST */
+		size_t len = strlen(services[i].name);
+		if (more >= 0)
+			continue;
+		if (reply + 3 + len > replyend) {
+			more = i;
+			continue;
+		}
+		*reply++ = len;
+		*reply++ = 0;
+		*reply++ = T_NAME;
+		memcpy(reply, services[i].name, len);
+		reply += len;
+	}
+	if (more >= 0) {
+		SPAT_U32(T_MORE, more);
+	}
+
+	replybuf[0] = 0;
+	replybuf[1] = 0;
+	replybuf[2] = n ? T_OK : T_ESRCH;
+	if (srclen > 0)
+		sendto(controlsock, replybuf, reply - replybuf,
+		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+}
+
+/* apply cmd to the group member entry, 1 if it named a service */
+static int
+control_group_member(enum tags cmd, const char *group, const char *entry, int w)
+{
+	if (entry[0] == '.')
+		return 0;
+
+	/* members are symlinks, the last segment is the service name */
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	const char *name = entry;
+	sprn(path, path + sizeof path, "%s/%s", group, entry);
+	ssize_t r = readlink(path, target, sizeof target - 1);
+	if (r > 0) {
+		target[r] = 0;
+		while (r > 1 && target[r - 1] == '/')
+			target[--r] = 0;
+		name = strrchr(target, '/');
+		name = name ? name + 1 : target;
+	}
+
+	if (!valid_service_name(name))
+		return 0;
+	int i = control_lookup(cmd, name);
+	if (i < 0)
+		return 0;
+
+	control_apply(cmd, i);
+	if (w >= 0)
+		services[i].waiters |= 1u << w;
+	return 1;
+}
+
+/* apply cmd to the members of group, which waiter w (if >= 0) waits for */
+static int
+control_group(enum tags cmd, const char *group, int w)
+{
+	int n = 0;
+	DIR *d = opendir(group);
+	if (!d)
+		return -1;
+
+	struct dirent *ent;
+	while ((ent = readdir(d)))
+		n += control_group_member(cmd, group, ent->d_name, w);
+	closedir(d);
+
+	return n;
+}
+
+/* split a u16 count and a service name off the payload in buf */
+static const char *
+count_payload(unsigned char *buf, int len, int *count)
+{
+	/* count, then a NUL-terminated name that fits services[].name */
+	if (len < 3 || len - 2 >= (int)sizeof services[0].name)
+		return 0;
+	char *name = (char *)buf + 5;
+	name[len - 2] = 0;
+	if (strlen(name) != (size_t)(len - 2))
+		return 0;
+
+	*count = buf[3] | (buf[4] << 8);
+	return name;
+}
+
+void
+handle_control_msg(unsigned char *buf, ssize_t r,
+    struct sockaddr_un src, socklen_t srclen)
+{
+	enum tags status = T_OK;
+
+	if (r < 3)
+		return;
+
+	// currently only the first command per socket is parsed
+	int len = buf[0] | (buf[1] << 8);
+	if (len + 3 > r)
+		return;
+	enum tags cmd = buf[2];
+	const char *sv = "";
+	if (len < 64) {
+		sv = (char *)buf + 3;
+		buf[3 + len] = 0;
+	}
+
+	switch (cmd) {
+	case T_CMD_LIST:
+	{
+		/* payload: optional u32 first index, optional pattern */
+		if (srclen == 0)
+			return;
+		if ((len > 0 && len < 4) || len >= 4 + (int)sizeof services[0].name)
+			goto fail;
+
+		int start = 0;
+		const char *pattern = 0;
+		if (len >= 4) {
+			unsigned char *p = buf + 3;
+			start = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+			buf[3 + len] = 0;
+			if (len > 4)
+				pattern = (char *)p + 4;
+		}
+
+		char replybuf[REPLY_PAGE];
+		char *replyend = replybuf + sizeof replybuf;
+		char *reply = replybuf;
+		deadline now = time_now();
+
+		int i;
+		for (i = start; i < max_service && replyend - reply > 256; i++) {
+			if (pattern && fnmatch(pattern, services[i].name, 0) != 0)
+				continue;
+
+			*reply++ = 0xff;
+			*reply++ = 0xff;
+			*reply++ = T_SERVICE;
+
+			char *lenpos = reply;
+			*reply++ = 0;
+			*reply++ = 0;
+			*reply++ = T_NAME;
+			char *s = services[i].name;
+			while ((*reply++ = *s++))
+				;
+			*lenpos = s - services[i].name;
+
+			SPAT_U8(T_STATE, services[i].state);
+			SPAT_U32(T_PID, services[i].pid);
+			SPAT_U32(T_WSTATUS, services[i].wstatus);
+			uint32_t uptime = (now - services[i].startstop) / 1000;
+			SPAT_U32(T_UPTIME, uptime);
+			if (IS_LOG(i)) {
+				SPAT_U32(T_LOG_PENDING, log_pending(i));
+				SPAT_U32(T_LOG_HWM, services[i].log_hwm);
+				SPAT_U32(T_PIPE_SIZE, services[i].pipesize);
+			}
+			if (services[i].nfdstore) {
+				SPAT_U8(T_FDSTORE, services[i].nfdstore);
+			}
+			if (services[i].oldpid) {
+				SPAT_U32(T_OLDPID, services[i].oldpid);
+			}
+			if (services[i].check) {
+				SPAT_U8(T_CHECK, services[i].check);
+				SPAT_U8(T_CHECK_FAILS, services[i].check_fails);
+				SPAT_U32(T_CHECK_LATENCY, services[i].check_latency);
+			}
+			if (services[i].last_run) {
+				SPAT_U32(T_LAST_RUN, (now - services[i].last_run) / 1000);
+				SPAT_U32(T_LAST_DURATION, services[i].last_duration);
+			}
+			if (services[i].scheduled && services[i].sched_next > now) {
+				SPAT_U32(T_NEXT_RUN, (services[i].sched_next - now) / 1000);
+			}
+
+			*reply++ = 0xfe;
+			*reply++ = 0xff;
+			*reply++ = T_SERVICE;
+		}
+		if (i < max_service) {
+			SPAT_U32(T_MORE, i);
+		}
+
+		sendto(controlsock, replybuf, reply - replybuf,
+		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+		return;
+	}
+	case T_CMD_QUERY:
+	{
+		if (srclen == 0)
+			return;
+
+		int i = find_service(sv);
+		if (i < 0)
+			goto fail;
+		char replybuf[128 + sizeof services[i].status_text];
+		char *reply = replybuf;
+		deadline now = time_now();
+
+		SPAT_U8(T_STATE, services[i].state);
+		SPAT_U32(T_PID, services[i].pid);
+		SPAT_U32(T_WSTATUS, services[i].wstatus);
+		uint32_t uptime = (now - services[i].startstop) / 1000;
+		SPAT_U32(T_UPTIME, uptime);
+		if (IS_LOG(i)) {
+			SPAT_U32(T_LOG_PENDING, log_pending(i));
+			SPAT_U32(T_LOG_HWM, services[i].log_hwm);
+			SPAT_U32(T_PIPE_SIZE, services[i].pipesize);
+		}
+		if (services[i].nfdstore) {
+			SPAT_U8(T_FDSTORE, services[i].nfdstore);
+		}
+		if (services[i].oldpid) {
+			SPAT_U32(T_OLDPID, services[i].oldpid);
+		}
+		if (services[i].check) {
+			SPAT_U8(T_CHECK, services[i].check);
+			SPAT_U8(T_CHECK_FAILS, services[i].check_fails);
+			SPAT_U32(T_CHECK_LATENCY, services[i].check_latency);
+		}
+		if (services[i].last_run) {
+			SPAT_U32(T_LAST_RUN, (now - services[i].last_run) / 1000);
+			SPAT_U32(T_LAST_DURATION, services[i].last_duration);
+		}
+		if (services[i].scheduled && services[i].sched_next > now) {
+			SPAT_U32(T_NEXT_RUN, (services[i].sched_next - now) / 1000);
+		}
+		if (services[i].stopping) {
+			SPAT_U8(T_STOPPING, 1);
+		}
+		if (services[i].status_text[0]) {
+			size_t l = strlen(services[i].status_text);
+			*reply++ = l;
+			*reply++ = 0;
+			*reply++ = T_STATUS_TEXT;
+			memcpy(reply, services[i].status_text, l);
+			reply += l;
+		}
+
+		sendto(controlsock, replybuf, reply - replybuf,
+		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+		return;
+	}
+	case T_CMD_LOGS:
+	{
+		if (srclen == 0)
+			return;
+
+		int i = find_service(sv);
+		if (i < 0)
+			goto fail;
+
+		char replybuf[3 + LOGBUF_SIZE];
+		size_t n = ring_copy(i, replybuf + 3);
+		replybuf[0] = n;
+		replybuf[1] = n >> 8;
+		replybuf[2] = T_LOG_DATA;
+
+		sendto(controlsock, replybuf, 3 + n,
+		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+		return;
+	}
+	case T_CMD_INFO:
+	{
+		if (srclen == 0)
+			return;
+
+		char replybuf[64];
+		char *reply = replybuf;
+
+		pid_t pid = getpid();
+		SPAT_U32(T_NITRO_PID, pid);
+		SPAT_U32(T_PID, pid);
+		SPAT_U32(T_MAX_SERVICE, max_service);
+		SPAT_U32(T_SERVICE_CAPACITY, maxsv);
+		SPAT_U32(T_SERVICE_HWM, service_hwm);
+		SPAT_U32(T_TOTAL_REAPS, total_reaps);
+		SPAT_U32(T_TOTAL_SV_REAPS, total_sv_reaps);
+		sendto(controlsock, replybuf, reply - replybuf,
+		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+		return;
+	}
+	case T_CMD_UP:
+	case T_CMD_DOWN:
+	case T_CMD_RESTART:
+	case T_CMD_READY:
+	{
+		if (len == 0)
+			goto fail;
+
+		if (is_pattern(sv)) {
+			control_pattern(cmd, 0, sv, src, srclen);
+			return;
+		}
+
+		if (sv[0] == '@' && !strchr(sv, '/')) {
+			/* reply once all members are UP (or DOWN) */
+			int w = -1;
+			if (srclen > 0 && cmd == T_CMD_DOWN)
+				w = waiter_add(STATEBIT(PROC_DOWN) | STATEBIT(PROC_FATAL),
+				    0, 0, src, srclen);
+			else if (srclen > 0)
+				w = waiter_add(STATEBIT(PROC_UP) | STATEBIT(PROC_ONESHOT),
+				    STATEBIT(PROC_FATAL), 0, src, srclen);
+			if (control_group(cmd, sv, w) <= 0) {
+				if (w >= 0)
+					waiter_drop(w);
+				goto fail;
+			}
+			if (w >= 0)
+				waiter_check(w);
+			return;
+		}
+
+		int i = control_lookup(cmd, sv);
+		if (i < 0)
+			goto fail;
+
+		control_apply(cmd, i);
+		goto ok;
+	}
+	case T_CMD_IDLE:
+	{
+		int i = find_service(sv);
+		if (i < 0 || !services[i].ondemand)
+			goto fail;
+		if (services[i].state == PROC_SETUP ||
+		    services[i].state == PROC_STARTING ||
+		    services[i].state == PROC_UP)
+			process_step(i, EVNT_WANT_DOWN);
+		goto ok;
+	}
+	case T_CMD_FDSTORE:
+	{
+		if (len == 0)
+			goto fail;
+		int i = find_service(sv);
+		if (i < 0)
+			goto fail;
+
+		if (nctlfds == 0)
+			fdstore_close(i);
+		for (int k = 0; k < nctlfds; k++) {
+			if (fdstore_add(i, ctlfds[k]) < 0)
+				status = T_ENOSPC;
+			else
+				ctlfds[k] = -1;
+		}
+		goto ok;
+	}
+	case T_CMD_RUN:
+	{
+		/* payload: T_NAME, T_ARG..., T_ENV..., optional T_LOG_TARGET */
+		if (global_state != GLBL_UP)
+			goto fail;
+
+		int t = transient_alloc();
+		if (t < 0) {
+			status = T_ENOSPC;
+			goto ok;
+		}
+
+		char name[64] = "";
+		char logname[64] = "";
+		unsigned char *end = buf + 3 + len;
+		for (unsigned char *p = buf + 3; p + 3 <= end; ) {
+			size_t l = p[0] | (p[1] << 8);
+			int tag = p[2];
+			char *d = (char *)p + 3;
+			if (p + 3 + l > end)
+				break;
+			p += 3 + l;
+
+			if ((tag == T_NAME || tag == T_LOG_TARGET) && l < 64) {
+				char *dst = tag == T_NAME ? name : logname;
+				memcpy(dst, d, l);
+				dst[l] = 0;
+			} else if ((tag == T_ARG || tag == T_ENV) &&
+			    transient_add(t, tag == T_ENV, d, l) < 0) {
+				status = T_ENOSPC;
+			}
+		}
+
+		struct stat st;
+		int i = -1;
+		if (status == T_OK) {
+			if (!valid_service_name(name) || strchr(name, '@') ||
+			    !transients[t].argc)
+				status = T_ESRCH;
+			else if (find_service(name) >= 0 || stat(name, &st) == 0)
+				status = T_EEXIST;
+			else if ((i = new_service(name)) < 0)
+				status = T_ENOSPC;
+		}
+		if (i < 0) {
+			transients[t].used = 0;
+			goto ok;
+		}
+
+		services[i].transient = t + 1;
+		services[i].seen = 1;
+		services[i].log_out[0] = -1;
+		services[i].log_out[1] = -1;
+		if (*logname)
+			log_attach(i, logname);
+
+		process_step(i, EVNT_WANT_UP);
+		notify(i);
+		if (services[i].state == PROC_FATAL)
+			status = T_EFAIL;       /* removed by poll_services */
+		goto ok;
+	}
+	case T_CMD_SCALE:
+	{
+		/* payload: u16 count, template name */
+		struct stat st;
+		int n;
+		const char *tmpl = count_payload(buf, len, &n);
+		if (!tmpl)
+			goto fail;
+		if (tmpl[strlen(tmpl) - 1] != '@' || strchr(tmpl, '/') ||
+		    stat(tmpl, &st) < 0 || !S_ISDIR(st.st_mode))
+			goto fail;
+		if (scale_set(tmpl, n > maxsv ? maxsv : n) < 0) {
+			status = T_ENOSPC;
+			goto ok;
+		}
+		want_rescan = 1;
+		goto ok;
+	}
+	case T_CMD_ROLLOUT:
+	{
+		/* payload: u16 batch size, template name */
+		int batch;
+		const char *tmpl = count_payload(buf, len, &batch);
+		if (!tmpl)
+			goto fail;
+		if (rollout.tmpl[0]) {
+			status = T_EBUSY;
+			goto ok;
+		}
+		size_t l = strlen(tmpl);
+		if (tmpl[l - 1] != '@' || global_state != GLBL_UP)
+			goto fail;
+
+		for (int i = 0; i < max_service; i++)
+			if (strncmp(services[i].name, tmpl, l) == 0 &&
+			    (services[i].state == PROC_STARTING ||
+			    services[i].state == PROC_UP))
+				services[i].rolling = 1;
+
+		stecpy(rollout.tmpl, rollout.tmpl + sizeof rollout.tmpl, tmpl);
+		rollout.batch = batch < 1 ? 1 : batch;
+		rollout.src = src;
+		rollout.srclen = srclen;
+
+		rollout_step();
+		return;         /* rollout_reply answers */
+	}
+	case T_CMD_WAIT:
+	{
+		/* payload: u16 want, u16 fail, u32 timeout [ms], T_NAME... */
+		if (len < 8 || srclen == 0)
+			goto fail;
+
+		unsigned char *p = buf + 3;
+		unsigned char *end = buf + 3 + len;
+		uint32_t ms = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+		int w = waiter_add(p[0] | (p[1] << 8), p[2] | (p[3] << 8),
+		    ms ? time_now() + ms : 0, src, srclen);
+
+		int n = 0;
+		for (p += 8; p + 3 <= end; ) {
+			size_t l = p[0] | (p[1] << 8);
+			int tag = p[2];
+			char name[64];
+			if (p + 3 + l > end)
+				break;
+			if (tag == T_NAME && l < sizeof name) {
+				memcpy(name, p + 3, l);
+				name[l] = 0;
+				int i = find_service(name);
+				if (i < 0) {
+					waiter_drop(w);
+					goto fail;
+				}
+				services[i].waiters |= 1u << w;
+				n++;
+			}
+			p += 3 + l;
+		}
+		if (n == 0) {
+			waiter_drop(w);
+			goto fail;
+		}
+
+		waiter_check(w);
+		return;
+	}
+	case T_CMD_RESCAN:
+		want_rescan = 1;
+		goto ok;
+	case T_CMD_REEXEC:
+		if (global_state != GLBL_UP || rollout.tmpl[0])
+			goto fail;
+		want_reexec = 1;
+		goto ok;
+	case T_CMD_SHUTDOWN:
+		want_shutdown = 1;
+		goto ok;
+	case T_CMD_REBOOT:
+		want_reboot = 1;
+		goto ok;
+	case T_CMD_SOFTREBOOT:
+		want_reboot = want_softreboot = 1;
+		goto ok;
+	case T_CMD_KEXEC:
+		want_reboot = want_kexec = 1;
+		goto ok;
+	case T_CMD_SIGNAL:
+		if (len < 2)
+			goto fail;
+		if (is_pattern(sv + 1)) {
+			control_pattern(cmd, sv[0], sv + 1, src, srclen);
+			return;
+		}
+		int i = find_service(sv + 1);
+		if (i >= 0 && services[i].pid) {
+			kill(services[i].pid, (unsigned char)sv[0]);
+			goto ok;
 		}
-		break;
+		goto fail;
+	default:
+		status = T_ENOSYS;
+		goto ok;
+	}
+
+fail:
+	status = T_ESRCH;
+ok:
+	if (srclen > 0) {
+		unsigned char reply[] = { 0, 0, status };
+		sendto(controlsock, reply, sizeof reply,
+		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
 	}
 }
 
 void
-on_signal(int sig)
+handle_control_sock()
 {
-	int old_errno = errno;
+	unsigned char buf[CTLMSG_SIZE];
+	struct sockaddr_un src;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof (int) * MAXFDSTORE)];
+	} cmsg;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf };
+	struct msghdr msg = {
+		.msg_name = &src,
+		.msg_namelen = sizeof src,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof cmsg.buf,
+	};
+	int flags = MSG_DONTWAIT;
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	ssize_t r = recvmsg(controlsock, &msg, flags);
 
-	switch (sig) {
-	case SIGPIPE:           /* ignore, but don't use SIG_IGN */
+	if (r < 0) {
+		if (errno == EAGAIN)
+			return;
+		dprn("callback error: errno=%d\n", errno);
 		return;
-	case SIGINT:
-		if (real_pid1)
-			want_reboot = 1;    /* Linux Ctrl-Alt-Delete */
-		else
-			want_shutdown = 1;
-		break;
-	case SIGTERM:
-		want_shutdown = 1;
-		break;
-	case SIGHUP:
-		want_rescan = 1;
-		break;
-	case SIGCHLD:           /* just selfpipe */
-		break;
 	}
 
-	ssize_t r;
-	do {
-		r = write(selfpipe[1], "", 1);
-	} while (r == -1 && errno == EINTR);
-
-	errno = old_errno;
-}
+	nctlfds = 0;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+		for (int k = 0; k < n; k++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(c) + k * sizeof (int), sizeof fd);
+			if (nctlfds < MAXFDSTORE)
+				ctlfds[nctlfds++] = fd;
+			else
+				close(fd);
+		}
+	}
 
-int
-find_service(const char *name)
-{
-	for (int i = 0; i < max_service; i++)
-		if (strcmp(services[i].name, name) == 0)
-			return i;
+	handle_control_msg(buf, r, src, msg.msg_namelen);
 
-	return -1;
+	/* close what was not taken */
+	for (int k = 0; k < nctlfds; k++)
+		if (ctlfds[k] >= 0)
+			close(ctlfds[k]);
+	nctlfds = 0;
 }
 
-int
-add_service(const char *name)
+void
+has_died(pid_t pid, int status)
 {
-	int i;
-	for (i = 0; i < max_service; i++)
-		if (strcmp(services[i].name, name) == 0)
-			goto refresh_log;
+	total_reaps++;
 
-	struct stat st;
-	if (strcmp(name, "SYS") != 0 &&
-	    strcmp(name, ".SHUTDOWN") != 0 &&
-	    stat_slash_to_at(name, "run", &st) != 0 &&
-	    stat_slash_to_at(name, "setup", &st) != 0) {
-		prn(2, "- nitro: no such service: %s\n", name);
-		return -1;
-	}
+	for (int i = 0; i < max_service; i++) {
+		if (services[i].setuppid == pid) {
+			total_sv_reaps++;
 
-	/* else set up a new service */
+			dprn("setup %s[%d] has died with status %d\n",
+			    services[i].name, pid, status);
 
-	if (strlen(name) >= sizeof (services[i].name)) {
-		return -1;
-	} else if (max_service >= MAXSV - 1) {
-		prn(2, "- nitro: too many services, limit=%d\n", MAXSV);
-		return -1;
-	}
+			services[i].setuppid = 0;
 
-	max_service++;
+			if (services[i].state == PROC_SETUP) {
+				if (WEXITSTATUS(status) == 0) {
+					process_step(i, EVNT_SETUP);
+				} else if (WEXITSTATUS(status) == 111) {
+					services[i].state = PROC_FATAL;
+					services[i].wstatus = -1;
+					notify(i);
+				} else {
+					services[i].state = PROC_DELAY;
+					services[i].timeout = DELAY_RESPAWN;
+					services[i].deadline = 0;
+				}
+			}
 
-	stecpy(services[i].name, services[i].name + sizeof services[i].name, name);
-	services[i].pid = 0;
-	services[i].state = PROC_DELAY;
-	services[i].startstop = time_now();
-	services[i].timeout = 1;
-	services[i].deadline = 0;
+			if ((services[i].flags & SV_SYS) &&
+			    global_state == GLBL_UP) { /* C-A-D during SYS */
+				services[i].seen = 0;
+				proc_cleanup(i);
+				proc_zap(i);
 
-	services[i].log_in[0] = -1;
-	services[i].log_in[1] = -1;
+				prn(2, "- nitro: SYS/setup finished with status %d\n", status);
 
-	services[i].readypipe = -1;
+				// bring up rest of the services
+				rescan();
+				return;
+			}
 
-	if (strcmp(services[i].name, "LOG") == 0)
-		services[i].log_in[0] = PENDING_FD;
+			if (services[i].state == PROC_SHUTDOWN ||
+			    services[i].state == PROC_RESTART) {
+				// When down or restart is requested during
+				// setup, skip straight to finished as the main
+				// process didn't run yet.
+				process_step(i, EVNT_FINISHED);
+			}
 
-refresh_log:
- 	if (services[i].log_out[1] == PENDING_FD)
-		return i;
+			return;
+		}
 
-	services[i].log_out[0] = -1;
-	services[i].log_out[1] = -1;
+		if (services[i].checkpid == pid) {
+			total_sv_reaps++;
 
-	char log_target[PATH_MAX];
-	char log_link[PATH_MAX];
-	char s = 0;
-	char *instance = strchr(name, '@');
-	if (instance) {
-		instance++;
-		s = *instance;
-		*instance = 0;
-	}
-	sprn(log_link, log_link + sizeof log_link, "%s/log", name);
-	if (instance)
-		*instance = s;
+			dprn("check %s[%d] has died with status %d\n",
+			    services[i].name, pid, status);
+			services[i].checkpid = 0;
+			check_done(i, WIFEXITED(status) && WEXITSTATUS(status) == 0,
+			    services[i].check_start);
 
-	ssize_t r = readlink(log_link, log_target, sizeof log_target - 1);
-	if (r < 0) {
-		if (errno == EINVAL)
-			prn(2, "warning: ignoring log, it is not a symlink: %s\n", name);
-		if (errno == ENOENT &&
-		    strncmp(services[i].name, "LOG@", 4) != 0 &&   // no loops
-		    strcmp(services[i].name, "LOG") != 0 &&        // no loops
-		    strcmp(services[i].name, "SYS") != 0 &&        // too soon
-		    stat("LOG@", &st) == 0 &&
-		    S_ISDIR(st.st_mode))
-			stecpy(log_target, log_target + sizeof log_target,
-			    "LOG@");
-		else
-			return i;
-	}
+			return;
+		}
 
-	/* just interpret the last path segment as service name */
-	log_target[r] = 0;
-	char *target_name = strrchr(log_target, '/');
-	if (target_name)
-		target_name++;
-	else
-		target_name = log_target;
+		if (services[i].oldpid == pid) {
+			total_sv_reaps++;
 
-	size_t n = strlen(target_name);
-	if (target_name[n-1] == '@')
-		stecpy(target_name + n, log_target + sizeof log_target,
-		    instance ? instance : name);
+			dprn("old instance %s[%d] has died with status %d\n",
+			    services[i].name, pid, status);
+			services[i].oldpid = 0;
+			services[i].oldkill = 0;
+			if (services[i].state == PROC_DOWN)
+				proc_zap(i);
 
-	services[i].log_out[1] = PENDING_FD;
+			return;
+		}
 
-	int created = find_service(target_name) < 0;
-	int j = add_service(target_name);
-	if (j < 0)
-		return i;
+		if (services[i].pid == pid) {
+			total_sv_reaps++;
 
-	services[j].seen = 1; /* mark @ service used */
-	if (services[j].log_in[0] == -1) {
-		if (pipe2(services[j].log_in, O_CLOEXEC) < 0) {
-			prn(2, "- nitro: can't create log pipe: errno=%d\n", errno);
-			services[j].log_in[0] = -1;
-			services[j].log_in[1] = -1;
+			dprn("service %s[%d] has died with status %d\n",
+			    services[i].name, pid, status);
+			services[i].pid = 0;
+			services[i].wstatus = status;
+			process_step(i, EVNT_EXITED);
+
+			return;
 		}
-	}
 
-	services[i].log_out[0] = services[j].log_in[0];
-	services[i].log_out[1] = services[j].log_in[1];
+		if (services[i].finishpid == pid) {
+			total_sv_reaps++;
 
-	if (created) {
-		services[j].state = PROC_DOWN;
-		services[j].timeout = 0;
+			dprn("finish script %s[%d] has died with status %d\n",
+			    services[i].name, pid, status);
+			services[i].finishpid = 0;
+
+			if (services[i].flags & SV_SYS) {
+				prn(2, "- nitro: SYS/finish finished\n");
+				process_step(i, EVNT_FINISHED);
+				do_stop_services();
+			} else {
+				process_step(i, EVNT_FINISHED);
+			}
+
+			return;
+		}
 	}
 
-	return i;
+	dprn("reaping unknown child %d\n", pid);
 }
 
-static void
-reopendir(DIR **d)
+#ifdef __linux__
+static int
+mounted(const char *dir)
 {
-#ifdef REOPEN_USE_CLOSEDIR
-	DIR *newd = opendir(servicedir);
-	if (!newd)
-		return;
-	closedir(*d);
-	*d = newd;
-	(void)!fchdir(dirfd(newd));
-#else
-
-	// avoid OpenBSD bug: ensure we hit end, so rewinddir forces re-read.
-	while (readdir(*d))
-		;
+	struct stat rootst;
+	struct stat dirst;
 
-#ifdef REOPEN_USE_DUP_HACK
-	// this fiddles in the internals of DIR, use only if you vetted
-	// your libc to tolerate this!
-	int fd = open(servicedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-	if (fd >= 0) {
-		if (dup3(fd, dirfd(*d), O_CLOEXEC) < 0)
-			close(fd);
-		else
-			(void)!fchdir(dirfd(*d));
-	}
-#endif
+	/* only detects toplevel mount points */
+	stat("/", &rootst);
+	if (stat(dir, &dirst) < 0)
+		return 1;  /* can't mount if mountpoint doesn't exist */
 
-	rewinddir(*d);
-#endif
+	return rootst.st_dev != dirst.st_dev;
 }
+#endif
 
 void
-rescan()
+init_mount()
 {
-	int i;
-
-	for (i = 0; i < max_service; i++)
-		services[i].seen = 0;
-
-	reopendir(&cwd);
-
-	struct dirent *ent;
-	while ((ent = readdir(cwd))) {
-		char *name = ent->d_name;
-		struct stat st;
-
-		if (stat(name, &st) < 0)
-			continue;
-		if (!S_ISDIR(st.st_mode))
-			continue;
+#ifdef __linux__
+	if (access("/dev/null", F_OK) < 0 && !mounted("/dev"))
+		mount("dev", "/dev", "devtmpfs", MS_NOSUID, "mode=0755");
+	if (!mounted("/run"))
+		mount("run", "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755");
+#endif
+#ifdef __NetBSD__
+	control_socket_path = control_socket();
 
-		if (name[strlen(name) - 1] == '@') {
-			// mark parametrized services seen
-			size_t prefixlen = strlen(name);
-			for (i = 0; i < max_service; i++)
-				if (strncmp(name, services[i].name, prefixlen) == 0 &&
-				    services[i].state != PROC_DOWN) {
-					services[i].seen = 1;
-				}
+	char *last_slash = strrchr(control_socket_path, '/');
+	if (!last_slash)
+		return;
 
-			continue;
-		}
+	*last_slash = 0;
 
-		if (!valid_service_name(name))
-			continue;
+	struct stat st;
+	if (stat(control_socket_path, &st) < 0)
+		fatal("mountpoint %s missing: errno=%d",
+		    control_socket_path, errno);
 
-		int created = find_service(name) < 0;
-		int i = add_service(name);
-		if (i < 0)
-			continue;
+	struct tmpfs_args args = {
+		.ta_version = TMPFS_ARGS_VERSION,
+		 // 32MB should be enough for everyone
+		.ta_size_max = 32 * 1024 * 1024,
+		.ta_root_uid = st.st_uid,
+		.ta_root_gid = st.st_gid,
+		.ta_root_mode = st.st_mode,
+	};
+	if (mount(MOUNT_TMPFS, control_socket_path, MNT_NOSUID | MNT_NODEV,
+	    &args, sizeof args) < 0)
+		fatal("mounting %s failed: errno=%d\n",
+		    control_socket_path, errno);
 
-		if (created && stat_slash(name, "down", &st) == 0) {
-			services[i].state = PROC_DOWN;
-			services[i].timeout = 0;
-		}
+	*last_slash = '/';
+#endif
+}
 
-		services[i].seen = 1;
-	}
+#ifdef __linux__
+/* whether a kernel was staged with kexec_load(2) */
+int
+kexec_loaded()
+{
+	char c = 0;
+	int fd = open("/sys/kernel/kexec_loaded", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	(void)! read(fd, &c, 1);
+	close(fd);
 
-	// iterate backwards so we can zap
-	for (i = max_service - 1; i >= 0; i--) {
-		if (IS_LOG(i) && services[i].state == PROC_DOWN &&
-		    strchr(services[i].name, '@')) {
-			services[i].seen = 0;
-			for (int j = 0; j < max_service; j++)
-				if (i != j && services[i].log_in[1] == services[j].log_out[1]) {
-					services[i].seen = 1;
-					break;
-				}
-		}
-		if (!services[i].seen) {
-			process_step(i, EVNT_WANT_DOWN);
-			if (services[i].state == PROC_DOWN)
-				proc_zap(i);
-		}
-	}
+	return c == '1';
 }
+#endif
 
 void
-own_console()
+killall()
 {
-	int ttyfd = open("/dev/console", O_RDWR);
-	if (ttyfd < 0)
-		return;
-	dup2(ttyfd, 0);
-	dup2(ttyfd, 1);
-	dup2(ttyfd, 2);
-	if (ttyfd > 2)
-		close(ttyfd);
-	ioctl(0, TIOCSCTTY, 1);
+	prn(2, "- nitro: sending SIGTERM to all processes\n");
+	kill(-1, SIGTERM);
+	kill(-1, SIGCONT);
+	global_state = GLBL_WAIT_TERM;
+
+	int i = add_service(".SHUTDOWN");
+	services[i].state = PROC_DELAY;
+	services[i].timeout = TIMEOUT_SIGTERM;
+	services[i].deadline = 0;
 }
 
 void
-do_stop_services()
+slayall()
 {
-	global_state = GLBL_SHUTDOWN;
-
-	int up = 0;
-	for (int i = 0; i < max_service; i++) {
-		if (IS_LOG(i))
-			continue;
-
-		process_step(i, EVNT_WANT_DOWN);
+	prn(2, "- nitro: sending SIGKILL to all processes\n");
 
-		if (!(services[i].state == PROC_DOWN ||
-		    services[i].state == PROC_FATAL))
-			up++;
+#ifdef __linux__
+	/* On Linux, kill(-1, SIGKILL) can block indefinitely and hang the
+	   current process when a process is stuck in state D, so fork and only
+	   block the child.  */
+	pid_t child = fork();
+	if (child == 0) {
+		kill(-1, SIGKILL);
+		_exit(0);
 	}
+#else
+	kill(-1, SIGKILL);
+#endif
 
-	if (up)
-		prn(2, "- nitro: waiting for %d services to finish", up);
+	global_state = GLBL_WAIT_KILL;
+
+	int i = add_service(".SHUTDOWN");
+	services[i].state = PROC_DELAY;
+	services[i].timeout = TIMEOUT_SIGKILL;
+	services[i].deadline = 0;
 }
 
-void
-do_shutdown()
-{
-	if (global_state == GLBL_UP) {
-		global_state = GLBL_WAIT_FINISH;
+#undef CTRL
 
-		if (want_reboot)
-			prn(2, "- nitro: rebooting\n");
-		else
-			prn(2, "- nitro: shutting down\n");
+#define CHLD 0
+#define CTRL 1
+#define NTFY 2
+#define INOT 3
+#define MNTS 4
+
+/* the state handed over to a new nitro by reexec(), encoded as SPAT */
+enum state_tags {
+	S_MAGIC           = 1,  // payload: "nitro"
+	S_SERVICE         = 2,  // open/close
+	S_NAME            = 3,  // payload: bytes
+	S_RING            = 4,  // payload: buffered output
+	S_RING_OUT        = 5,  // payload: output not yet forwarded
+	S_LISTENFD        = 6,  // payload: i64, repeated
+	S_FDSTORE         = 7,  // payload: i64, repeated
+	S_CONTROLSOCK     = 8,  // payload: i64
+	S_GLOBALLOG_IN    = 9,  // payload: i64
+	S_GLOBALLOG_OUT   = 10, // payload: i64
+	S_TOTAL_REAPS     = 11, // payload: i64
+	S_TOTAL_SV_REAPS  = 12, // payload: i64
+	S_ARG             = 13, // payload: bytes, repeated
+	S_ENV             = 14, // payload: bytes, repeated
+	S_SCALE           = 15, // payload: u16 count, template, repeated
+	S_STATUS_TEXT     = 16, // payload: bytes
+	S_NOTIFYSOCK      = 17, // payload: i64
+	S_PROBE_ADDR      = 18, // payload: struct sockaddr
+	/* 32 and up: the plain fields of struct service, see svfields */
+};
 
-		if (pid1)
-			own_console();
-#ifdef __linux__
-		if (real_pid1)
-			reboot(RB_ENABLE_CAD);
-#endif
+#define SVFIELD(tag, field, isfd) \
+	{ tag, offsetof(struct service, field), \
+	  sizeof ((struct service *)0)->field, isfd }
+
+static const struct {
+	unsigned char tag;
+	unsigned short offset;
+	unsigned char size;
+	unsigned char isfd;
+} svfields[] = {
+	SVFIELD(32, state, 0),
+	SVFIELD(33, seen, 0),
+	SVFIELD(34, startstop, 0),
+	SVFIELD(35, deadline, 0),
+	SVFIELD(36, timeout, 0),
+	SVFIELD(37, pid, 0),
+	SVFIELD(38, setuppid, 0),
+	SVFIELD(39, finishpid, 0),
+	SVFIELD(40, oldpid, 0),
+	SVFIELD(41, oldkill, 0),
+	SVFIELD(42, wstatus, 0),
+	SVFIELD(43, log_out[0], 1),
+	SVFIELD(44, log_out[1], 1),
+	SVFIELD(45, log_in[0], 1),
+	SVFIELD(46, log_in[1], 1),
+	SVFIELD(47, readypipe, 1),
+	SVFIELD(48, capture[0], 2),   /* only valid with a ring */
+	SVFIELD(49, capture[1], 2),
+	SVFIELD(50, ondemand, 0),
+	SVFIELD(51, idle_timeout, 0),
+	SVFIELD(52, idle_deadline, 0),
+	SVFIELD(54, pipesize, 0),
+	SVFIELD(55, log_hwm, 0),
+	SVFIELD(56, notify, 0),
+	SVFIELD(57, stopping, 0),
+	SVFIELD(58, watchdog_ping, 0),
+	SVFIELD(59, watchdog, 0),
+	SVFIELD(60, checkpid, 0),
+	SVFIELD(61, check_interval, 0),
+	SVFIELD(62, check_timeout, 0),
+	SVFIELD(63, check_latency, 0),
+	SVFIELD(64, check_start, 0),
+	SVFIELD(65, check_next, 0),
+	SVFIELD(66, check, 0),
+	SVFIELD(67, check_fails, 0),
+	SVFIELD(68, check_failmax, 0),
+	SVFIELD(69, probefd, 1),
+	SVFIELD(70, probe_addrlen, 0),
+	SVFIELD(71, probe_interval, 0),
+	SVFIELD(72, probe_start, 0),
+	SVFIELD(73, probe_next, 0),
+	SVFIELD(74, scheduled, 0),
+	SVFIELD(75, sched_pending, 0),
+	SVFIELD(76, sched_next, 0),
+	SVFIELD(77, sched_wall, 0),
+	SVFIELD(78, last_run, 0),
+	SVFIELD(79, last_duration, 0),
+	SVFIELD(80, trigger, 0),
+};
 
-		struct stat st;
-		if (stat("SYS/finish", &st) == 0) {
-			int b = add_service("SYS");
-			services[b].state = PROC_ONESHOT;
-			process_step(b, EVNT_WANT_DOWN);
-			/* got zapped or is down */
-			if (strcmp(services[b].name, "SYS") != 0 ||
-			    services[b].state == PROC_DOWN)
-				do_stop_services();
-			else
-				services[b].timeout = TIMEOUT_SYS_FINISH;
-		} else {
-			do_stop_services();
-		}
-	} else if (global_state == GLBL_WAIT_FINISH) {
-		do_stop_services();
+#define NSVFIELDS (sizeof svfields / sizeof svfields[0])
+
+static int64_t
+svfield_get(int i, int f)
+{
+	char *p = (char *)&services[i] + svfields[f].offset;
+	int32_t v32;
+	int64_t v64;
+
+	switch (svfields[f].size) {
+	case 1: return *(signed char *)p;
+	case 4: memcpy(&v32, p, 4); return v32;
+	case 8: memcpy(&v64, p, 8); return v64;
 	}
+	return 0;
 }
 
-void
-open_control_socket()
+static void
+svfield_set(int i, int f, int64_t v)
 {
-	control_socket_path = control_socket();
-	char *last_slash = strrchr(control_socket_path, '/');
-	if (last_slash) {
-		char dir[PATH_MAX];
-		memcpy(dir, control_socket_path, last_slash - control_socket_path);
-		dir[last_slash - control_socket_path] = 0;
-		mkdir(dir, 0700);
-		// ignore errors
+	char *p = (char *)&services[i] + svfields[f].offset;
+	int32_t v32 = v;
 
-		sprn(notifypath, notifypath + sizeof notifypath, "%s/notify", dir);
-		mkdir(notifypath, 0700);
-		// ignore errors
+	switch (svfields[f].size) {
+	case 1: *(signed char *)p = v; break;
+	case 4: memcpy(p, &v32, 4); break;
+	case 8: memcpy(p, &v, 8); break;
+	}
+}
 
-		notifydir = opendir(notifypath);
-		if (!notifydir)
-			fatal("could not create notify dir %s: errno=%d\n", notifypath, errno);
+/* set or clear FD_CLOEXEC on all descriptors that survive a reexec */
+static void
+state_fds(int keep)
+{
+#define KEEP(fd) if ((fd) >= 0) fcntl((fd), F_SETFD, keep ? 0 : FD_CLOEXEC)
+	KEEP(controlsock);
+	KEEP(notifysock);
+	KEEP(globallog[0]);
+	KEEP(globallog[1] < 0 ? -globallog[1] : globallog[1]);
+
+	for (int i = 0; i < max_service; i++) {
+		for (size_t f = 0; f < NSVFIELDS; f++)
+			if (svfields[f].isfd == 1 ||
+			    (svfields[f].isfd == 2 && services[i].ring))
+				KEEP(svfield_get(i, f));
+		for (int k = 0; k < services[i].nlisten; k++)
+			KEEP(services[i].listenfd[k]);
+		for (int k = 0; k < services[i].nfdstore; k++)
+			KEEP(services[i].fdstore[k]);
 	}
+#undef KEEP
+}
 
-	struct sockaddr_un addr = { 0 };
-	addr.sun_family = AF_UNIX;
-	stecpy(addr.sun_path, addr.sun_path + sizeof addr.sun_path, control_socket_path);
+unsigned char statebuf[4096];
+size_t statelen;
+int stateerr;
 
-	int checksock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (checksock < 0)
-		fatal("check socket: errno=%d", errno);
-	if (connect(checksock, (struct sockaddr *)&addr, sizeof addr) == 0)
-		fatal("socket in use outside of nitro\n");
-	else if (errno == EPROTOTYPE)
-		fatal_no_panic("socket already in use\n");
-	else if (errno == ECONNREFUSED) // stale socket, remove
-		unlink(control_socket_path);
-	// else if (errno == ENOENT) // socket doesn't exist, good
-	// ignore other errors, fail below.
-	close(checksock);
+static void
+state_flush(int fd)
+{
+	if (statelen && safe_write(fd, (char *)statebuf, statelen) < 0)
+		stateerr = errno;
+	statelen = 0;
+}
 
-	controlsock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-	if (controlsock < 0)
-		fatal("control socket: errno=%d", errno);
+static void
+state_put(int fd, int tag, const void *data, size_t len)
+{
+	unsigned char hdr[3] = { len & 0xff, (len >> 8) & 0xff, tag };
+
+	if (len >= 0xfffe)      /* open/close, no payload */
+		len = 0;
+
+	if (statelen + sizeof hdr + len > sizeof statebuf)
+		state_flush(fd);
+	memcpy(statebuf + statelen, hdr, sizeof hdr);
+	statelen += sizeof hdr;
+
+	if (len > sizeof statebuf - statelen) {
+		state_flush(fd);
+		if (safe_write(fd, data, len) < 0)
+			stateerr = errno;
+	} else if (len) {
+		memcpy(statebuf + statelen, data, len);
+		statelen += len;
+	}
+}
 
-	mode_t mask = umask(0077);
-	int r = bind(controlsock, (struct sockaddr *)&addr, sizeof addr);
-	umask(mask);
-	if (r < 0)
-		fatal("could not bind control socket: errno=%d\n", errno);
+static void
+state_put_num(int fd, int tag, int64_t v)
+{
+	unsigned char b[8];
+	for (int k = 0; k < 8; k++)
+		b[k] = (uint64_t)v >> (8 * k);
+	state_put(fd, tag, b, sizeof b);
 }
 
-int
-notifyprefix(const char *name, const char *file)
+static int
+save_state(int fd)
 {
-	if (strncmp("ALL,", file, 4) == 0)
-		return 1;
+	char ringbuf[LOGBUF_SIZE];
+
+	statelen = 0;
+	stateerr = 0;
+
+	state_put(fd, S_MAGIC, "nitro", 5);
+	state_put_num(fd, S_CONTROLSOCK, controlsock);
+	state_put_num(fd, S_NOTIFYSOCK, notifysock);
+	state_put_num(fd, S_GLOBALLOG_IN, globallog[0]);
+	state_put_num(fd, S_GLOBALLOG_OUT, globallog[1]);
+	state_put_num(fd, S_TOTAL_REAPS, total_reaps);
+	state_put_num(fd, S_TOTAL_SV_REAPS, total_sv_reaps);
+	for (int k = 0; k < MAXSCALE; k++) {
+		if (!scales[k].name[0])
+			continue;
+		char b[2 + sizeof scales[k].name];
+		size_t l = strlen(scales[k].name);
+		b[0] = scales[k].count & 0xff;
+		b[1] = scales[k].count >> 8;
+		memcpy(b + 2, scales[k].name, l);
+		state_put(fd, S_SCALE, b, 2 + l);
+	}
 
-	// slashes are encoded as comma in the notify file name
-	while (*name && (*name == *file || (*name == '/' && *file == ',')))
-		name++, file++;
+	for (int i = 0; i < max_service; i++) {
+		state_put(fd, S_SERVICE, 0, 0xffff);
+		state_put(fd, S_NAME, services[i].name, strlen(services[i].name));
+		if (services[i].status_text[0])
+			state_put(fd, S_STATUS_TEXT, services[i].status_text,
+			    strlen(services[i].status_text));
+		if (services[i].probe_addrlen)
+			state_put(fd, S_PROBE_ADDR, &services[i].probe_addr,
+			    services[i].probe_addrlen);
+		for (size_t f = 0; f < NSVFIELDS; f++)
+			state_put_num(fd, svfields[f].tag, svfield_get(i, f));
+		for (int k = 0; k < services[i].nlisten; k++)
+			state_put_num(fd, S_LISTENFD, services[i].listenfd[k]);
+		for (int k = 0; k < services[i].nfdstore; k++)
+			state_put_num(fd, S_FDSTORE, services[i].fdstore[k]);
+		if (services[i].transient) {
+			struct transient *tr = &transients[services[i].transient - 1];
+			for (int k = 0; k < tr->argc; k++)
+				state_put(fd, S_ARG, tr->argv[k], strlen(tr->argv[k]));
+			for (int k = 0; k < tr->envc; k++)
+				state_put(fd, S_ENV, tr->env[k], strlen(tr->env[k]));
+		}
+		if (services[i].ring) {
+			struct ring *rg = &rings[services[i].ring - 1];
+			state_put(fd, S_RING, ringbuf, ring_copy(i, ringbuf));
+			state_put(fd, S_RING_OUT, rg->out, rg->pending);
+		}
+		state_put(fd, S_SERVICE, 0, 0xfffe);
+	}
 
-	return *name == 0 && *file == ',';
+	state_flush(fd);
+
+	return stateerr ? -1 : 0;
 }
 
-void
-notify(int i)
+static int64_t
+state_num(unsigned char *d, size_t len)
 {
-	char notifybuf[128];
-	unsigned char len = strlen(services[i].name);
-	notifybuf[0] = len;
-	notifybuf[1] = 0;
-	notifybuf[2] = services[i].state;
-	stecpy(notifybuf + 3, notifybuf + sizeof notifybuf, services[i].name);
+	uint64_t v = 0;
+	if (len != 8)
+		return -1;
+	for (int k = 0; k < 8; k++)
+		v |= (uint64_t)d[k] << (8 * k);
+	return (int64_t)v;
+}
 
-	struct dirent *ent;
-	rewinddir(notifydir);
-	while ((ent = readdir(notifydir))) {
-		char *name = ent->d_name;
+/* adopt the services of the nitro that exec'ed us */
+/* fd is still used by nitro or one of the restored services */
+static int
+restore_fd_used(int fd)
+{
+	if (fd == controlsock || fd == notifysock || fd == globallog[0] ||
+	    fd == (globallog[1] < 0 ? -globallog[1] : globallog[1]))
+		return 1;
 
-		if (name[0] == '.')
-			continue;
+	for (int i = 0; i < max_service; i++) {
+		for (size_t f = 0; f < NSVFIELDS; f++)
+			if ((svfields[f].isfd == 1 ||
+			    (svfields[f].isfd == 2 && services[i].ring)) &&
+			    svfield_get(i, f) == fd)
+				return 1;
+		for (int k = 0; k < services[i].nlisten; k++)
+			if (services[i].listenfd[k] == fd)
+				return 1;
+		for (int k = 0; k < services[i].nfdstore; k++)
+			if (services[i].fdstore[k] == fd)
+				return 1;
+	}
 
-		if (notifyprefix(services[i].name, name)) {
-			struct sockaddr_un addr = { 0 };
-			addr.sun_family = AF_UNIX;
+	return 0;
+}
 
-			sprn(addr.sun_path, addr.sun_path + sizeof addr.sun_path,
-			    "%s/%s", notifypath, name);
+/* the service i did not fit into the table: kill its processes and
+   close its descriptors, as nothing would supervise them any more.
+   Services are saved in table order, so all that are kept come first. */
+static void
+restore_drop(int i)
+{
+	prn(2, "- nitro: no room for %s after re-exec, limit=%d, killing it\n",
+	    services[i].name, maxsv);
+
+	pid_t pids[] = { services[i].pid, services[i].oldpid,
+	    services[i].setuppid, services[i].finishpid, services[i].checkpid };
+	for (size_t k = 0; k < sizeof pids / sizeof pids[0]; k++)
+		if (pids[k] > 0)
+			kill(pids[k], SIGKILL);
+
+	for (size_t f = 0; f < NSVFIELDS; f++)
+		if (svfields[f].isfd == 1 ||
+		    (svfields[f].isfd == 2 && services[i].ring)) {
+			int fd = svfield_get(i, f);
+			if (fd > 2 && !restore_fd_used(fd))
+				close(fd);
+		}
+	for (int k = 0; k < services[i].nlisten; k++)
+		close(services[i].listenfd[k]);
+	for (int k = 0; k < services[i].nfdstore; k++)
+		close(services[i].fdstore[k]);
+
+	if (services[i].ring)
+		rings[services[i].ring - 1].used = 0;
+	transient_free(i);
+	services[i] = (struct service){ 0 };
+}
 
-			if (sendto(controlsock, notifybuf, len + 3,
-			    MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof addr) < 0) {
-				if (errno == ECONNREFUSED) {
-					// remove stale socket
-					unlinkat(dirfd(notifydir), name, 0);
+static void
+restore_state(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < 8)
+		fatal("can't read state: errno=%d\n", errno);
+
+	unsigned char *buf = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		fatal("can't map state: errno=%d\n", errno);
+	unsigned char *end = buf + st.st_size;
+
+	if (buf[2] != S_MAGIC || buf[0] != 5 || memcmp(buf + 3, "nitro", 5) != 0)
+		fatal("invalid state\n");
+
+	int i = -1;
+	unsigned char *p = buf;
+	while (p + 3 <= end) {
+		size_t len = p[0] | (p[1] << 8);
+		int tag = p[2];
+		unsigned char *d = p + 3;
+
+		if (len == 0xffff) {            /* open */
+			if (tag == S_SERVICE) {
+				/* the spare last slot takes what doesn't fit */
+				if (max_service < maxsv - 1) {
+					i = max_service++;
+					if (max_service > service_hwm)
+						service_hwm = max_service;
+				} else {
+					i = maxsv - 1;
 				}
+				services[i] = (struct service){ 0 };
+				services[i].log_in[0] = services[i].log_in[1] = -1;
+				services[i].log_out[0] = services[i].log_out[1] = -1;
+				services[i].readypipe = -1;
+			}
+			p += 3;
+			continue;
+		} else if (len == 0xfffe) {     /* close */
+			if (i == maxsv - 1)
+				restore_drop(i);
+			i = -1;
+			p += 3;
+			continue;
+		} else if (d + len > end) {
+			break;
+		}
+		p = d + len;
+
+		int64_t v = state_num(d, len);
+		switch (tag) {
+		case S_CONTROLSOCK: controlsock = v; continue;
+		case S_NOTIFYSOCK: notifysock = v; continue;
+		case S_GLOBALLOG_IN: globallog[0] = v; continue;
+		case S_GLOBALLOG_OUT: globallog[1] = v; continue;
+		case S_TOTAL_REAPS: total_reaps = v; continue;
+		case S_TOTAL_SV_REAPS: total_sv_reaps = v; continue;
+		case S_SCALE:
+			if (len > 2 && len < 2 + sizeof scales[0].name) {
+				char tmpl[sizeof scales[0].name];
+				memcpy(tmpl, d + 2, len - 2);
+				tmpl[len - 2] = 0;
+				scale_set(tmpl, d[0] | (d[1] << 8));
 			}
+			continue;
 		}
-	}
-}
 
-void
-handle_ready_pipe(int j)
-{
-	char buf[256];
+		if (i < 0)
+			continue;
 
-	for (int i = 0; i < max_service; i++) {
-		if (fds[j].fd == services[i].readypipe) {
-			int r = read(fds[j].fd, buf, sizeof buf);
-			if (r == -1) {
-				if (errno != EINTR && errno != EAGAIN) {
-					dprn("read error: %d\n", errno);
-				}
-			} else if (memchr(buf, '\n', r)) {
-				if (services[i].state == PROC_STARTING) {
-					dprn("service %s is ready\n", services[i].name);
-					services[i].deadline = 0;
-					services[i].timeout = 0;
-					services[i].state = PROC_UP;
-					notify(i);
-				}
+		switch (tag) {
+		case S_NAME:
+			if (len < sizeof services[i].name) {
+				memcpy(services[i].name, d, len);
+				services[i].name[len] = 0;
+				services[i].flags = name_flags(services[i].name);
 			}
-			if (r == 0 || (fds[j].revents & POLLHUP)) {
-				close(services[i].readypipe);
-				services[i].readypipe = -1;
+			break;
+		case S_PROBE_ADDR:
+			if (len <= sizeof services[i].probe_addr)
+				memcpy(&services[i].probe_addr, d, len);
+			break;
+		case S_STATUS_TEXT:
+			if (len < sizeof services[i].status_text) {
+				memcpy(services[i].status_text, d, len);
+				services[i].status_text[len] = 0;
+			}
+			break;
+		case S_LISTENFD:
+			if (services[i].nlisten < MAXLISTEN)
+				services[i].listenfd[services[i].nlisten++] = v;
+			else
+				close(v);
+			break;
+		case S_FDSTORE:
+			if (services[i].nfdstore < MAXFDSTORE)
+				services[i].fdstore[services[i].nfdstore++] = v;
+			else
+				close(v);
+			break;
+		case S_RING: {
+			int r;
+			for (r = 0; r < LOGBUF_SLOTS; r++)
+				if (!rings[r].used)
+					break;
+			if (r == LOGBUF_SLOTS)
+				break;
+			if (len > sizeof rings[r].buf) {
+				d += len - sizeof rings[r].buf;
+				len = sizeof rings[r].buf;
+			}
+			rings[r] = (struct ring){ .used = 1 };
+			memcpy(rings[r].buf, d, len);
+			rings[r].len = len;
+			rings[r].pos = len % sizeof rings[r].buf;
+			services[i].ring = r + 1;
+			break;
+		}
+		case S_ARG:
+		case S_ENV:
+			if (!services[i].transient) {
+				int t = transient_alloc();
+				if (t < 0)
+					break;
+				services[i].transient = t + 1;
+			}
+			transient_add(services[i].transient - 1, tag == S_ENV,
+			    (char *)d, len);
+			break;
+		case S_RING_OUT:
+			if (services[i].ring && len <= PIPE_BUF) {
+				struct ring *rg = &rings[services[i].ring - 1];
+				memcpy(rg->out, d, len);
+				rg->pending = len;
 			}
 			break;
+		default:
+			for (size_t f = 0; f < NSVFIELDS; f++)
+				if (svfields[f].tag == tag)
+					svfield_set(i, f, v);
 		}
 	}
-}
 
-#define SPAT_U8(tag, value) \
-		*reply++ = 1; \
-		*reply++ = 0; \
-		*reply++ = tag; \
-		*reply++ = ((uint8_t)value);
+	munmap(buf, st.st_size);
+	close(fd);
 
-#define SPAT_U32(tag, value) \
-		*reply++ = 4; \
-		*reply++ = 0; \
-		*reply++ = tag; \
-		*reply++ = ((uint32_t)value); \
-		*reply++ = ((uint32_t)value) >> 8; \
-		*reply++ = ((uint32_t)value) >> 16; \
-		*reply++ = ((uint32_t)value) >> 24;
+	state_fds(0);
+}
 
+/* replace nitro by a (possibly new) binary, keeping all services */
 void
-handle_control_sock()
+reexec()
 {
-	enum tags status = T_OK;
-	unsigned char buf[256];
-	struct sockaddr_un src;
-	socklen_t srclen = sizeof src;
-	ssize_t r = recvfrom(controlsock, buf, sizeof buf,
-	    MSG_DONTWAIT, (struct sockaddr *)&src, &srclen);
-
-	if (r < 0) {
-		if (errno == EAGAIN)
-			return;
-		dprn("callback error: errno=%d\n", errno);
+	int fd;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	fd = memfd_create("nitro-state", 0);
+#else
+	char path[PATH_MAX];
+	sprn(path, path + sizeof path, "%s/.state", notifypath);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	unlink(path);
+#endif
+	if (fd < 0) {
+		prn(2, "- nitro: can't create state file: errno=%d\n", errno);
 		return;
 	}
 
-	if (r < 3)
-		return;
-
-	// currently only the first command per socket is parsed
-	int len = buf[0] | (buf[1] << 8);
-	if (len > r + 3)
+	if (save_state(fd) < 0) {
+		prn(2, "- nitro: can't write state: errno=%d\n", stateerr);
+		close(fd);
 		return;
-	enum tags cmd = buf[2];
-	const char *sv = "";
-	if (len < 64) {
-		sv = (char *)buf + 3;
-		buf[3 + len] = 0;
 	}
 
-	switch (cmd) {
-	case T_CMD_LIST:
-	{
-		if (srclen == 0)
-			return;
-
-		char replybuf[4096];
-		char *replyend = replybuf + sizeof replybuf;
-		char *reply = replybuf;
-		deadline now = time_now();
-
-		for (int i = 0; i < max_service && replyend - replybuf > 128; i++) {
-			*reply++ = 0xff;
-			*reply++ = 0xff;
-			*reply++ = T_SERVICE;
+	char statefd[32];
+	char *extra[1] = { statefd };
+	steprl(stecpy(statefd, statefd + sizeof statefd,
+	    "NITRO_STATE_FD="), statefd + sizeof statefd, fd);
 
-			char *lenpos = reply;
-			*reply++ = 0;
-			*reply++ = 0;
-			*reply++ = T_NAME;
-			char *s = services[i].name;
-			while ((*reply++ = *s++))
-				;
-			*lenpos = s - services[i].name;
+	size_t envc = 0;
+	while (child_environ[envc])
+		envc++;
+	char *env[envc + 2];
 
-			SPAT_U8(T_STATE, services[i].state);
-			SPAT_U32(T_PID, services[i].pid);
-			SPAT_U32(T_WSTATUS, services[i].wstatus);
-			uint32_t uptime = (now - services[i].startstop) / 1000;
-			SPAT_U32(T_UPTIME, uptime);
+	/* the new nitro can't answer them */
+	for (int w = 0; w < MAXWAITERS; w++)
+		if (waiters[w].used)
+			waiter_reply(w, T_EFAIL, -1);
 
-			*reply++ = 0xfe;
-			*reply++ = 0xff;
-			*reply++ = T_SERVICE;
-		}
+	prn(2, "- nitro: re-executing %s\n", nitro_exe);
 
-		sendto(controlsock, replybuf, reply - replybuf,
-		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
-		return;
-	}
-	case T_CMD_QUERY:
-	{
-		if (srclen == 0)
-			return;
+	state_fds(1);
+	execve(nitro_exe, nitro_argv, child_env(env, extra, 1));
 
-		int i = find_service(sv);
-		if (i < 0)
-			goto fail;
-		char replybuf[128];
-		char *reply = replybuf;
-		deadline now = time_now();
+	prn(2, "- nitro: could not re-exec '%s': errno=%d\n", nitro_exe, errno);
+	state_fds(0);
+	close(fd);
+}
 
-		SPAT_U8(T_STATE, services[i].state);
-		SPAT_U32(T_PID, services[i].pid);
-		SPAT_U32(T_WSTATUS, services[i].wstatus);
-		uint32_t uptime = (now - services[i].startstop) / 1000;
-		SPAT_U32(T_UPTIME, uptime);
+/* find the binary to re-exec later, when we are in the service directory:
+   the path we were started with if absolute, else what it resolved to */
+static void
+find_exe(const char *argv0)
+{
+	char *end = nitro_exe + sizeof nitro_exe;
 
-		sendto(controlsock, replybuf, reply - replybuf,
-		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+	if (argv0[0] == '/') {
+		stecpy(nitro_exe, end, argv0);
 		return;
 	}
-	case T_CMD_INFO:
-	{
-		if (srclen == 0)
-			return;
-
-		char replybuf[64];
-		char *reply = replybuf;
-
-		pid_t pid = getpid();
-		SPAT_U32(T_NITRO_PID, pid);
-		SPAT_U32(T_PID, pid);
-		SPAT_U32(T_MAX_SERVICE, max_service);
-		SPAT_U32(T_TOTAL_REAPS, total_reaps);
-		SPAT_U32(T_TOTAL_SV_REAPS, total_sv_reaps);
-		sendto(controlsock, replybuf, reply - replybuf,
-		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+#ifdef __linux__
+	ssize_t r = readlink("/proc/self/exe", nitro_exe, sizeof nitro_exe - 1);
+	if (r > 0) {
+		nitro_exe[r] = 0;
 		return;
 	}
-	case T_CMD_UP:
-	case T_CMD_DOWN:
-	case T_CMD_RESTART:
-	case T_CMD_READY:
-	{
-		struct stat st;
-
-		if (len == 0)
-			goto fail;
-
-		int i;
-		if ((cmd != T_CMD_DOWN || find_service("SYS") != -1) &&
-		    cmd != T_CMD_READY &&
-		    valid_service_name(sv) &&
-		    stat_slash_to_at(sv, ".", &st) == 0)
-			i = add_service(sv);
-		else
-			i = find_service(sv);
-		if (i < 0)
-			goto fail;
-		services[i].seen = 1;
-
-		if (cmd == T_CMD_UP)
-			process_step(i, EVNT_WANT_UP);
-		else if (cmd == T_CMD_DOWN)
-			process_step(i, EVNT_WANT_DOWN);
-		else if (cmd == T_CMD_RESTART)
-			process_step(i, EVNT_WANT_RESTART);
-		else if (cmd == T_CMD_READY &&
-		    services[i].state == PROC_STARTING)
-			process_step(i, EVNT_TIMEOUT);
-
-		notify(i);
+#endif
+	char *s = nitro_exe;
+	if (getcwd(nitro_exe, sizeof nitro_exe))
+		s = stecpy(nitro_exe + strlen(nitro_exe), end, "/");
+	stecpy(s, end, argv0);
+}
 
-		goto ok;
-	}
-	case T_CMD_RESCAN:
-		want_rescan = 1;
-		goto ok;
-	case T_CMD_SHUTDOWN:
-		want_shutdown = 1;
-		goto ok;
-	case T_CMD_REBOOT:
-		want_reboot = 1;
-		goto ok;
-	case T_CMD_SIGNAL:
-		if (len < 2)
-			goto fail;
-		int i = find_service(sv + 1);
-		if (i >= 0 && services[i].pid) {
-			kill(services[i].pid, (unsigned char)sv[0]);
-			goto ok;
-		}
-		goto fail;
-	default:
-		status = T_ENOSYS;
-		goto ok;
-	}
+/* take NITRO_STATE_FD out of the environment, returns the fd or -1 */
+static int
+state_fd_from_env()
+{
+	static const char var[] = "NITRO_STATE_FD=";
+	int fd = -1;
 
-fail:
-	status = T_ESRCH;
-ok:
-	if (srclen > 0) {
-		unsigned char reply[] = { 0, 0, status };
-		sendto(controlsock, reply, sizeof reply,
-		    MSG_DONTWAIT, (struct sockaddr *)&src, srclen);
+	for (char **e = environ; *e; e++) {
+		if (strncmp(*e, var, sizeof var - 1) != 0)
+			continue;
+
+		fd = atoi(*e + sizeof var - 1);
+		char **f = e;
+		do
+			f[0] = f[1];
+		while (*f++);
+		break;
 	}
+
+	return fd;
 }
 
-void
-has_died(pid_t pid, int status)
+/* look at the timers of all services and collect their fds to poll,
+   return the number of fds used */
+int
+poll_services(deadline now, int *timeout)
 {
-	total_reaps++;
+	int max_fd = FIXFD;
 
 	for (int i = 0; i < max_service; i++) {
-		if (services[i].setuppid == pid) {
-			total_sv_reaps++;
-
-			dprn("setup %s[%d] has died with status %d\n",
-			    services[i].name, pid, status);
-
-			services[i].setuppid = 0;
+		if (services[i].transient &&
+		    ((!services[i].seen && services[i].state == PROC_DOWN) ||
+		    services[i].state == PROC_FATAL)) {
+			/* a transient service that was stopped or failed */
+			services[i].seen = 0;
+			proc_zap(i);
+			if (i >= max_service)
+				break;
+		}
 
-			if (services[i].state == PROC_SETUP) {
-				if (WEXITSTATUS(status) == 0) {
-					process_step(i, EVNT_SETUP);
-				} else if (WEXITSTATUS(status) == 111) {
-					services[i].state = PROC_FATAL;
-					services[i].wstatus = -1;
-					notify(i);
-				} else {
-					services[i].state = PROC_DELAY;
-					services[i].timeout = DELAY_RESPAWN;
-					services[i].deadline = 0;
-				}
+		/* catch state changes outside of process_step */
+		if (status && (status->max_service != (uint32_t)max_service ||
+		    services[i].status_state != services[i].state ||
+		    services[i].status_pid != services[i].pid))
+			status_update(i);
+again:
+		if (services[i].idle_deadline) {
+			if (services[i].state != PROC_SETUP &&
+			    services[i].state != PROC_STARTING &&
+			    services[i].state != PROC_UP) {
+				services[i].idle_deadline = 0;
+			} else if (services[i].idle_deadline <= now &&
+			    idle_confirm(i)) {
+				dprn("service %s is idle\n", services[i].name);
+				services[i].idle_deadline = 0;
+				process_step(i, EVNT_WANT_DOWN);
+				goto again;
+			} else {
+				wait_until(timeout, services[i].idle_deadline, now);
 			}
+		}
 
-			if (strcmp(services[i].name, "SYS") == 0 &&
-			    global_state == GLBL_UP) { /* C-A-D during SYS */
-				services[i].seen = 0;
-				proc_cleanup(i);
-				proc_zap(i);
+		if (services[i].watchdog > 0 &&
+		    services[i].state == PROC_UP &&
+		    global_state == GLBL_UP) {
+			deadline d = services[i].watchdog_ping +
+			    services[i].watchdog;
+			if (d <= now) {
+				prn(2, "- nitro: watchdog of %s expired, restarting\n",
+				    services[i].name);
+				process_step(i, EVNT_WANT_RESTART);
+				goto again;
+			}
+			wait_until(timeout, d, now);
+		}
 
-				prn(2, "- nitro: SYS/setup finished with status %d\n", status);
+		if (services[i].checkpid) {
+			deadline d = services[i].check_start +
+			    services[i].check_timeout;
+			if (d <= now)
+				kill(services[i].checkpid, SIGKILL);
+			else
+				wait_until(timeout, d, now);
+		} else if (services[i].check_interval > 0 &&
+		    services[i].state == PROC_UP &&
+		    global_state == GLBL_UP) {
+			int interval = services[i].check_interval;
+			if (!services[i].check_next)
+				services[i].check_next =
+				    now + interval + jitter(interval);
+			if (services[i].check_next <= now) {
+				proc_check(i);
+				services[i].check_next =
+				    now + interval + jitter(interval);
+			}
+			wait_until(timeout, services[i].check_next, now);
+		}
 
-				// bring up rest of the services
-				rescan();
-				return;
+		if (services[i].probefd >= 0) {
+			deadline d = services[i].probe_start +
+			    (services[i].state == PROC_UP ?
+			    services[i].check_timeout : PROBE_TIMEOUT);
+			if (d <= now) {
+				probe_finish(i, 1);
+				goto again;
+			}
+			wait_until(timeout, d, now);
+			fds[max_fd].fd = services[i].probefd;
+			fds[max_fd].events = POLLOUT;
+			fdowner[max_fd].service = i;
+			fdowner[max_fd].kind = FD_PROBE;
+			max_fd++;
+		} else if (services[i].probe_addrlen &&
+		    (services[i].state == PROC_STARTING ||
+		    (services[i].state == PROC_UP &&
+		    services[i].probe_interval > 0)) &&
+		    global_state == GLBL_UP) {
+			int interval = services[i].probe_interval;
+			if (!services[i].probe_next)
+				services[i].probe_next = now +
+				    (services[i].state == PROC_STARTING ?
+				    PROBE_RETRY : interval + jitter(interval));
+			if (services[i].probe_next <= now) {
+				probe_connect(i);
+				goto again;
 			}
+			wait_until(timeout, services[i].probe_next, now);
+		}
 
-			if (services[i].state == PROC_SHUTDOWN ||
-			    services[i].state == PROC_RESTART) {
-				// When down or restart is requested during
-				// setup, skip straight to finished as the main
-				// process didn't run yet.
-				process_step(i, EVNT_FINISHED);
+		if (services[i].scheduled && global_state == GLBL_UP) {
+			if (services[i].sched_pending &&
+			    services[i].state == PROC_DOWN) {
+				services[i].sched_pending = 0;
+				services[i].last_run = now;
+				process_step(i, EVNT_WANT_UP);
+			}
+			if (!services[i].sched_next)
+				sched_plan(i, now);
+			/* the wall clock may jump, e.g. after a suspend */
+			if (services[i].sched_next &&
+			    (services[i].sched_next <= now ||
+			    (services[i].sched_wall &&
+			    time(0) >= services[i].sched_wall))) {
+				sched_run(i);
+				sched_plan(i, now);
+			}
+			if (services[i].sched_next) {
+				wait_until(timeout, services[i].sched_next, now);
+				if (services[i].sched_wall)
+					wait_until(timeout, now + SCHED_RECHECK, now);
 			}
+		}
 
-			return;
+		if (services[i].oldkill) {
+			if (services[i].oldkill <= now) {
+				kill(services[i].oldpid, SIGKILL);
+				services[i].oldkill = 0;
+			} else {
+				wait_until(timeout, services[i].oldkill, now);
+			}
 		}
 
-		if (services[i].pid == pid) {
-			total_sv_reaps++;
+		if (services[i].timeout > 0) {
+			if (services[i].deadline == 0)
+				services[i].deadline = now + services[i].timeout;
 
-			dprn("service %s[%d] has died with status %d\n",
-			    services[i].name, pid, status);
-			services[i].pid = 0;
-			services[i].wstatus = status;
-			process_step(i, EVNT_EXITED);
+			if (services[i].deadline <= now) {
+				process_step(i, EVNT_TIMEOUT);
+				goto again;
+			}
 
-			return;
+			wait_until(timeout, services[i].deadline, now);
 		}
 
-		if (services[i].finishpid == pid) {
-			total_sv_reaps++;
-
-			dprn("finish script %s[%d] has died with status %d\n",
-			    services[i].name, pid, status);
-			services[i].finishpid = 0;
+		if (services[i].readypipe != -1) {
+			fds[max_fd].fd = services[i].readypipe;
+			fds[max_fd].events = POLLIN;
+			fdowner[max_fd].service = i;
+			fdowner[max_fd].kind = FD_READY;
+			max_fd++;
+		}
 
-			if (strcmp(services[i].name, "SYS") == 0) {
-				prn(2, "- nitro: SYS/finish finished\n");
-				process_step(i, EVNT_FINISHED);
-				do_stop_services();
+		if (services[i].ring) {
+			if (rings[services[i].ring - 1].pending) {
+				fds[max_fd].fd = forward_fd(i);
+				fds[max_fd].events = POLLOUT;
+				fdowner[max_fd].kind = FD_FORWARD;
 			} else {
-				process_step(i, EVNT_FINISHED);
+				fds[max_fd].fd = services[i].capture[0];
+				fds[max_fd].events = POLLIN;
+				fdowner[max_fd].kind = FD_CAPTURE;
 			}
+			fdowner[max_fd].service = i;
+			max_fd++;
+		}
 
-			return;
+		/* watch sockets for activation, or for connections while
+		   the service reported being idle */
+		if ((services[i].ondemand &&
+		    services[i].state == PROC_DOWN &&
+		    global_state == GLBL_UP) ||
+		    services[i].idle_deadline) {
+			for (int k = 0; k < services[i].nlisten; k++) {
+				fds[max_fd].fd = services[i].listenfd[k];
+				fds[max_fd].events = POLLIN;
+				fdowner[max_fd].service = i;
+				fdowner[max_fd].kind = FD_LISTEN;
+				max_fd++;
+			}
 		}
 	}
 
-	dprn("reaping unknown child %d\n", pid);
-}
-
-#ifdef __linux__
-static int
-mounted(const char *dir)
-{
-	struct stat rootst;
-	struct stat dirst;
-
-	/* only detects toplevel mount points */
-	stat("/", &rootst);
-	if (stat(dir, &dirst) < 0)
-		return 1;  /* can't mount if mountpoint doesn't exist */
-
-	return rootst.st_dev != dirst.st_dev;
-}
-#endif
-
-void
-init_mount()
-{
-#ifdef __linux__
-	if (access("/dev/null", F_OK) < 0 && !mounted("/dev"))
-		mount("dev", "/dev", "devtmpfs", MS_NOSUID, "mode=0755");
-	if (!mounted("/run"))
-		mount("run", "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755");
-#endif
-#ifdef __NetBSD__
-	control_socket_path = control_socket();
-
-	char *last_slash = strrchr(control_socket_path, '/');
-	if (!last_slash)
-		return;
-
-	*last_slash = 0;
-
-	struct stat st;
-	if (stat(control_socket_path, &st) < 0)
-		fatal("mountpoint %s missing: errno=%d",
-		    control_socket_path, errno);
-
-	struct tmpfs_args args = {
-		.ta_version = TMPFS_ARGS_VERSION,
-		 // 32MB should be enough for everyone
-		.ta_size_max = 32 * 1024 * 1024,
-		.ta_root_uid = st.st_uid,
-		.ta_root_gid = st.st_gid,
-		.ta_root_mode = st.st_mode,
-	};
-	if (mount(MOUNT_TMPFS, control_socket_path, MNT_NOSUID | MNT_NODEV,
-	    &args, sizeof args) < 0)
-		fatal("mounting %s failed: errno=%d\n",
-		    control_socket_path, errno);
-
-	*last_slash = '/';
-#endif
+	return max_fd;
 }
 
-void
-killall()
+/* the number in the environment variable name, else dflt */
+static long
+env_num(const char *name, long dflt, long min, long max)
 {
-	prn(2, "- nitro: sending SIGTERM to all processes\n");
-	kill(-1, SIGTERM);
-	kill(-1, SIGCONT);
-	global_state = GLBL_WAIT_TERM;
-
-	int i = add_service(".SHUTDOWN");
-	services[i].state = PROC_DELAY;
-	services[i].timeout = TIMEOUT_SIGTERM;
-	services[i].deadline = 0;
+	char *e = getenv(name);
+	if (!e || !*e)
+		return dflt;
+
+	long n = 0;
+	for (; ((unsigned int)*e - '0') < 10 && n <= max; e++)
+		n = n*10 + (*e - '0');
+	if (*e || n < min || n > max) {
+		prn(2, "- nitro: invalid %s, using %d\n", name, (int)dflt);
+		return dflt;
+	}
+	return n;
 }
 
+/* reserve the arena for NITRO_MAXSV (or MAXSV) services */
 void
-slayall()
+arena_setup()
 {
-	prn(2, "- nitro: sending SIGKILL to all processes\n");
-
-#ifdef __linux__
-	/* On Linux, kill(-1, SIGKILL) can block indefinitely and hang the
-	   current process when a process is stuck in state D, so fork and only
-	   block the child.  */
-	pid_t child = fork();
-	if (child == 0) {
-		kill(-1, SIGKILL);
-		_exit(0);
-	}
-#else
-	kill(-1, SIGKILL);
-#endif
-
-	global_state = GLBL_WAIT_KILL;
-
-	int i = add_service(".SHUTDOWN");
-	services[i].state = PROC_DELAY;
-	services[i].timeout = TIMEOUT_SIGKILL;
-	services[i].deadline = 0;
+	maxsv = env_num("NITRO_MAXSV", MAXSV, 2, MAXSV_LIMIT);
+
+	size_t svsize = maxsv * sizeof *services;
+	size_t fdsize = MAXFDS * sizeof *fds;
+	size_t ownersize = MAXFDS * sizeof *fdowner;
+	char *p = mmap(0, svsize + fdsize + ownersize, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		fatal("can't reserve %d services: errno=%d\n", maxsv, errno);
+
+	services = (struct service *)p;
+	fds = (struct pollfd *)(p + svsize);
+	fdowner = (struct fdowner *)(p + svsize + fdsize);
 }
 
-#undef CTRL
-
-#define CHLD 0
-#define CTRL 1
-
 int
 main(int argc, char *argv[])
 {
 	int i;
 
+	nitro_argv = argv;
+	find_exe(argv[0]);
+	int statefd = state_fd_from_env();      /* set by reexec() */
+
 	pid1 = real_pid1 = (getpid() == 1);
-	if (pid1) {
+	if (pid1 && statefd >= 0) {
+#ifdef __linux__
+		if (reboot(RB_DISABLE_CAD) < 0)
+			real_pid1 = 0;
+#endif
+	} else if (pid1) {
 		umask(0022);
 		init_mount();
 #ifdef __linux__
@@ -1856,7 +5320,6 @@ main(int argc, char *argv[])
 #endif
 		own_console();
 	}
-
 	// can't use putenv, which pulls in realloc
 	if (!getenv("PATH")) {
 		envbuf[0] = (char *)"PATH=" _PATH_STDPATH;
@@ -1926,9 +5389,20 @@ main(int argc, char *argv[])
 	if (pipe2(selfpipe, O_NONBLOCK | O_CLOEXEC) < 0)
 		fatal("selfpipe pipe: errno=%d\n", errno);
 
-	if (pipe2(globallog, O_CLOEXEC) < 0)   // keep globallog blocking
-		fatal("globallog pipe: errno=%d\n", errno);
-	globallog[1] = -globallog[1];     // made active when LOG is started
+	arena_setup();
+	log_sample_interval = env_num("NITRO_LOG_SAMPLE", LOG_SAMPLE_INTERVAL,
+	    0, 3600000);
+	/* load the time zone for ./schedule now, not at runtime: the libc
+	   only reads it again when TZ changes */
+	tzset();
+
+	if (statefd >= 0) {
+		restore_state(statefd);
+	} else {
+		if (pipe2(globallog, O_CLOEXEC) < 0)   // keep globallog blocking
+			fatal("globallog pipe: errno=%d\n", errno);
+		globallog[1] = -globallog[1];     // made active when LOG is started
+	}
 
 	sigset_t allset;
 	sigfillset(&allset);
@@ -1941,63 +5415,81 @@ main(int argc, char *argv[])
 	sigaction(SIGCHLD, &sa, 0);
 	sigaction(SIGHUP, &sa, 0);
 	sigaction(SIGINT, &sa, 0);
+#ifdef SIGRTMIN
+	sigaction(SIGRTMIN + 6, &sa, 0);
+#endif
 	if (!real_pid1)         // only standalone and in containers
 		sigaction(SIGTERM, &sa, 0);
 
-	open_control_socket();
-
 	global_state = GLBL_UP;
 
-	prn(2, "- nitro: booting\n");
-
 	struct stat st;
-	if (stat("SYS/setup", &st) == 0) {
-		int b = add_service("SYS");
-		process_step(b, EVNT_WANT_UP);
+	if (statefd >= 0) {
+		open_notify_dir();
+#ifdef __linux__
+		if (notifysock < 0)
+			open_notify_socket();
+		open_trigger_watch();
+		trigger_check(0, 0);
+#endif
+		prn(2, "- nitro: re-executed, adopted %d services\n", max_service);
+		/* reap what died in between */
+		(void)! write(selfpipe[1], "", 1);
 	} else {
-		if (stat("LOG", &st) == 0) {
-			int l = add_service("LOG");
-			process_step(l, EVNT_WANT_UP);
+		open_control_socket();
+#ifdef __linux__
+		open_trigger_watch();
+#endif
+
+		prn(2, "- nitro: booting\n");
+
+		if (stat("SYS/setup", &st) == 0) {
+			int b = add_service("SYS");
+			process_step(b, EVNT_WANT_UP);
+		} else {
+			if (stat("LOG", &st) == 0) {
+				int l = add_service("LOG");
+				process_step(l, EVNT_WANT_UP);
+			}
+			rescan();
 		}
-		rescan();
 	}
 
 	fds[CHLD].fd = selfpipe[0];
 	fds[CHLD].events = POLLIN;
 	fds[CTRL].fd = controlsock;
 	fds[CTRL].events = POLLIN;
+	fds[NTFY].fd = notifysock;
+	fds[NTFY].events = POLLIN;
+	fds[INOT].fd = inotifyfd;
+	fds[INOT].events = POLLIN;
+	fds[MNTS].fd = mountsfd;
+	fds[MNTS].events = POLLPRI;
 
 	while (1) {
 		deadline now = time_now();
 
 		int timeout = -1;
-		int max_fd = FIXFD;
-
-		for (i = 0; i < max_service; i++) {
-again:
-			if (services[i].readypipe != -1) {
-				fds[max_fd].fd = services[i].readypipe;
-				fds[max_fd].events = POLLIN;
-				max_fd++;
-			}
-
-			if (services[i].timeout <= 0)
-				continue;
-
-			if (services[i].deadline == 0)
-				services[i].deadline = now + services[i].timeout;
-
-			if (services[i].deadline <= now) {
-				process_step(i, EVNT_TIMEOUT);
-				goto again;
-			}
+		int max_fd = poll_services(now, &timeout);
 
-			int64_t wait_for = services[i].deadline - now;
-			if (wait_for > 0) {
-				if (timeout == -1 || (wait_for < timeout))
-					timeout = wait_for;
-			}
+		if (log_sample_interval && log_sample_deadline <= now) {
+			if (sample_log_pipes())
+				log_sample_deadline = now + log_sample_interval;
+			else
+				log_sample_deadline = INT64_MAX;
 		}
+		if (log_sample_interval && log_sample_deadline != INT64_MAX)
+			wait_until(&timeout, log_sample_deadline, now);
+
+		/* states changed above, look at rollout and waiters again */
+		if (state_changed && (rollout.tmpl[0] || nwaiters))
+			timeout = 0;
+		for (int w = 0; nwaiters && w < MAXWAITERS; w++)
+			if (waiters[w].used && waiters[w].deadline)
+				wait_until(&timeout, waiters[w].deadline, now);
+		for (int i = 0; rollout.tmpl[0] && i < max_service; i++)
+			if (services[i].rolling == 2)
+				wait_until(&timeout, services[i].rolling_deadline, now);
 
 		if (global_state == GLBL_FINAL)
 			break;
@@ -2037,9 +5529,48 @@ again:
 			handle_control_sock();
 		}
 
+#ifdef __linux__
+		if (fds[NTFY].revents & POLLIN) {
+			handle_notify_sock();
+		}
+
+		if (fds[INOT].revents & POLLIN) {
+			handle_trigger_watch();
+		}
+
+		if (fds[MNTS].revents & POLLPRI) {
+			trigger_check(0, 0);
+		}
+#endif
+
 		for (int j = FIXFD; j < max_fd; j++) {
-			if (fds[j].revents)
+			if (!fds[j].revents)
+				continue;
+
+			int i = fdowner[j].service;
+			switch (fdowner[j].kind) {
+			case FD_READY:
 				handle_ready_pipe(j);
+				break;
+			case FD_PROBE:
+				if (i < max_service &&
+				    fds[j].fd == services[i].probefd)
+					probe_finish(i, 0);
+				break;
+			case FD_CAPTURE:
+				if (i < max_service && services[i].ring &&
+				    fds[j].fd == services[i].capture[0])
+					ring_read(i);
+				break;
+			case FD_FORWARD:
+				if (i < max_service && services[i].ring)
+					ring_forward(i);
+				break;
+			case FD_LISTEN:
+				if (i < max_service && services[i].nlisten > 0)
+					process_step(i, EVNT_ACTIVATE);
+				break;
+			}
 		}
 
 		if (want_rescan) {
@@ -2047,6 +5578,17 @@ again:
 			want_rescan = 0;
 		}
 
+		if (want_reexec) {
+			want_reexec = 0;
+			reexec();
+		}
+
+		state_changed = 0;
+		if (rollout.tmpl[0])
+			rollout_step();
+		if (nwaiters)
+			waiters_check();
+
 		if (want_shutdown || want_reboot) {
 			do_shutdown();
 		}
@@ -2081,6 +5623,12 @@ again:
 
 	close(controlsock);
 	unlink(control_socket_path);
+	if (notifysock >= 0) {
+		close(notifysock);
+		unlink(notifysockpath);
+	}
+	if (status)
+		unlink(statuspath);
 
 	exec1("SYS/reincarnate", 0);
 	if (errno != ENOENT)
@@ -2094,7 +5642,7 @@ again:
 			if (child < 0) {
 				prn(2, "- nitro: SYS/final failed to exec: errno=%d\n", errno);
 			} else if (child == 0) {
-				exec1("SYS/final", want_reboot ? "reboot" : "shutdown");
+				exec1("SYS/final", shutdown_mode());
 				_exit(127);
 			} else {
 				int wstatus = 0;
@@ -2111,7 +5659,13 @@ again:
 				}
 			}
 		}
+	}
+
+	/* a soft reboot keeps the kernel and just runs nitro again */
+	if (real_pid1 && want_softreboot)
+		sync();
 
+	if (real_pid1 && !want_softreboot) {
 #ifdef __linux__
 		if (mount("/", "/", "", MS_REMOUNT | MS_RDONLY, "") < 0)
 			prn(2, "- nitro: could not remount / read-only: errno=%d\n", errno);
@@ -2135,6 +5689,15 @@ again:
 		sleep(1);
 
 #ifdef __linux__
+#ifdef RB_KEXEC
+		if (want_kexec) {
+			if (kexec_loaded())
+				reboot(RB_KEXEC);
+			else
+				errno = ENOENT;
+			prn(2, "- nitro: kexec failed, rebooting: errno=%d\n", errno);
+		}
+#endif
 		if (want_reboot)
 			reboot(RB_AUTOBOOT);
 		else
@@ -2153,8 +5716,8 @@ again:
 
 	if (want_reboot) {
 		prn(2, "- nitro: re-execing\n");
-		execv(argv[0], argv);
-		fatal("could not re-exec '%s': errno=%d\n", argv[0], errno);
+		execv(nitro_exe, argv);
+		fatal("could not re-exec '%s': errno=%d\n", nitro_exe, errno);
 	}
 
 	prn(2, "- nitro: finished\n");
@@ -11,7 +11,29 @@
 
 static char default_sock[256] = RUNDIR "/nitro/nitro.sock";
 
-/* max fd usage: 500 services (250 loggers) = 1000 fd for log pipes + const. */
+typedef int64_t deadline;               /* milliseconds since boot */
+
+/* the clock of all timestamps nitro keeps, also in the status file */
+static deadline
+time_now()
+{
+	struct timespec now;
+
+	/* prefer a clock that does *not* count time during suspend, as we
+	   are measuring delays */
+#if defined(CLOCK_UPTIME)
+	clock_gettime(CLOCK_UPTIME, &now);
+#elif defined(CLOCK_UPTIME_RAW)
+	clock_gettime(CLOCK_UPTIME_RAW, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* max fd usage: 500 services (250 loggers) = 1000 fd for log pipes + const.
+   nitro reserves room for NITRO_MAXSV services instead if set. */
 #ifndef MAXSV
 #define MAXSV 500
 #endif
@@ -34,6 +56,11 @@ enum tags {
 	T_OK              = 80,
 	T_ESRCH           = 81,
 	T_ENOSYS          = 82,
+	T_ENOSPC          = 83,
+	T_EEXIST          = 84,
+	T_EFAIL           = 85, // optionally followed by T_NAME
+	T_EBUSY           = 86,
+	T_ETIMEDOUT       = 87, // optionally followed by T_NAME
 	T_SERVICE         = 100, // framing for service metadata
 	T_NAME            = 101, // payload: service name
 	T_STATE           = 102, // payload: state
@@ -44,17 +71,47 @@ enum tags {
 	T_MAX_SERVICE     = 107, // payload: u32
 	T_TOTAL_REAPS     = 108, // payload: u32
 	T_TOTAL_SV_REAPS  = 109, // payload: u32
+	T_LOG_PENDING     = 110, // payload: u32 [bytes]
+	T_LOG_HWM         = 111, // payload: u32 [bytes]
+	T_PIPE_SIZE       = 112, // payload: u32 [bytes]
+	T_LOG_DATA        = 113, // payload: bytes
+	T_FDSTORE         = 114, // payload: u8
+	T_OLDPID          = 115, // payload: u32
+	T_ARG             = 116, // payload: bytes
+	T_ENV             = 117, // payload: bytes, NAME=VALUE
+	T_LOG_TARGET      = 118, // payload: service name
+	T_STATUS_TEXT     = 119, // payload: bytes, STATUS= of sd_notify
 	T_CMD_UP          = 120, // payload: service name
 	T_CMD_DOWN        = 121, // payload: service name
 	T_CMD_RESTART     = 122, // payload: service name
 	T_CMD_INFO        = 123,
-	T_CMD_LIST        = 124,
+	T_CMD_LIST        = 124, // payload: optional u32 first index, pattern
 	T_CMD_QUERY       = 125, // payload: service name
 	T_CMD_RESCAN      = 126,
 	T_CMD_SHUTDOWN    = 127,
 	T_CMD_REBOOT      = 128,
 	T_CMD_SIGNAL      = 129,
 	T_CMD_READY       = 130,
+	T_CMD_LOGS        = 131, // payload: service name
+	T_CMD_IDLE        = 132, // payload: service name
+	T_CMD_FDSTORE     = 133, // payload: service name, fds: SCM_RIGHTS
+	T_CMD_REEXEC      = 134,
+	T_CMD_SOFTREBOOT  = 135,
+	T_CMD_KEXEC       = 136,
+	T_CMD_RUN         = 137, // payload: T_NAME, T_ARG..., T_ENV..., T_LOG_TARGET
+	T_CMD_SCALE       = 138, // payload: u16 count, template name
+	T_CMD_ROLLOUT     = 139, // payload: u16 batch size, template name
+	T_CMD_WAIT        = 140, // payload: u16 want, u16 fail, u32 ms, T_NAME...
+	T_STOPPING        = 160, // payload: u8
+	T_CHECK           = 161, // payload: u8, 1: passed, 2: failed
+	T_CHECK_FAILS     = 162, // payload: u8, failed checks in a row
+	T_CHECK_LATENCY   = 163, // payload: u32 [ms]
+	T_LAST_RUN        = 164, // payload: u32 [secs ago]
+	T_LAST_DURATION   = 165, // payload: u32 [ms]
+	T_NEXT_RUN        = 166, // payload: u32 [secs from now]
+	T_SERVICE_CAPACITY = 167, // payload: u32
+	T_SERVICE_HWM     = 168, // payload: u32
+	T_MORE            = 169, // payload: u32, index to list on from
 };
 
 enum internal_commands {
@@ -64,6 +121,45 @@ enum internal_commands {
 	T_WAIT_STARTING   = 232,
 };
 
+/* The file "status" next to the control socket holds a copy of the
+   service table, for reading without talking to nitro.  It is a
+   seqlock: seq is odd while nitro writes, so copy it until seq is
+   even and the same before and after. */
+#define STATUS_MAGIC 0x6f72746e  /* "ntro" */
+#define STATUS_VERSION 2
+
+struct status_entry {
+	char name[64];
+	int64_t startstop;      /* ms on the time_now() clock */
+	int32_t pid;
+	int32_t oldpid;
+	int32_t wstatus;
+	int32_t log_pending;    /* -1 if not a log service */
+	int32_t log_hwm;
+	int32_t pipe_size;
+	uint8_t state;
+	uint8_t fdstore;
+	uint8_t check;          /* 0: no ./check, 1: passed, 2: failed */
+	uint8_t check_fails;
+	int32_t check_latency;  /* ms */
+	int64_t last_run;       /* ms on the time_now() clock, 0 if never */
+	int64_t next_run;       /* ms on the time_now() clock, 0 if unscheduled */
+	int32_t last_duration;  /* ms */
+	int32_t pad;
+};
+
+struct status_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t max_service;
+	int32_t nitro_pid;
+	uint32_t pad;
+	uint64_t total_reaps;
+	uint64_t total_sv_reaps;
+	struct status_entry services[];  /* room for NITRO_MAXSV */
+};
+
 static char *
 control_socket()
 {
@@ -5,6 +5,7 @@
 #define INIT_SYSTEM
 #endif
 
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -18,6 +19,7 @@
 #include <limits.h>
 #include <math.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -41,6 +43,15 @@ struct request {
 	int wait;
 	char *service;
 	unsigned char signal;
+	int count;              /* for scale */
+	int *passfds;
+	int npassfds;
+	char **argv;            /* for run: VAR=VALUE..., COMMAND, ARG... */
+	int argc;
+	char *logtarget;
+	int stage;              /* 1 once the action was acknowledged */
+	int paging;             /* 1 while fetching more of a list */
+	uint32_t more;          /* index to list on from */
 	char notifypath[128];
 };
 
@@ -49,15 +60,9 @@ struct pollfd *fds;
 int maxreq;
 int vflag;
 
-typedef int64_t deadline;               /* milliseconds since boot */
+#define MAXPASSFDS 8
 
-deadline
-time_now()
-{
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	return (deadline)now.tv_sec * 1000 + now.tv_nsec / 1000000;
-}
+deadline timeout;
 
 static int
 max(int a, int b)
@@ -222,7 +227,15 @@ again:
 struct service {
 	char name[64];
 	uint32_t pid, state, wstatus, uptime;
-} services[MAXSV];
+	int islog;
+	uint32_t logpending, loghwm, pipesize;
+	int fdstore;
+	uint32_t oldpid;
+	int check, check_fails;
+	uint32_t check_latency;
+	int has_run, has_next;
+	uint32_t last_run, last_duration, next_run;
+} *services;
 
 int
 svnamecmp(const void *a, const void *b)
@@ -283,37 +296,229 @@ spat_decode_u32(unsigned char *buf, unsigned char tag, uint32_t *dst)
 	return 1;
 }
 
+static void
+print_log_pipe(struct service *sv)
+{
+	if (!sv->islog)
+		return;
+	if (sv->pipesize)
+		printf(" (pipe %d/%d max %d)",
+		    sv->logpending, sv->pipesize, sv->loghwm);
+	else
+		printf(" (pipe %d max %d)", sv->logpending, sv->loghwm);
+}
 
-void
-list(unsigned char *buf,  unsigned char *bufe)
+/* the result of the last health check, if there is a ./check */
+static void
+print_check(struct service *sv)
+{
+	if (sv->check == 1)
+		printf(" (check ok %dms)", sv->check_latency);
+	else if (sv->check == 2 && sv->check_fails)
+		printf(" (check failed x%d %dms)",
+		    sv->check_fails, sv->check_latency);
+	else if (sv->check == 2)
+		printf(" (check failed %dms)", sv->check_latency);
+}
+
+/* decode the health check fields, return 0 if buf is something else */
+static int
+spat_decode_check(unsigned char *buf, struct service *sv)
+{
+	if (spat_tag(buf) == T_CHECK && spat_len(buf) == 1)
+		sv->check = buf[3];
+	else if (spat_tag(buf) == T_CHECK_FAILS && spat_len(buf) == 1)
+		sv->check_fails = buf[3];
+	else
+		return spat_decode_u32(buf, T_CHECK_LATENCY, &sv->check_latency);
+	return 1;
+}
+
+/* the last and next run of a service with a ./schedule */
+static void
+print_sched(struct service *sv)
+{
+	if (sv->has_run)
+		printf(" (last run %ds ago, %dms)",
+		    sv->last_run, sv->last_duration);
+	if (sv->has_next)
+		printf(" (next run in %ds)", sv->next_run);
+}
+
+/* decode the schedule fields, return 0 if buf is something else */
+static int
+spat_decode_sched(unsigned char *buf, struct service *sv)
+{
+	if (spat_decode_u32(buf, T_LAST_RUN, &sv->last_run))
+		sv->has_run = 1;
+	else if (spat_decode_u32(buf, T_NEXT_RUN, &sv->next_run))
+		sv->has_next = 1;
+	else
+		return spat_decode_u32(buf, T_LAST_DURATION, &sv->last_duration);
+	return 1;
+}
+
+void print_services(int);
+
+int nlisted;
+
+/* append the services of a list reply, return 1 if nitro has more */
+int
+list(unsigned char *buf, unsigned char *bufe, uint32_t *more)
 {
-	int max_service = 0;
+	int n = 0;
+	int paged = 0;
 
-	while (buf < bufe && max_service < MAXSV) {
+	for (unsigned char *p = buf; p < bufe; p = spat_skip(p))
+		if (spat_tag(p) == T_SERVICE && spat_len(p) == SPAT_OPEN)
+			n++;
+
+	struct service *s = realloc(services, (nlisted + n + 1) * sizeof *services);
+	if (!s) {
+		perror("realloc");
+		exit(111);
+	}
+	services = s;
+	memset(services + nlisted, 0, (n + 1) * sizeof *services);
+
+	while (buf < bufe) {
+		if (spat_decode_u32(buf, T_MORE, more)) {
+			paged = 1;
+			buf = spat_skip(buf);
+			continue;
+		}
 		if (spat_tag(buf) != T_SERVICE && spat_len(buf) != SPAT_OPEN) {
 			buf = spat_skip_to_end(buf, bufe);
 			continue;
 		}
 		buf = spat_skip(buf);
 
+		struct service *sv = &services[nlisted];
 		while (buf < bufe) {
-			if (spat_decode_u32(buf, T_PID, &services[max_service].pid) ||
-			    spat_decode_u32(buf, T_WSTATUS, &services[max_service].wstatus) ||
-			    spat_decode_u32(buf, T_UPTIME, &services[max_service].uptime))
+			if (spat_decode_u32(buf, T_PID, &sv->pid) ||
+			    spat_decode_u32(buf, T_WSTATUS, &sv->wstatus) ||
+			    spat_decode_u32(buf, T_UPTIME, &sv->uptime) ||
+			    spat_decode_u32(buf, T_LOG_HWM, &sv->loghwm) ||
+			    spat_decode_u32(buf, T_PIPE_SIZE, &sv->pipesize) ||
+			    spat_decode_u32(buf, T_OLDPID, &sv->oldpid) ||
+			    spat_decode_check(buf, sv) ||
+			    spat_decode_sched(buf, sv))
 				;
+			else if (spat_decode_u32(buf, T_LOG_PENDING, &sv->logpending))
+				sv->islog = 1;
 			else if (spat_tag(buf) == T_STATE && spat_len(buf) == 1)
-				services[max_service].state = buf[3];
+				sv->state = buf[3];
+			else if (spat_tag(buf) == T_FDSTORE && spat_len(buf) == 1)
+				sv->fdstore = buf[3];
 			else if (spat_tag(buf) == T_NAME && spat_len(buf) < 64) {
-				memcpy(services[max_service].name, buf + 3, spat_len(buf));
-				services[max_service].name[spat_len(buf)] = 0;
+				memcpy(sv->name, buf + 3, spat_len(buf));
+				sv->name[spat_len(buf)] = 0;
 			} else if (spat_tag(buf) == T_SERVICE && spat_len(buf) == SPAT_CLOSE) {
-				max_service++;
+				nlisted++;
+				buf = spat_skip(buf);
 				break;
 			}
 			buf = spat_skip(buf);
 		}
 	}
 
+	return paged;
+}
+
+/* read the service table from the status file instead of asking nitro */
+int
+list_status()
+{
+	char path[PATH_MAX];
+	char *slash = strrchr(sockpath, '/');
+	if (!slash || (size_t)(slash - sockpath) + sizeof "/status" > sizeof path)
+		return -1;
+	memcpy(path, sockpath, slash - sockpath);
+	strcpy(path + (slash - sockpath), "/status");
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	struct status_page *page = MAP_FAILED;
+	size_t size = 0;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof *page) {
+		size = st.st_size;
+		page = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (page == MAP_FAILED)
+		return -1;
+
+	/* the table is sized for NITRO_MAXSV, only copy the used part */
+	uint32_t cap = (size - sizeof *page) / sizeof page->services[0];
+	struct status_page *snap = malloc(size);
+	int ok = 0;
+	if (snap && page->magic == STATUS_MAGIC &&
+	    page->version == STATUS_VERSION) {
+		for (int tries = 0; tries < 1000 && !ok; tries++) {
+			uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1) {
+				sched_yield();
+				continue;
+			}
+			uint32_t n = page->max_service;
+			memcpy(snap, page, sizeof *page +
+			    (n > cap ? cap : n) * sizeof page->services[0]);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			ok = __atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq;
+		}
+	}
+	munmap(page, size);
+
+	/* a stale file of a dead nitro */
+	if (!ok || snap->max_service > cap ||
+	    (kill(snap->nitro_pid, 0) < 0 && errno == ESRCH) ||
+	    !(services = calloc(snap->max_service + 1, sizeof *services))) {
+		free(snap);
+		return -1;
+	}
+
+	deadline now = time_now();
+	for (uint32_t i = 0; i < snap->max_service; i++) {
+		struct status_entry *e = &snap->services[i];
+		services[i] = (struct service){ 0 };
+		memcpy(services[i].name, e->name, sizeof services[i].name);
+		services[i].name[sizeof services[i].name - 1] = 0;
+		services[i].pid = e->pid;
+		services[i].oldpid = e->oldpid;
+		services[i].state = e->state;
+		services[i].wstatus = e->wstatus;
+		services[i].uptime = (now - e->startstop) / 1000;
+		services[i].islog = e->log_pending >= 0;
+		services[i].logpending = e->log_pending;
+		services[i].loghwm = e->log_hwm;
+		services[i].pipesize = e->pipe_size;
+		services[i].fdstore = e->fdstore;
+		services[i].check = e->check;
+		services[i].check_fails = e->check_fails;
+		services[i].check_latency = e->check_latency;
+		if (e->last_run) {
+			services[i].has_run = 1;
+			services[i].last_run = (now - e->last_run) / 1000;
+			services[i].last_duration = e->last_duration;
+		}
+		if (e->next_run > now) {
+			services[i].has_next = 1;
+			services[i].next_run = (e->next_run - now) / 1000;
+		}
+	}
+
+	print_services(snap->max_service);
+	free(snap);
+
+	return 0;
+}
+
+void
+print_services(int max_service)
+{
 	qsort(services, max_service, sizeof services[0], svnamecmp);
 
 	for (int i = 0; i < max_service; i++) {
@@ -321,17 +526,82 @@ list(unsigned char *buf,  unsigned char *bufe)
 		    proc_state_str(services[i].state), services[i].name);
 		if (services[i].pid)
 			printf(" (pid %d)", services[i].pid);
-		printf(" (wstatus %d) %ds\n",
+		if (services[i].oldpid)
+			printf(" (old pid %d)", services[i].oldpid);
+		printf(" (wstatus %d) %ds",
 		    services[i].wstatus, services[i].uptime);
+		print_log_pipe(&services[i]);
+		if (services[i].fdstore)
+			printf(" (fdstore %d)", services[i].fdstore);
+		print_check(&services[i]);
+		print_sched(&services[i]);
+		printf("\n");
 	}
 }
 
+/* append a SPAT packet with payload s, return 0 if it doesn't fit */
+static int
+spat_str(char **buf, char *end, int tag, const char *s)
+{
+	size_t len = strlen(s);
+	if (len >= 0xfffe || (size_t)(end - *buf) < 3 + len)
+		return 0;
+
+	*(*buf)++ = len & 0xff;
+	*(*buf)++ = len >> 8;
+	*(*buf)++ = tag;
+	memcpy(*buf, s, len);
+	*buf += len;
+	return 1;
+}
+
+static int
+is_pattern(const char *s)
+{
+	return s && strpbrk(s, "*?[") != 0;
+}
+
+#define STATEBIT(s) (1u << (s))
+
+/* the states nitro should wait for after the action, 0 for none */
+static int
+wait_states(struct request *req, int *fail)
+{
+	*fail = 0;
+	if (req->service && (req->service[0] == '@' || is_pattern(req->service)))
+		return 0;       /* nitro replies when the group is done */
+
+	switch (req->cmd) {
+	case T_CMD_UP:
+	case T_CMD_RUN:
+	case T_CMD_RESTART:
+		if (req->wait < 0)
+			return 0;
+		*fail = STATEBIT(PROC_FATAL);
+		return STATEBIT(PROC_UP) | STATEBIT(PROC_ONESHOT) |
+		    (req->wait == 0 ? STATEBIT(PROC_STARTING) : 0);
+	case T_CMD_DOWN:
+		if (req->wait < 0)
+			return 0;
+		return STATEBIT(PROC_DOWN) | STATEBIT(PROC_FATAL) |
+		    (req->wait == 0 ? STATEBIT(PROC_SHUTDOWN) : 0);
+	case T_WAIT_UP:
+		return STATEBIT(PROC_UP) | STATEBIT(PROC_ONESHOT);
+	case T_WAIT_DOWN:
+		return STATEBIT(PROC_DOWN) | STATEBIT(PROC_FATAL);
+	case T_WAIT_STARTING:
+		return STATEBIT(PROC_STARTING) | STATEBIT(PROC_UP) |
+		    STATEBIT(PROC_ONESHOT);
+	}
+	return 0;
+}
+
 int
 handle_request(int i)
 {
 	const char *sv = reqs[i].service ? reqs[i].service : "";
 
-	char buffer[256];
+	char buffer[8192];
 	char *buf = buffer;
 
 	if (strlen(sv) > 64) {
@@ -339,25 +609,108 @@ handle_request(int i)
 		return 111;
 	}
 
-	int len = strlen(sv);
-	*buf++ = len + !!(reqs[i].cmd == T_CMD_SIGNAL);
-	*buf++ = 0;
 	switch (reqs[i].cmd) {
 	case T_WAIT_UP:
 	case T_WAIT_DOWN:
 	case T_WAIT_STARTING:
-		*buf++ = T_CMD_QUERY;
-		break;
-	default:
+		reqs[i].stage = 1;      /* nothing to do but wait */
+	}
+
+	int len = strlen(sv);
+	if (reqs[i].paging) {
+		/* the rest of a list, or of the services a pattern matched */
+		if (!is_pattern(sv))
+			len = 0;
+		*buf++ = 4 + len;
+		*buf++ = 0;
+		*buf++ = T_CMD_LIST;
+		for (int k = 0; k < 32; k += 8)
+			*buf++ = (reqs[i].more >> k) & 0xff;
+		memcpy(buf, sv, len);
+		buf += len;
+	} else if (reqs[i].stage) {
+		/* let nitro reply once the service reached a wanted state */
+		int fail;
+		int want = wait_states(&reqs[i], &fail);
+		uint32_t ms = 0;
+		if (timeout)
+			ms = max(1, timeout - time_now());
+
+		*buf++ = 8 + 3 + len;
+		*buf++ = 0;
+		*buf++ = T_CMD_WAIT;
+		*buf++ = want & 0xff;
+		*buf++ = want >> 8;
+		*buf++ = fail & 0xff;
+		*buf++ = fail >> 8;
+		for (int k = 0; k < 32; k += 8)
+			*buf++ = (ms >> k) & 0xff;
+		*buf++ = len;
+		*buf++ = 0;
+		*buf++ = T_NAME;
+		memcpy(buf, sv, len);
+		buf += len;
+	} else if (reqs[i].cmd == T_CMD_RUN) {
+		char *end = buffer + sizeof buffer;
+		int ok = 1, k = 0;
+
+		buf += 3;
+		ok = ok && spat_str(&buf, end, T_NAME, sv);
+		for (; k < reqs[i].argc && strchr(reqs[i].argv[k], '='); k++)
+			ok = ok && spat_str(&buf, end, T_ENV, reqs[i].argv[k]);
+		for (; k < reqs[i].argc; k++)
+			ok = ok && spat_str(&buf, end, T_ARG, reqs[i].argv[k]);
+		if (reqs[i].logtarget)
+			ok = ok && spat_str(&buf, end, T_LOG_TARGET, reqs[i].logtarget);
+		if (!ok) {
+			fprintf(stderr, "nitroctl: command too long: %s\n", sv);
+			return 111;
+		}
+
+		len = buf - buffer - 3;
+		buffer[0] = len & 0xff;
+		buffer[1] = len >> 8;
+		buffer[2] = T_CMD_RUN;
+	} else {
+		int count = reqs[i].cmd == T_CMD_SCALE ||
+		    reqs[i].cmd == T_CMD_ROLLOUT;
+		*buf++ = len + !!(reqs[i].cmd == T_CMD_SIGNAL) + 2*count;
+		*buf++ = 0;
 		*buf++ = reqs[i].cmd;
+		if (reqs[i].cmd == T_CMD_SIGNAL)
+			*buf++ = reqs[i].signal;
+		if (count) {
+			*buf++ = reqs[i].count & 0xff;
+			*buf++ = reqs[i].count >> 8;
+		}
+		memcpy(buf, sv, len);
+		buf += len;
 	}
-	if (reqs[i].cmd == T_CMD_SIGNAL)
-		*buf++ = reqs[i].signal;
-	memcpy(buf, sv, len);
-	buf += len;
 
-	int r = sendto(fds[i].fd, buffer, buf - buffer,
-	    MSG_DONTWAIT, (struct sockaddr *)&sockaddr, sizeof sockaddr);
+	struct iovec iov = { .iov_base = buffer, .iov_len = buf - buffer };
+	struct msghdr msg = {
+		.msg_name = &sockaddr,
+		.msg_namelen = sizeof sockaddr,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof (int) * MAXPASSFDS)];
+	} cmsg;
+	if (reqs[i].npassfds > 0 && !reqs[i].stage) {
+		size_t fdlen = sizeof (int) * reqs[i].npassfds;
+		memset(&cmsg, 0, sizeof cmsg);
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(fdlen);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(fdlen);
+		memcpy(CMSG_DATA(c), reqs[i].passfds, fdlen);
+	}
+
+	int r = sendmsg(fds[i].fd, &msg, MSG_DONTWAIT);
 
 	if (r < 0) {
 		// On BSD, UNIX DGRAM sockets can be full, but have POLLOUT.
@@ -380,7 +733,7 @@ int
 handle_response(int i)
 {
 	ssize_t rd;
-	unsigned char buffer[4096];
+	unsigned char buffer[65536];
 	rd = read(fds[i].fd, buffer, sizeof buffer);
 	if (rd < 0) {
 		perror("read");
@@ -388,48 +741,137 @@ handle_response(int i)
 	}
 	unsigned char *buf = buffer;
 	unsigned char *bufe = buffer + rd;
+	int fail;
+
+	if (spat_tag(buf) >= PROC_DOWN && spat_tag(buf) <= PROC_DELAY) {
+		/* state change notification, nitro replies when we are done */
+		if (vflag && wait_states(&reqs[i], &fail))
+			printf("%s %s\n", proc_state_str(spat_tag(buf)),
+			    reqs[i].service);
+		return -1;
+	}
 
-	if (spat_tag(buf) == T_ESRCH) {
+	if (spat_tag(buf) == T_ESRCH && reqs[i].stage &&
+	    (reqs[i].cmd == T_CMD_RUN || reqs[i].cmd == T_CMD_DOWN)) {
+		return 0;       /* transient service already finished */
+	} else if (spat_tag(buf) == T_ESRCH && reqs[i].cmd == T_CMD_RUN) {
+		fprintf(stderr, "nitroctl: can't run '%s'\n", reqs[i].service);
+		return 111;
+	} else if (spat_tag(buf) == T_ESRCH) {
 		fprintf(stderr, "nitroctl: no such service '%s'\n",
 		    reqs[i].service);
 		return 111;
+	} else if (spat_tag(buf) == T_EEXIST) {
+		fprintf(stderr, "nitroctl: service '%s' already exists\n",
+		    reqs[i].service);
+		return 1;
+	} else if (spat_tag(buf) == T_ENOSPC && reqs[i].cmd == T_CMD_RUN) {
+		fprintf(stderr, "nitroctl: too many transient services, "
+		    "or command too long: %s\n", reqs[i].service);
+		return 1;
 	} else if (spat_tag(buf) == T_ENOSYS) {
 		fprintf(stderr, "nitroctl: command not implemented in server\n");
 		return 111;
+	} else if (spat_tag(buf) == T_ETIMEDOUT && reqs[i].cmd == T_CMD_ROLLOUT) {
+		fprintf(stderr, "nitroctl: rolling restart of '%s' aborted",
+		    reqs[i].service);
+		buf = spat_skip(buf);
+		if (buf < bufe && spat_tag(buf) == T_NAME)
+			fprintf(stderr, ", '%.*s' timed out", spat_len(buf), buf + 3);
+		fprintf(stderr, "\n");
+		return 3;
+	} else if (spat_tag(buf) == T_ETIMEDOUT) {
+		fprintf(stderr, "nitroctl: action timed out\n");
+		return 3;
+	} else if (spat_tag(buf) == T_EFAIL && reqs[i].cmd == T_CMD_RUN) {
+		fprintf(stderr, "nitroctl: can't start '%s'\n", reqs[i].service);
+		return 1;
+	} else if (spat_tag(buf) == T_EFAIL && reqs[i].stage) {
+		fprintf(stderr, "nitroctl: failed to %sstart '%s'\n",
+		    reqs[i].cmd == T_CMD_RESTART ? "re" : "",
+		    reqs[i].service);
+		return 1;
+	} else if (spat_tag(buf) == T_EFAIL) {
+		fprintf(stderr, "nitroctl: %s '%s' aborted",
+		    reqs[i].cmd == T_CMD_ROLLOUT ? "rolling restart of" : "group",
+		    reqs[i].service);
+		buf = spat_skip(buf);
+		if (buf < bufe && spat_tag(buf) == T_NAME)
+			fprintf(stderr, ", '%.*s' failed", spat_len(buf), buf + 3);
+		fprintf(stderr, "\n");
+		return 1;
+	} else if (spat_tag(buf) == T_EBUSY && reqs[i].cmd == T_CMD_ROLLOUT) {
+		fprintf(stderr, "nitroctl: a rolling restart is already running\n");
+		return 1;
+	} else if (spat_tag(buf) == T_EBUSY) {
+		fprintf(stderr, "nitroctl: too many clients waiting for '%s'\n",
+		    reqs[i].service);
+		return 1;
+	} else if (spat_tag(buf) == T_ENOSPC && reqs[i].cmd == T_CMD_SCALE) {
+		fprintf(stderr, "nitroctl: too many scaled templates: %s\n",
+		    reqs[i].service);
+		return 1;
+	} else if (spat_tag(buf) == T_ENOSPC) {
+		fprintf(stderr, "nitroctl: fd store of '%s' is full\n",
+		    reqs[i].service);
+		return 1;
 	}
 
 	if (spat_tag(buf) == T_OK)
 		buf = spat_skip(buf);
 
-	int state = 0;
-	if (spat_tag(buf) >= PROC_DOWN && spat_tag(buf) <= PROC_DELAY) {
-		state = spat_tag(buf);
-
-		if (vflag)
-			switch (reqs[i].cmd) {
-			case T_CMD_UP:
-			case T_CMD_DOWN:
-			case T_CMD_RESTART:
-			case T_WAIT_UP:
-			case T_WAIT_DOWN:
-				printf("%s %s\n", proc_state_str(state),
-				    reqs[i].service);
-			}
-	} else if (spat_tag(buf) == T_STATE && spat_len(buf) == 1) {
-		state = buf[3];
-
-		if (vflag)
-			switch (reqs[i].cmd) {
-			case T_WAIT_UP:
-			case T_WAIT_DOWN:
-				printf("%s %s\n", proc_state_str(state),
-				    reqs[i].service);
-			}
+	if (reqs[i].stage)
+		return 0;       /* the wanted states were reached */
+	if (wait_states(&reqs[i], &fail)) {
+		reqs[i].stage = 1;
+		fds[i].events = POLLOUT;
+		return -1;
+	}
+
+	if (reqs[i].service && reqs[i].service[0] == '@' &&
+	    (reqs[i].cmd == T_CMD_UP || reqs[i].cmd == T_CMD_DOWN ||
+	    reqs[i].cmd == T_CMD_RESTART || reqs[i].cmd == T_CMD_READY))
+		return 0;       /* nitro replies when the group is done */
+
+	if (is_pattern(reqs[i].service) &&
+	    (reqs[i].cmd == T_CMD_UP || reqs[i].cmd == T_CMD_DOWN ||
+	    reqs[i].cmd == T_CMD_RESTART || reqs[i].cmd == T_CMD_READY ||
+	    reqs[i].cmd == T_CMD_SIGNAL)) {
+		/* nitro applied it to all matching services */
+		int more = 0;
+		if (reqs[i].paging) {
+			nlisted = 0;
+			more = list(buf, bufe, &reqs[i].more);
+			for (int k = 0; k < nlisted; k++)
+				if (reqs[i].cmd != T_CMD_SIGNAL || services[k].pid)
+					printf("%s\n", services[k].name);
+		} else {
+			for (; buf < bufe && spat_tag(buf) == T_NAME; buf = spat_skip(buf))
+				printf("%.*s\n", spat_len(buf), buf + 3);
+			more = buf < bufe &&
+			    spat_decode_u32(buf, T_MORE, &reqs[i].more);
+		}
+		if (more) {
+			reqs[i].paging = 1;
+			fds[i].events = POLLOUT;
+			return -1;
+		}
+		return 0;
 	}
 
 	switch (reqs[i].cmd) {
 	case T_CMD_LIST:
-		list(buf, buf + rd);
+		if (list(buf, bufe, &reqs[i].more)) {
+			reqs[i].paging = 1;
+			fds[i].events = POLLOUT;
+			return -1;
+		}
+		print_services(nlisted);
+		return 0;
+	case T_CMD_LOGS:
+		if (spat_tag(buf) == T_LOG_DATA && spat_len(buf) >= 0 &&
+		    buf + 3 + spat_len(buf) <= bufe)
+			fwrite(buf + 3, 1, spat_len(buf), stdout);
 		return 0;
 	case T_CMD_INFO: ;
 		uint32_t u;
@@ -440,6 +882,10 @@ handle_response(int i)
 				printf("pid %d\n", u);
 			else if (spat_decode_u32(buf, T_MAX_SERVICE, &u))
 				printf("max_service %d\n", u);
+			else if (spat_decode_u32(buf, T_SERVICE_CAPACITY, &u))
+				printf("service_capacity %d\n", u);
+			else if (spat_decode_u32(buf, T_SERVICE_HWM, &u))
+				printf("service_hwm %d\n", u);
 			else if (spat_decode_u32(buf, T_TOTAL_REAPS, &u))
 				printf("total_reaps %d\n", u);
 			else if (spat_decode_u32(buf, T_TOTAL_SV_REAPS, &u))
@@ -450,48 +896,35 @@ handle_response(int i)
 			buf = spat_skip(buf);
 		}
 		return 0;
-	case T_WAIT_STARTING:
-		if (state == PROC_STARTING ||
-		    state == PROC_UP ||
-		    state == PROC_ONESHOT)
-			return 0;
-		return -1;
-	case T_WAIT_UP:
-		if (state == PROC_FATAL)
-			return -1;
-		/* fallthrough */
-	case T_CMD_UP:
-	case T_CMD_RESTART:
-		if (reqs[i].wait < 0)
-			return 0;
-		if (reqs[i].wait == 0 && state == PROC_STARTING)
-			return 0;
-		if (state == PROC_UP || state == PROC_ONESHOT)
-			return 0;
-		if (state == PROC_FATAL) {
-			fprintf(stderr,
-			    "nitroctl: failed to %sstart '%s'\n",
-			    reqs[i].cmd == T_CMD_UP ? "" : "re", reqs[i].service);
-			return 1;
-		}
-		break;
-	case T_WAIT_DOWN:
-	case T_CMD_DOWN:
-		if (!reqs[i].wait && state == PROC_SHUTDOWN)
-			return 0;
-		if (state == PROC_DOWN || state == PROC_FATAL)
-			return 0;
-		break;
 	case T_CMD_QUERY: ;
-		uint32_t pid = 0, wstatus = 0, uptime = 0;
+		uint32_t pid = 0, wstatus = 0, uptime = 0, state = 0;
+		struct service sv = { 0 };
+		char status[64] = "";
+		int stopping = 0;
 
 		while (buf < bufe) {
 			if (spat_decode_u32(buf, T_PID, &pid) ||
 			    spat_decode_u32(buf, T_WSTATUS, &wstatus) ||
-			    spat_decode_u32(buf, T_UPTIME, &uptime))
+			    spat_decode_u32(buf, T_UPTIME, &uptime) ||
+			    spat_decode_u32(buf, T_LOG_HWM, &sv.loghwm) ||
+			    spat_decode_u32(buf, T_PIPE_SIZE, &sv.pipesize) ||
+			    spat_decode_u32(buf, T_OLDPID, &sv.oldpid) ||
+			    spat_decode_check(buf, &sv) ||
+			    spat_decode_sched(buf, &sv))
 				;
+			else if (spat_decode_u32(buf, T_LOG_PENDING, &sv.logpending))
+				sv.islog = 1;
 			else if (spat_tag(buf) == T_STATE && spat_len(buf) == 1)
 				state = buf[3];
+			else if (spat_tag(buf) == T_FDSTORE && spat_len(buf) == 1)
+				sv.fdstore = buf[3];
+			else if (spat_tag(buf) == T_STOPPING && spat_len(buf) == 1)
+				stopping = buf[3];
+			else if (spat_tag(buf) == T_STATUS_TEXT &&
+			    spat_len(buf) < (int)sizeof status &&
+			    buf + 3 + spat_len(buf) <= bufe)
+				snprintf(status, sizeof status, "%.*s",
+				    spat_len(buf), buf + 3);
 
 			buf = spat_skip(buf);
 		}
@@ -500,18 +933,28 @@ handle_response(int i)
 			printf("%s %s", proc_state_str(state), reqs[i].service);
 			if (pid)
 				printf(" (pid %d)", pid);
-			printf(" (wstatus %d) %ds\n", (int)wstatus, uptime);
+			if (sv.oldpid)
+				printf(" (old pid %d)", sv.oldpid);
+			printf(" (wstatus %d) %ds", (int)wstatus, uptime);
+			print_log_pipe(&sv);
+			if (sv.fdstore)
+				printf(" (fdstore %d)", sv.fdstore);
+			print_check(&sv);
+			print_sched(&sv);
+			if (stopping)
+				printf(" (stopping)");
+			if (*status)
+				printf(" (status: %s)", status);
+			printf("\n");
 		} else if (reqs[i].wait == 1 && pid) {
 			printf("%d\n", pid);
 		} else if (!pid) {
 			return 1;
 		}
 		return 0;
-	default:
-		return 0;
 	}
 
-	return -1;  // again
+	return 0;
 }
 
 int
@@ -657,10 +1100,11 @@ init_usage:
 	}
 #endif
 
-	deadline timeout = 0;
+	char *logtarget = 0;
 	int c;
-	while ((c = getopt(argc, argv, "t:v")) != -1)
+	while ((c = getopt(argc, argv, "l:t:v")) != -1)
 		switch (c) {
+		case 'l': logtarget = optarg; break;
 		case 't': {
 			errno = 0;
 			char *rest = 0;
@@ -704,18 +1148,92 @@ init_usage:
 
 	signal(SIGINT, on_sigint);
 
-	if (streq1(cmd, "list") && argc == 1)
+	if (streq1(cmd, "list") && argc == 1 && list_status() == 0)
+		return 0;
+	else if (streq1(cmd, "list") && argc == 1)
 		reqs[maxreq++] = (struct request){ .cmd = T_CMD_LIST };
 	else if (streq(cmd, "info"))
 		reqs[maxreq++] = (struct request){ .cmd = T_CMD_INFO };
 	else if (streq1(cmd, "scan") || streq(cmd, "rescan"))
 		reqs[maxreq++] = (struct request){ .cmd = T_CMD_RESCAN };
+	else if (streq(cmd, "reexec"))
+		reqs[maxreq++] = (struct request){ .cmd = T_CMD_REEXEC };
 	else if (streq(cmd, "Reboot"))
 		reqs[maxreq++] = (struct request){ .cmd = T_CMD_REBOOT };
 	else if (streq(cmd, "Shutdown"))
 		reqs[maxreq++] = (struct request){ .cmd = T_CMD_SHUTDOWN };
+	else if (streq(cmd, "Softreboot"))
+		reqs[maxreq++] = (struct request){ .cmd = T_CMD_SOFTREBOOT };
+	else if (streq(cmd, "Kexec"))
+		reqs[maxreq++] = (struct request){ .cmd = T_CMD_KEXEC };
 	else if (streq(cmd, "events"))
 		return print_events();
+	else if (streq(cmd, "fdstore") && argc > 1) {
+		static int passfds[MAXPASSFDS];
+		int n = 0;
+		for (int i = 2; i < argc; i++) {
+			char *rest = 0;
+			errno = 0;
+			long fd = strtol(argv[i], &rest, 10);
+			if (fd < 0 || fd > INT_MAX || *rest || errno != 0 ||
+			    n >= MAXPASSFDS || fcntl(fd, F_GETFD) < 0) {
+				fprintf(stderr, "nitroctl: invalid fd '%s'\n", argv[i]);
+				exit(2);
+			}
+			passfds[n++] = fd;
+		}
+		reqs[maxreq++] = (struct request){
+			.cmd = T_CMD_FDSTORE,
+			.service = normalize(argv[1]),
+			.passfds = passfds,
+			.npassfds = n
+		};
+	}
+	else if (streq(cmd, "run") && argc > 2) {
+		int k = 2;
+		while (k < argc && strchr(argv[k], '='))
+			k++;
+		if (k == argc)
+			goto usage;
+		reqs[maxreq++] = (struct request){
+			.cmd = T_CMD_RUN,
+			.service = argv[1],
+			.argv = argv + 2,
+			.argc = argc - 2,
+			.logtarget = logtarget
+		};
+	}
+	else if ((streq(cmd, "scale") && argc == 3) ||
+	    (streq(cmd, "rolling-restart") && (argc == 2 || argc == 3))) {
+		long n = 1;
+		if (argc == 3) {
+			char *rest = 0;
+			errno = 0;
+			n = strtol(argv[2], &rest, 10);
+			if (n < 0 || n > 0xffff || *rest || errno != 0) {
+				fprintf(stderr, "nitroctl: invalid count '%s'\n", argv[2]);
+				exit(2);
+			}
+		}
+		char *tmpl = normalize(argv[1]);
+		if (tmpl[strlen(tmpl) - 1] != '@') {
+			size_t l = strlen(tmpl);
+			char *t = malloc(l + 2);
+			if (!t) {
+				perror("malloc");
+				exit(111);
+			}
+			memcpy(t, tmpl, l);
+			memcpy(t + l, "@", 2);
+			tmpl = t;
+		}
+		reqs[maxreq++] = (struct request){
+			.cmd = streq(cmd, "scale") ? T_CMD_SCALE : T_CMD_ROLLOUT,
+			.service = tmpl,
+			.count = n,
+			.wait = -1
+		};
+	}
 	else if (argc > 1 && (
 	    streq1(cmd, "pause") ||
 	    streq1(cmd, "cont") ||
@@ -766,6 +1284,10 @@ init_usage:
 				reqs[maxreq++] = (struct request){ .cmd = T_WAIT_STARTING, .service = service, .wait = 1 };
 			else if (streq(cmd, "ready"))
 				reqs[maxreq++] = (struct request){ .cmd = T_CMD_READY, .service = service, .wait = -1 };
+			else if (streq(cmd, "idle"))
+				reqs[maxreq++] = (struct request){ .cmd = T_CMD_IDLE, .service = service, .wait = -1 };
+			else if (streq(cmd, "logs"))
+				reqs[maxreq++] = (struct request){ .cmd = T_CMD_LOGS, .service = service };
 			else
 				goto usage;
 		}
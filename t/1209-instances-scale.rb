@@ -0,0 +1,38 @@
+require './t/case'
+
+with_fixture "w@/run!" => <<EOF_A, "w@/instances" => "3\n" do |svdir|
+#!/bin/sh
+exec sleep 100
+EOF_A
+  testcase(svdir) { |events|
+    events.poll_for(["STARTING", "w@1"])
+    events.poll_for(["STARTING", "w@2"])
+    events.poll_for(["STARTING", "w@3"])
+
+    `nitroctl scale w@ 1`
+    $?.exitstatus == 0  or raise "scale failed"
+    events.poll_for(["DOWN", "w@2"])
+    events.poll_for(["DOWN", "w@3"])
+    sleep 0.2 while `nitroctl list` =~ / w@[23] /
+    `nitroctl list` =~ / w@1 /  or raise "w@1 stopped"
+
+    events.clear
+    `nitroctl scale w 2`
+    events.poll_for(["STARTING", "w@2"])
+    `nitroctl list` =~ / w@3 /  and raise "w@3 started"
+
+    `nitroctl up w@x`
+    `nitroctl scale w@ 0`
+    events.poll_for(["DOWN", "w@1"])
+    events.poll_for(["DOWN", "w@2"])
+    `nitroctl list` =~ / w@x /  or raise "w@x stopped"
+
+    # count without a name, a name with a NUL, a name that is too long
+    ["\x02\x00\x8a\x01\x00",
+     "\x03\x00\x8a\x01\x00\x00",
+     "\x42\x00\x8a\x01\x00" + "w"*63 + "@"].each { |m|
+      control_raw(m) == "\x00\x00\x51".b  or raise "bad scale accepted"
+    }
+    `nitroctl list` =~ / w@x /  or raise "w@x stopped"
+  }
+end
@@ -0,0 +1,49 @@
+require './t/case'
+
+with_fixture "w@/run!" => <<EOF_A, "w@/setup!" => <<EOF_B, "w@/notification-fd" => "3\n", "w@/instances" => "3\n", "w@/rollout-timeout" => "2\n" do |svdir|
+#!/bin/sh
+echo start $1 >>../order
+[ -e ../hang ] && exec sleep 100
+sleep 0.3
+echo ready $1 >>../order
+echo >&3
+exec sleep 100
+EOF_A
+#!/bin/sh
+[ -e ../fail ] && [ "$1" = 2 ] && exit 111
+exit 0
+EOF_B
+  testcase(svdir) { |events|
+    order = File.join(svdir, "order")
+    events.poll_for(["UP", "w@1"])
+    events.poll_for(["UP", "w@2"])
+    events.poll_for(["UP", "w@3"])
+    File.write(order, "")
+
+    `nitroctl rolling-restart w@ 1`
+    $?.exitstatus == 0  or raise "rolling restart failed"
+    lines = File.read(order).lines.map(&:split)
+    lines.size == 6  or raise "not all restarted: #{lines}"
+    lines.each_slice(2) { |(s, r)|
+      s[0] == "start" && r[0] == "ready" && s[1] == r[1]  or
+        raise "restarts overlap: #{lines}"
+    }
+
+    # an empty name whose count ends in '@', a name that is too long
+    ["\x03\x00\x8b\x01\x40\x00",
+     "\x42\x00\x8b\x01\x00" + "w"*63 + "@"].each { |m|
+      control_raw(m) == "\x00\x00\x51".b  or raise "bad rollout accepted"
+    }
+
+    File.write(File.join(svdir, "fail"), "")
+    out = `nitroctl rolling-restart w@ 2 2>&1`
+    $?.exitstatus == 1  or raise "failure not reported"
+    out =~ /'w@2' failed/  or raise "failed instance not named: #{out}"
+
+    File.unlink(File.join(svdir, "fail"))
+    File.write(File.join(svdir, "hang"), "")
+    out = `nitroctl rolling-restart w@ 1 2>&1`
+    $?.exitstatus == 3  or raise "stuck instance not reported"
+    out =~ /'w@\d' timed out/  or raise "stuck instance not named: #{out}"
+  }
+end
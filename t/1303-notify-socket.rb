@@ -0,0 +1,49 @@
+require './t/case'
+
+with_fixture "a/notify-socket" => "", "a/run!" => <<'EOF_A', "b/notify-socket" => "", "b/run!" => <<'EOF_B', "c/notify-socket" => "", "c/run!" => <<'EOF_C' do |svdir|
+#!/usr/bin/env ruby
+require 'socket'
+sock = Socket.new(:UNIX, :DGRAM)
+addr = Socket.sockaddr_un(ENV["NOTIFY_SOCKET"])
+sock.send("STATUS=warming up", 0, addr)
+sleep 3
+sock.send("READY=1\nSTATUS=serving", 0, addr)
+sleep 100
+EOF_A
+#!/usr/bin/env ruby
+require 'socket'
+pid = spawn("sleep", "100")
+File.write("main.pid", pid.to_s)
+Socket.new(:UNIX, :DGRAM).send("MAINPID=#{pid}\nREADY=1", 0,
+  Socket.sockaddr_un(ENV["NOTIFY_SOCKET"]))
+EOF_B
+#!/usr/bin/env ruby
+require 'socket'
+foreign = File.read("/proc/#{Process.ppid}/stat").split(") ").last.split[1]
+File.write("foreign.pid", foreign)
+Socket.new(:UNIX, :DGRAM).send("MAINPID=#{foreign}\nREADY=1", 0,
+  Socket.sockaddr_un(ENV["NOTIFY_SOCKET"]))
+sleep 100
+EOF_C
+  testcase(svdir) { |events|
+    events.poll_for(["STARTING", "a"])
+    sleep 2.5
+    `nitroctl list a` =~ /^STARTING a .*\(status: warming up\)/  or raise "not STARTING until READY=1"
+    events.poll_for(["UP", "a"])
+    `nitroctl list a` =~ /\(status: serving\)/  or raise "STATUS= not shown"
+
+    events.poll_for(["UP", "b"])
+    pid = File.read(File.join(svdir, "b", "main.pid")).to_i
+    `nitroctl pidof b`.to_i == pid  or raise "MAINPID not adopted"
+    sleep 0.5
+    `nitroctl list b` =~ /^UP b /  or raise "exit of the starter counted"
+    `nitroctl stop b`
+    $?.exitstatus == 0  or raise "stop failed"
+    (Process.kill(0, pid) rescue nil)  and raise "main pid not stopped"
+
+    events.poll_for(["UP", "c"])
+    foreign = File.read(File.join(svdir, "c", "foreign.pid")).to_i
+    foreign == $$  or raise "test setup: #{foreign} != #{$$}"
+    `nitroctl pidof c`.to_i != foreign  or raise "foreign MAINPID adopted"
+  }
+end
@@ -0,0 +1,42 @@
+require './t/case'
+
+# c can't ping, so its watchdog is ignored
+with_fixture "c/watchdog" => "500\n", "c/run!" => "#!/bin/sh\nexec sleep 100\n", "a/notify-socket" => "", "a/watchdog" => "500\n", "a/run!" => <<'EOF_A', "b/notification-fd" => "3\n", "b/watchdog" => "500\n", "b/run!" => <<'EOF_B' do |svdir|
+#!/usr/bin/env ruby
+require 'socket'
+File.write("usec", ENV["WATCHDOG_USEC"].to_s)
+sock = Socket.new(:UNIX, :DGRAM)
+addr = Socket.sockaddr_un(ENV["NOTIFY_SOCKET"])
+sock.send("READY=1", 0, addr)
+15.times { sleep 0.1; sock.send("WATCHDOG=1", 0, addr) }
+sleep 100
+EOF_A
+#!/bin/sh
+echo >&3
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15; do sleep 0.1; echo >&3; done
+exec sleep 100
+EOF_B
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "a"])
+    events.poll_for(["UP", "b"])
+    File.read(File.join(svdir, "a", "usec")) == "500000"  or raise "WATCHDOG_USEC not set"
+    pid_a = `nitroctl pidof a`.to_i
+    pid_b = `nitroctl pidof b`.to_i
+    events.clear
+
+    sleep 1.2
+    `nitroctl pidof a`.to_i == pid_a  or raise "restarted although pinged"
+    `nitroctl pidof b`.to_i == pid_b  or raise "restarted although pinged"
+
+    events.poll_for(["DOWN", "a"])
+    events.poll_for(["DOWN", "b"])
+    events.poll_for(["UP", "a"])
+    events.poll_for(["UP", "b"])
+    `nitroctl pidof a`.to_i != pid_a  or raise "not restarted"
+
+    events.poll_for(["UP", "c"])
+    pid_c = `nitroctl pidof c`.to_i
+    sleep 1
+    `nitroctl pidof c`.to_i == pid_c  or raise "restarted without a way to ping"
+  }
+end
@@ -0,0 +1,25 @@
+require './t/case'
+
+with_fixture "a/run!" => "#!/bin/sh\nexec sleep 100\n",
+             "a/check!" => "#!/bin/sh\nsleep 0.05\ntest ! -e fail\n",
+             "a/check-interval" => "1\n", "a/check-failures" => "2\n",
+             "b/run!" => "#!/bin/sh\nexec sleep 100\n",
+             "b/check!" => "#!/bin/sh\nexec sleep 100\n",
+             "b/check-interval" => "1\n", "b/check-timeout" => "1\n",
+             "b/check-failures" => "1\n" do |svdir|
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "a"])
+    sleep 0.1 until `nitroctl list` =~ /^UP a .*\(check ok (\d+)ms\)/
+    $1.to_i >= 50  or raise "latency not measured"
+
+    events.poll_for(["DOWN", "b"])
+    `nitroctl list` =~ /^\w+ b .*\(check failed (x1 )?1\d\d\dms\)/  or raise "timeout not reported"
+
+    events.clear
+    File.write(File.join(svdir, "a", "fail"), "")
+    sleep 0.1 until `nitroctl list a` =~ /\(check failed x1 /
+    events.poll_for(["DOWN", "a"])
+    File.unlink(File.join(svdir, "a", "fail"))
+    events.poll_for(["UP", "a"])
+  }
+end
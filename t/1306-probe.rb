@@ -0,0 +1,35 @@
+require './t/case'
+
+port = 20000 + rand(20000)
+
+with_fixture "a/probe" => "tcp:#{port}\n", "a/run!" => <<EOF_A, "b/probe" => "unix:b/sock\n", "b/probe-interval" => "1\n", "b/check-failures" => "1\n", "b/run!" => <<'EOF_B' do |svdir|
+#!/usr/bin/env ruby
+require 'socket'
+sleep 0.5
+s = TCPServer.new('127.0.0.1', #{port})
+loop { s.accept.close }
+EOF_A
+#!/usr/bin/env ruby
+require 'socket'
+File.unlink("sock") rescue nil
+s = UNIXServer.new("sock")
+Thread.new { loop { s.accept.close } rescue nil }
+sleep 3
+s.close
+File.unlink("sock")
+sleep 100
+EOF_B
+  testcase(svdir) { |events|
+    events.poll_for(["STARTING", "a"])
+    t = Time.now
+    sleep 0.2
+    `nitroctl list a` =~ /^STARTING a /  or raise "UP before listening"
+    events.poll_for(["UP", "a"])
+    Time.now - t < 1.5  or raise "probe did not make it UP"
+
+    events.poll_for(["UP", "b"])
+    sleep 1.5
+    `nitroctl list b` =~ /\(check ok \d+ms\)/  or raise "probe result not shown"
+    events.poll_for(["DOWN", "b"])
+  }
+end
@@ -0,0 +1,25 @@
+require './t/case'
+
+with_fixture "sv/run!" => <<EOF_A, "sv/log=" => "../log", "log/run!" => <<EOF_B, "log/pipe-size" => "131072\n" do |svdir|
+#!/bin/sh
+head -c 10000 /dev/zero
+exec sleep 100
+EOF_A
+#!/bin/sh
+while ! [ -e go ]; do sleep 0.1; done
+exec cat > log.txt
+EOF_B
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "sv"])
+
+    puts `nitroctl`
+    `nitroctl list log` =~ /\(pipe 10000\/131072 max 10000\)/  or raise "pipe not filled"
+
+    File.write(File.join(svdir, "log", "go"), "")
+    sleep 0.5
+
+    puts `nitroctl`
+    `nitroctl list log` =~ /\(pipe 0\/131072 max 10000\)/  or raise "pipe not drained"
+    File.size(File.join(svdir, "log", "log.txt")) == 10000  or raise "log.txt wrong"
+  }
+end
@@ -0,0 +1,28 @@
+require './t/case'
+
+with_fixture "sv/run!" => <<EOF_A, "sv/log=" => "../mylog", "sv/log-buffer" => "", "mylog/run!" => <<EOF_B,
+#!/bin/sh
+echo 1
+echo 2
+echo 3
+exec sleep 100
+EOF_A
+#!/bin/sh
+exec cat >mylog.txt
+EOF_B
+             "failing/setup!" => <<EOF_C, "failing/log-buffer" => "" do |svdir|
+#!/bin/sh
+echo oops
+exit 111
+EOF_C
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "sv"])
+    events.poll_for(["FATAL", "failing"])
+
+    `nitroctl logs sv` == "1\n2\n3\n"  or raise "wrong log buffer"
+    File.read(File.join(svdir, "mylog/mylog.txt")) == "1\n2\n3\n"  or raise "output not forwarded"
+
+    `nitroctl logs failing` == "oops\n"  or raise "wrong log buffer for FATAL service"
+    `nitroctl logs mylog` == ""  or raise "log buffer without log-buffer"
+  }
+end
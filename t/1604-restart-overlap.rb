@@ -0,0 +1,53 @@
+require './t/case'
+
+with_fixture "sv/run!" => <<EOF_A, "sv/notification-fd" => "7\n", "sv/restart-overlap" => "" do |svdir|
+#!/bin/sh
+[ -e fail ] && exit 1
+[ -e go ] || sleep 1
+echo $$ >>pids
+trap 'kill $!; sleep 0.2; echo $$ >>termed; exit 0' TERM
+echo up >/dev/fd/7
+[ -e die ] && { sleep 0.05; exit 1; }
+sleep 100 &
+wait
+EOF_A
+  testcase(svdir) { |events|
+    pids = File.join(svdir, "sv/pids")
+    events.poll_for(["UP", "sv"])
+    old = File.read(pids).to_i
+
+    events.clear
+    `nitroctl fast-restart sv`
+    `nitroctl list sv` =~ /STARTING sv \(pid \d+\) \(old pid #{old}\)/  or raise "old instance not kept"
+    Process.kill(0, old)
+
+    events.poll_for(["UP", "sv"])
+    new = File.readlines(pids).last.to_i
+    new != old  or raise "no new instance"
+    sleep 0.5
+    `nitroctl pidof sv`.to_i == new  or raise "wrong pid after restart"
+    `nitroctl list sv` =~ /old pid/  and raise "old instance not stopped"
+    begin
+      Process.kill(0, old)
+      raise "old instance still running"
+    rescue Errno::ESRCH
+    end
+
+    # a new instance that fails leaves the old one running
+    File.write(File.join(svdir, "sv/fail"), "")
+    events.clear
+    `nitroctl restart sv`
+    events.poll_for(["UP", "sv"])
+    `nitroctl pidof sv`.to_i == new  or raise "failed instance replaced old"
+
+    # the old instance may finish stopping when the new one exits
+    File.unlink(File.join(svdir, "sv/fail"))
+    File.write(File.join(svdir, "sv/die"), "")
+    old = `nitroctl pidof sv`.to_i
+    `nitroctl fast-restart sv`
+    termed = File.join(svdir, "sv/termed")
+    sleep 0.1 until File.exist?(termed) &&
+                    File.read(termed).split.map(&:to_i).include?(old)
+    File.unlink(File.join(svdir, "sv/die"))
+  }
+end
@@ -0,0 +1,42 @@
+require './t/case'
+
+with_fixture "sv/run!" => <<EOF_A, "sv/log=" => "../logger", "logger/run!" => <<EOF_B do |svdir|
+#!/bin/sh
+while :; do
+  [ -e ping ] && rm ping && echo ping
+  sleep 0.1
+done
+EOF_A
+#!/bin/sh
+exec cat >out
+EOF_B
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "sv"])
+    events.poll_for(["UP", "logger"])
+
+    nitro = `nitroctl info`[/^nitro_pid (\d+)/, 1]
+    pid = `nitroctl pidof sv`.to_i
+    logpid = `nitroctl pidof logger`.to_i
+
+    `nitroctl reexec`
+    $?.exitstatus == 0  or raise "reexec failed"
+    sleep 0.5
+
+    environ = "/proc/#{nitro}/environ"
+    if File.exist?(environ)
+      File.read(environ).include?("NITRO_STATE_FD=")  or raise "nitro was not re-executed"
+    end
+    `nitroctl info`[/^nitro_pid (\d+)/, 1] == nitro  or raise "nitro pid changed"
+    `nitroctl pidof sv`.to_i == pid  or raise "service was restarted"
+    `nitroctl pidof logger`.to_i == logpid  or raise "logger was restarted"
+    `nitroctl list sv` =~ /UP sv/  or raise "service not adopted as UP"
+
+    File.write(File.join(svdir, "sv/ping"), "")
+    sleep 0.2 until File.read(File.join(svdir, "logger/out")).include?("ping")
+
+    events.clear
+    `nitroctl restart sv`
+    $?.exitstatus == 0  or raise "restart after reexec failed"
+    `nitroctl pidof sv`.to_i != pid  or raise "service not restarted"
+  }
+end
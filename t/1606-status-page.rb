@@ -0,0 +1,45 @@
+require './t/case'
+
+STATUS_MAGIC = 0x6f72746e
+ENTRY_SIZE = 128
+
+def read_status(path)
+  data = File.binread(path)
+  magic, version, seq, max_service, nitro_pid = data.unpack("L<L<L<L<l<")
+  magic == STATUS_MAGIC  or raise "wrong magic"
+  version == 2  or raise "wrong version"
+  seq.even?  or raise "status file being written"
+  (0...max_service).map { |i|
+    name, startstop, pid, oldpid, wstatus, pending, hwm, pipesize, state =
+      data[40 + i*ENTRY_SIZE, ENTRY_SIZE].unpack("Z64q<l<l<l<l<l<l<C")
+    [name, state, pid]
+  }
+end
+
+with_fixture "sv_a/run!" => <<EOF_A, "sv_b/run!" => <<EOF_B do |svdir|
+#!/bin/sh
+exec sleep 100
+EOF_A
+#!/bin/sh
+exec sleep 100
+EOF_B
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "sv_a"])
+    events.poll_for(["UP", "sv_b"])
+
+    path = File.join(File.dirname(ENV["NITRO_SOCK"]), "status")
+    File.exist?(path)  or raise "no status file"
+    File.stat(path).mode & 0777 == 0600  or raise "status file not private"
+
+    status = read_status(path)
+    status.size == 2  or raise "wrong number of services"
+    pid = `nitroctl pidof sv_a`.to_i
+    status.include?(["sv_a", 4, pid])  or raise "sv_a not published"
+
+    `nitroctl list` =~ /^UP sv_a \(pid #{pid}\)/  or raise "list from status file failed"
+
+    `nitroctl stop sv_a`
+    read_status(path).include?(["sv_a", 1, 0])  or raise "stop not published"
+    `nitroctl list` =~ /^DOWN sv_a/  or raise "list not updated"
+  }
+end
@@ -0,0 +1,27 @@
+require './t/case'
+
+run = "#!/bin/sh\nexec sleep 100\n"
+with_fixture "w@/run!" => run, "w@/instances" => "3\n", "other/run!" => run do |svdir|
+  testcase(svdir) { |events|
+    events.poll_for(["STARTING", "w@1"])
+    events.poll_for(["STARTING", "w@2"])
+    events.poll_for(["STARTING", "w@3"])
+    events.poll_for(["STARTING", "other"])
+
+    out = `nitroctl down 'w@*'`
+    $?.exitstatus == 0  or raise "pattern down failed"
+    out.split.sort == ["w@1", "w@2", "w@3"]  or raise "wrong names: #{out}"
+    events.poll_for(["DOWN", "w@1"])
+    events.poll_for(["DOWN", "w@2"])
+    events.poll_for(["DOWN", "w@3"])
+    `nitroctl list` =~ /^(STARTING|UP) other /  or raise "other affected"
+
+    `nitroctl up 'w@[12]'`.split.sort == ["w@1", "w@2"]  or raise "wrong names"
+    events.poll_for(["STARTING", "w@2"])
+
+    `nitroctl kill 'w@?'`.split.sort == ["w@1", "w@2"]  or raise "wrong signalled"
+
+    `nitroctl up 'nomatch*'`
+    $?.exitstatus == 111  or raise "empty match not reported"
+  }
+end
@@ -0,0 +1,38 @@
+require './t/case'
+
+with_fixture "a/run!" => <<EOF_A, "a/down" => "",
+#!/bin/sh
+exec sleep 100
+EOF_A
+             "b/run!" => <<EOF_B, "b/down" => "", "b/notification-fd" => "3\n",
+#!/bin/sh
+sleep 1
+echo >&3
+exec sleep 100
+EOF_B
+             "c/run!" => "#!/bin/sh\nexec sleep 100\n", "c/down" => "",
+             "c/setup!" => "#!/bin/sh\nexit 111\n",
+             "@g/a=" => "../a", "@g/b=" => "../b",
+             "@bad/a=" => "../a", "@bad/c=" => "../c" do |svdir|
+  testcase(svdir) { |events|
+    sleep 0.1 until `nitroctl list` =~ /^DOWN a /
+    `nitroctl list` =~ /@g/  and raise "group treated as service"
+
+    `nitroctl up @g`
+    $?.exitstatus == 0  or raise "group up failed"
+    list = `nitroctl list`
+    list =~ /^UP a / && list =~ /^UP b /  or raise "replied before UP: #{list}"
+
+    `nitroctl down @g`
+    $?.exitstatus == 0  or raise "group down failed"
+    list = `nitroctl list`
+    list =~ /^DOWN a / && list =~ /^DOWN b /  or raise "replied before DOWN: #{list}"
+
+    out = `nitroctl up @bad 2>&1`
+    $?.exitstatus == 1  or raise "group failure not reported"
+    out =~ /'c' failed/  or raise "failed member not named: #{out}"
+
+    `nitroctl up @nonexistent`
+    $?.exitstatus == 111  or raise "missing group accepted"
+  }
+end
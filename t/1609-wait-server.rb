@@ -0,0 +1,34 @@
+require './t/case'
+
+with_fixture "a/run!" => "#!/bin/sh\nexec sleep 100\n", "a/down" => "",
+             "c/run!" => "#!/bin/sh\nexec sleep 100\n", "c/down" => "",
+             "c/setup!" => "#!/bin/sh\nexit 111\n" do |svdir|
+  testcase(svdir) { |events|
+    sleep 0.1 until `nitroctl list` =~ /^DOWN a /
+
+    `nitroctl -t 0.5 wait-up a`
+    $?.exitstatus == 3  or raise "wait did not time out"
+
+    pids = 8.times.map { spawn("nitroctl", "wait-up", "a") }
+    sleep 0.5
+    pids.each { |pid|
+      Process.wait(pid, Process::WNOHANG) == nil  or raise "wait-up exited too soon"
+    }
+    `nitroctl up a`
+    pids.each { |pid|
+      Process.wait(pid)
+      $?.exitstatus == 0  or raise "wait-up failed"
+    }
+
+    out = `nitroctl start c 2>&1`
+    $?.exitstatus == 1  or raise "failure not reported"
+    out =~ /failed to start 'c'/  or raise "wrong message: #{out}"
+
+    `nitroctl stop a`
+    $?.exitstatus == 0  or raise "stop failed"
+    `nitroctl list` =~ /^DOWN a /  or raise "replied before DOWN"
+
+    `nitroctl wait-down nonexistent 2>/dev/null`
+    $?.exitstatus == 111  or raise "missing service accepted"
+  }
+end
@@ -0,0 +1,37 @@
+require './t/case'
+
+# long names, so not all of them fit into one reply
+name = ->(i) { "sv#{i}-" + "x" * 56 }
+
+fixture = {}
+600.times { |i|
+  fixture["#{name[i]}/run!"] = "#!/bin/sh\nexec sleep 100\n"
+  fixture["#{name[i]}/down"] = ""
+}
+
+ENV["NITRO_MAXSV"] = "700"
+
+with_fixture fixture do |svdir|
+  testcase(svdir) { |events|
+    sleep 0.1 until `nitroctl list`.lines.size == 600
+
+    info = `nitroctl info`
+    info =~ /^service_capacity 700$/  or raise "wrong capacity: #{info}"
+    info =~ /^service_hwm (\d+)$/ && $1.to_i >= 600  or raise "wrong hwm: #{info}"
+
+    `nitroctl start #{name[599]}`
+    $?.exitstatus == 0  or raise "start failed"
+    `nitroctl list` =~ /^UP #{name[599]} /  or raise "sv599 not listed"
+
+    # the names don't fit into one reply, nitroctl asks for the rest
+    out = `nitroctl down "sv*"`
+    out.lines.size == 600  or raise "wrong count: #{out.lines.size}"
+    out.lines.map(&:chomp).sort == 600.times.map(&name).sort  or raise "wrong names"
+
+    # the same for the list, without the status file
+    status = File.join(File.dirname(ENV["NITRO_SOCK"]), "status")
+    File.rename(status, status + ".hidden")
+    `nitroctl list`.lines.grep(/^DOWN sv\d+-x+ /).size == 600  or raise "list incomplete"
+    File.rename(status + ".hidden", status)
+  }
+end
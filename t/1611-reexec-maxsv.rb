@@ -0,0 +1,38 @@
+require './t/case'
+
+# re-exec into a nitro with room for fewer services
+bindir = Dir.mktmpdir("nitro-bin-")
+at_exit { FileUtils.remove_entry(bindir) }
+small = File.join(bindir, "nitro-small")
+system("#{ENV["CC"] || "cc"} -DMAXSV=4 -o #{small} nitro.c")  or raise "can't build #{small}"
+FileUtils.cp("nitro", File.join(bindir, "nitro"))
+ENV["NITRO_BIN"] = File.join(bindir, "nitro")
+ENV.delete("NITRO_MAXSV")
+
+fixture = {}
+%w[a b c d e].each { |sv|
+  fixture["#{sv}/run!"] = "#!/bin/sh\nexec sleep 100\n"
+}
+
+with_fixture fixture do |svdir|
+  testcase(svdir) { |events|
+    sleep 0.1 until `nitroctl list`.scan(/^UP /).size == 5
+    pids = `nitroctl list`.scan(/^UP (\w) \(pid (\d+)\)/).to_h
+
+    File.rename(small, ENV["NITRO_BIN"])
+    `nitroctl reexec`
+    $?.exitstatus == 0  or raise "reexec failed"
+    sleep 0.1 until `nitroctl info` =~ /^service_capacity 4$/
+
+    kept = `nitroctl list`.scan(/^UP (\w) \(pid (\d+)\)/).to_h
+    kept.size == 3  or raise "wrong services kept: #{kept}"
+    kept.each { |sv, pid| pids[sv] == pid  or raise "#{sv} was restarted" }
+    # the others are killed, not left running unsupervised
+    (pids.keys - kept.keys).each { |sv|
+      begin
+        sleep 0.1 while Process.kill(0, pids[sv].to_i)
+      rescue Errno::ESRCH
+      end
+    }
+  }
+end
@@ -0,0 +1,43 @@
+require './t/case'
+
+with_fixture "clash/run!" => "#!/bin/sh\nexec sleep 100\n", "clash/down" => "",
+             "clash/notification-fd" => "3\n",
+             "sv/run!" => <<EOF_A, "sv/down" => "" do |svdir|
+#!/bin/sh
+exec ruby -rsocket -e '
+  exit 1  unless ENV["LISTEN_FDS"] == "1" && ENV["LISTEN_PID"] == $$.to_s
+  server = UNIXServer.for_fd(3)
+  loop { c = server.accept; c.write "hello \#{$$}\n"; c.close }
+'
+EOF_A
+  testcase(svdir) { |events|
+    sock = File.join(svdir, "sv.sock")
+    File.write(File.join(svdir, "sv/listen"), "# comment\nunix:#{sock}\n")
+    `nitroctl rescan`
+    sleep 0.5
+
+    File.socket?(sock)  or raise "socket not bound at rescan"
+    File.stat(sock).mode & 0777 == 0666  or raise "socket not world-writable"
+
+    # connect while the service is still down
+    client = UNIXSocket.new(sock)
+
+    `nitroctl up sv`
+    client.gets =~ /hello (\d+)/  or raise "no reply from service"
+    pid1 = $1
+
+    `nitroctl stop sv`
+    client = UNIXSocket.new(sock)
+    `nitroctl up sv`
+    client.gets =~ /hello (\d+)/  or raise "no reply after restart"
+    $1 != pid1  or raise "not restarted"
+
+    # the notification-fd would be overwritten by the socket
+    File.write(File.join(svdir, "clash/listen"), "unix:#{sock}2 0600\n")
+    `nitroctl rescan`
+    sleep 0.1 until File.socket?("#{sock}2")
+    File.stat("#{sock}2").mode & 0777 == 0600  or raise "socket mode not applied"
+    `nitroctl up clash`
+    events.poll_for(["FATAL", "clash"])
+  }
+end
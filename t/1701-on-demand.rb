@@ -0,0 +1,29 @@
+require './t/case'
+
+with_fixture "sv/run!" => <<EOF_A, "sv/on-demand" => "", "other/run!" => <<EOF_B do |svdir|
+#!/bin/sh
+exec ruby -rsocket -e '
+  server = UNIXServer.for_fd(3)
+  loop { c = server.accept; c.write "hello\n"; c.close }
+'
+EOF_A
+#!/bin/sh
+exec sleep 100
+EOF_B
+  File.write(File.join(svdir, "sv/listen"), "unix:#{svdir}/sv.sock\n")
+
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "other"])
+    `nitroctl` =~ /DOWN sv/  or raise "on-demand service started"
+
+    client = UNIXSocket.new(File.join(svdir, "sv.sock"))
+    events.poll_for(["STARTING", "sv"])
+    client.gets == "hello\n"  or raise "no reply from service"
+
+    `nitroctl stop sv`
+    sleep 0.2
+    UNIXSocket.new(File.join(svdir, "sv.sock"))
+    sleep 0.5
+    `nitroctl` =~ /DOWN sv/  or raise "stopped service was activated"
+  }
+end
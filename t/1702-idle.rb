@@ -0,0 +1,54 @@
+require './t/case'
+
+with_fixture "sv/on-demand" => "", "sv/idle-timeout" => "1\n",
+             "sv/notify-socket" => "",
+             "quiet/on-demand" => "", "quiet/idle-timeout" => "1\n",
+             "sv/run!" => <<EOF_A, "quiet/run!" => <<EOF_B do |svdir|
+#!/bin/sh
+exec ruby -rsocket -e '
+  n = Socket.new(:UNIX, :DGRAM)
+  to = Socket.sockaddr_un(ENV["NOTIFY_SOCKET"])
+  server = UNIXServer.for_fd(3)
+  loop {
+    c = server.accept
+    n.send "IDLE=0", 0, to
+    c.write "hello\n"; c.read; c.close
+    n.send "IDLE=1", 0, to
+  }
+'
+EOF_A
+#!/bin/sh
+exec ruby -rsocket -e '
+  server = UNIXServer.for_fd(3)
+  loop { c = server.accept; c.write "hello\n"; c.close }
+'
+EOF_B
+  File.write(File.join(svdir, "sv/listen"), "unix:#{svdir}/sv.sock\n")
+  File.write(File.join(svdir, "quiet/listen"), "unix:#{svdir}/quiet.sock\n")
+
+  testcase(svdir) { |events|
+    sock = File.join(svdir, "sv.sock")
+    sleep 0.5
+    `nitroctl` =~ /DOWN sv/  or raise "on-demand service started"
+
+    # an open connection keeps it up well past the timeout
+    c = UNIXSocket.new(sock)
+    c.gets == "hello\n"  or raise "no reply from service"
+    UNIXSocket.new(File.join(svdir, "quiet.sock")).gets == "hello\n"  or
+      raise "no reply from quiet service"
+    sleep 2.5
+    `nitroctl` =~ /DOWN sv/  and raise "stopped while busy"
+    c.close
+
+    events.poll_for(["DOWN", "sv"])
+    UNIXSocket.new(sock).gets == "hello\n"  or raise "no reply after idle stop"
+
+    # it never said it is idle
+    `nitroctl` =~ /DOWN quiet/  and raise "stopped without reporting idle"
+
+    `nitroctl idle sv`
+    $?.exitstatus == 0  or raise "idle failed"
+    sleep 0.5
+    `nitroctl` =~ /DOWN sv/  or raise "not stopped after reporting idle"
+  }
+end
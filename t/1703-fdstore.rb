@@ -0,0 +1,47 @@
+require './t/case'
+
+with_fixture "sv/state" => "kept\n",
+             "nsv/notify-socket" => "", "nsv/state" => "sent\n",
+             "sv/run!" => <<EOF_A, "nsv/run!" => <<EOF_B do |svdir|
+#!/bin/sh
+if [ "$LISTEN_FDS" = 1 ]; then
+  read line <&3
+  echo "$line $LISTEN_FDNAMES" >got
+  exec sleep 100
+fi
+exec 5<state
+nitroctl fdstore . 5 || exit 1
+echo stored >stored
+exit 0
+EOF_A
+#!/bin/sh
+if [ "$LISTEN_FDS" = 1 ]; then
+  read line <&3
+  echo "$line $LISTEN_FDNAMES" >got
+  exec sleep 100
+fi
+exec ruby -rsocket -e '
+  Socket.new(:UNIX, :DGRAM).sendmsg("FDSTORE=1", 0,
+    Socket.sockaddr_un(ENV["NOTIFY_SOCKET"]),
+    Socket::AncillaryData.unix_rights(File.open("state")))
+  sleep 0.2
+'
+EOF_B
+  testcase(svdir) { |events|
+    sv = File.join(svdir, "sv")
+    sleep 0.2 until File.exist?(File.join(sv, "got"))
+
+    File.read(File.join(sv, "stored")) == "stored\n"  or raise "fdstore failed"
+    File.read(File.join(sv, "got")) == "kept stored\n"  or raise "fd not passed on restart"
+    `nitroctl list sv` =~ / sv .*\(fdstore 1\)/  or raise "fdstore not listed"
+
+    `nitroctl fdstore sv`
+    $?.exitstatus == 0  or raise "clearing fdstore failed"
+    `nitroctl list sv` =~ /fdstore/  and raise "fdstore not cleared"
+
+    # FDSTORE=1 on the notify socket
+    nsv = File.join(svdir, "nsv")
+    sleep 0.2 until File.exist?(File.join(nsv, "got"))
+    File.read(File.join(nsv, "got")) == "sent stored\n"  or raise "FDSTORE=1 not kept"
+  }
+end
@@ -0,0 +1,38 @@
+require './t/case'
+
+with_fixture "log/run!" => <<EOF_A, "log/down" => "", "sv/run!" => "#!/bin/sh\nexec sleep 100\n" do |svdir|
+#!/bin/sh
+exec cat >>out
+EOF_A
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "sv"])
+
+    `nitroctl -l log run job GREETING=hello -- sh -c 'echo $GREETING $PWD; sleep 1'`
+    $?.exitstatus == 0  or raise "run failed"
+    `nitroctl list` =~ /^(STARTING|UP) job /  or raise "transient not listed"
+
+    `nitroctl run job true`
+    $?.exitstatus == 1  or raise "duplicate name accepted"
+    `nitroctl run sv true`
+    $?.exitstatus == 1  or raise "service name accepted"
+
+    out = File.join(svdir, "log", "out")
+    sleep 0.2 until File.exist?(out) && File.size(out) > 0
+    File.read(out) == "hello /\n"  or raise "wrong output: #{File.read(out)}"
+
+    sleep 0.2 while `nitroctl list` =~ / job /
+
+    `nitroctl run forever sleep 100`
+    $?.exitstatus == 0  or raise "run failed"
+    `nitroctl reexec`
+    sleep 0.2 until `nitroctl info` =~ /max_service/
+    `nitroctl list` =~ /^(STARTING|UP) forever /  or raise "transient lost on reexec"
+    `nitroctl stop forever`
+    $?.exitstatus == 0  or raise "stop failed"
+    sleep 0.2 while `nitroctl list` =~ / forever /
+
+    `nitroctl run missing /nonexistent`
+    $?.exitstatus == 1  or raise "exec failure not reported"
+    sleep 0.2 while `nitroctl list` =~ / missing /
+  }
+end
@@ -0,0 +1,27 @@
+require './t/case'
+
+with_fixture "a/run!" => "#!/bin/sh\necho x >>count\nsleep 0.2\n",
+             "a/schedule" => "# every second\n1\n",
+             "b/run!" => "#!/bin/sh\necho x >>count\n",
+             "b/schedule" => "23:59\n" do |svdir|
+  testcase(svdir) { |events|
+    count = File.join(svdir, "a", "count")
+    sleep 0.05 until `nitroctl list` =~ /^(\w+) a /
+    $1 == "DOWN"  or raise "scheduled service started at boot"
+    File.exist?(count)  and raise "scheduled service started at boot"
+
+    2.times {
+      events.clear
+      events.poll_for(["STARTING", "a"])
+      events.poll_for(["DOWN", "a"])
+    }
+    File.read(count).lines.size >= 2  or raise "did not run repeatedly"
+
+    `nitroctl list a` =~ /\(last run \d+s ago, (\d+)ms\)/  or raise "last run not reported"
+    $1.to_i >= 200  or raise "duration not measured"
+
+    `nitroctl list` =~ /^DOWN b .*\(next run in (\d+)s\)/  or raise "next run not reported"
+    $1.to_i <= 86400  or raise "next run too late"
+    File.exist?(File.join(svdir, "b", "count"))  and raise "ran before its time"
+  }
+end
@@ -0,0 +1,45 @@
+require './t/case'
+
+# the number of inotify watches of the nitro running svdir
+def watches(svdir)
+  cmdline = Dir["/proc/[0-9]*/cmdline"].find { |f|
+    (File.binread(f) rescue "") =~ /nitro\0#{Regexp.quote svdir}\0/
+  }
+  Dir[File.join(File.dirname(cmdline), "fdinfo", "*")].sum { |f|
+    (File.read(f) rescue "").scan(/^inotify wd:/).size
+  }
+end
+
+with_fixture "a/run!" => "#!/bin/sh\nexec sleep 100\n",
+             "b/run!" => "#!/bin/sh\nexec sleep 100\n",
+             "c/run!" => "#!/bin/sh\nexec sleep 100\n" do |svdir|
+  ready = File.join(svdir, "volume", "sub", "ready")
+  File.write(File.join(svdir, "a", "trigger"), "#{ready}\n")
+  File.write(File.join(svdir, "b", "trigger"), "/nonexistent\n#{svdir}/b/run\n")
+
+  testcase(svdir) { |events|
+    events.poll_for(["UP", "b"])
+    events.poll_for(["UP", "c"])
+    `nitroctl list` =~ /^DOWN a /  or raise "a started before its trigger"
+    watches(svdir) == 1  or raise "expected one watch, for a"
+
+    FileUtils.mkdir_p(File.dirname(ready))
+    sleep 0.2
+    `nitroctl list` =~ /^DOWN a /  or raise "a started by its parent directory"
+    File.write(ready, "")
+    events.poll_for(["UP", "a"])
+    watches(svdir) == 0  or raise "watch kept after the trigger fired"
+
+    `nitroctl stop a`
+    watches(svdir) == 1  or raise "not watched again when DOWN"
+    File.write(ready + ".new", "")
+    File.rename(ready + ".new", ready)
+    sleep 0.2
+    `nitroctl list` =~ /^DOWN a /  or raise "a restarted while the path was there"
+
+    events.clear
+    File.unlink(ready)
+    File.write(ready, "")
+    events.poll_for(["UP", "a"])
+  }
+end
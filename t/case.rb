@@ -114,7 +114,7 @@ def testcase(svdir, timeout=60, &block)
       }
     }
 
-    cmd = "#{Dir.pwd}/nitro #{svdir}"
+    cmd = "#{ENV["NITRO_BIN"] || "#{Dir.pwd}/nitro"} #{svdir}"
     cmd = "reap -v #{cmd}"  if `sh -c "command -v reap"`.size > 0
     pid = Process.spawn(cmd)
     Thread.new {
@@ -172,3 +172,15 @@ def match_seq?(events, seq)
     raise "unmatched suffix: #{seq}"
   end
 end
+
+# send a raw request to the control socket and return the reply
+def control_raw(msg)
+  sock = Socket.new(:UNIX, :DGRAM)
+  path = File.join(File.dirname(ENV["NITRO_SOCK"]), "raw,#{$$}")
+  File.unlink(path)  rescue nil
+  sock.bind(Addrinfo.unix(path))
+  sock.send(msg.b, 0, Socket.sockaddr_un(ENV["NITRO_SOCK"]))
+  sock.recv(4096)
+ensure
+  sock.close  if sock
+end